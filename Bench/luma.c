@@ -0,0 +1,112 @@
+// Times the depth to luma conversion of an 848x480 frame: the per-pixel loop
+// that encodeFrame used before luma.c, each engine with the default mapping,
+// and the LUT with a gamma of 0.5. Every engine's output for the default
+// mapping must match the old loop byte for byte, including the scalar tails of
+// every width from 0 to 40. Exits with EXIT_FAILURE if one doesn't.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "helper.h"
+#include "luma.h"
+
+#define WIDTH 848
+#define HEIGHT 480
+#define C_RUNS 100
+#define WIDTH_TAILS_MAX 40
+
+static const enum lumaEngine engines[] = {
+	LUMA_ENGINE_LUT,
+	LUMA_ENGINE_SSE2,
+	LUMA_ENGINE_AVX2,
+};
+static const char *engineNames[] = {"LUT", "SSE2", "AVX2"};
+#define C_ENGINES (sizeof(engines) / sizeof(*engines))
+
+// encodeFrame's conversion from before luma.c existed
+static void oldRow(const uint16_t *in, uint8_t *out, size_t width)
+{
+	uint16_t inputMax = 4000;
+	for (size_t x = 0; x < width; x++) {
+		uint16_t value = in[x];
+		value = value <= inputMax ? value : inputMax;
+		uint8_t small = (uint8_t) (value * ((float) UINT8_MAX / inputMax));
+		out[x] = (uint8_t) (UINT8_MAX - small);
+	}
+}
+
+// ms to convert the whole frame, one row at a time, averaged over C_RUNS
+static double timeFrame(const struct luma *luma, const uint16_t *in, uint8_t *out)
+{
+	double msStart = getMonotonicTimeInMs();
+	for (unsigned int iRun = 0; iRun < C_RUNS; iRun++) {
+		for (size_t y = 0; y < HEIGHT; y++) {
+			if (luma) {
+				lumaConvertRow(luma, in + y * WIDTH, out + y * WIDTH, WIDTH);
+			} else {
+				oldRow(in + y * WIDTH, out + y * WIDTH, WIDTH);
+			}
+		}
+	}
+	return (getMonotonicTimeInMs() - msStart) / C_RUNS;
+}
+
+int main()
+{
+	size_t cPixels = WIDTH * HEIGHT;
+	uint16_t *in = malloc(cPixels * sizeof(uint16_t));
+	uint8_t *expected = malloc(cPixels);
+	uint8_t *out = malloc(cPixels);
+	if (!in || !expected || !out) {
+		return EXIT_FAILURE;
+	}
+
+	// depths from 0 to 8191, so that some are clipped
+	uint64_t state = 1;
+	for (size_t ii = 0; ii < cPixels; ii++) {
+		// xorshift64
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		in[ii] = (uint16_t) (state & 0x1FFF);
+	}
+
+	printf("%ux%u, ms per frame, average of %u runs\n", WIDTH, HEIGHT, C_RUNS);
+	printf("%-20s %8.3f\n", "old loop", timeFrame(NULL, in, expected));
+
+	bool success = true;
+	struct luma *luma = lumaInit(LUMA_MAPPING_DEFAULT);
+	for (unsigned int iEngine = 0; iEngine < C_ENGINES; iEngine++) {
+		if (lumaSetEngine(luma, engines[iEngine])) {
+			printf("%-20s %8s\n", engineNames[iEngine], "-");
+			continue;
+		}
+		double ms = timeFrame(luma, in, out);
+
+		bool same = !memcmp(out, expected, cPixels);
+		for (size_t width = 0; width <= WIDTH_TAILS_MAX; width++) {
+			uint8_t tailOld[WIDTH_TAILS_MAX];
+			uint8_t tailNew[WIDTH_TAILS_MAX];
+			oldRow(in, tailOld, width);
+			lumaConvertRow(luma, in, tailNew, width);
+			same = same && !memcmp(tailOld, tailNew, width);
+		}
+		success = success && same;
+		printf("%-20s %8.3f%s\n", engineNames[iEngine], ms, same ? "" : " WRONG");
+	}
+	lumaDestroy(luma);
+
+	struct lumaMapping mapping = LUMA_MAPPING_DEFAULT;
+	mapping.gamma = 0.5;
+	luma = lumaInit(mapping);
+	printf("%-20s %8.3f\n", "LUT, gamma 0.5", timeFrame(luma, in, out));
+	lumaDestroy(luma);
+
+	free(in);
+	free(expected);
+	free(out);
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,98 @@
+// Times medianCompute with every engine that this CPU supports, on random
+// frames, and checks that each engine's output matches the scalar insertion
+// sort's exactly. Exits with EXIT_FAILURE if one doesn't.
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "helper.h"
+#include "median.h"
+
+#define WIDTH 640
+#define HEIGHT 480
+#define C_RUNS 20
+#define C_FRAMES_MAX 11
+
+// 3 to 9 have sorting networks, 11 falls back to the insertion sort
+static const unsigned int cFramesTested[] = {3, 5, 7, 9, 11};
+
+static const enum medianEngine engines[] = {
+	MEDIAN_ENGINE_SCALAR,
+	MEDIAN_ENGINE_SSE2,
+	MEDIAN_ENGINE_AVX2,
+};
+#define C_ENGINES (sizeof(engines) / sizeof(*engines))
+
+int main()
+{
+	size_t cPixels = WIDTH * HEIGHT;
+
+	uint16_t *frames[C_FRAMES_MAX];
+	uint64_t state = 1;
+	for (unsigned int iFrame = 0; iFrame < C_FRAMES_MAX; iFrame++) {
+		frames[iFrame] = malloc(cPixels * sizeof(uint16_t));
+		if (!frames[iFrame]) {
+			return EXIT_FAILURE;
+		}
+		for (size_t ii = 0; ii < cPixels; ii++) {
+			// xorshift64
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			frames[iFrame][ii] = (uint16_t) state;
+		}
+	}
+	uint16_t *expected = malloc(cPixels * sizeof(uint16_t));
+	uint16_t *out = malloc(cPixels * sizeof(uint16_t));
+	if (!expected || !out) {
+		return EXIT_FAILURE;
+	}
+
+	medianInit();
+	printf("%ux%u, ms per frame, average of %u runs\n", WIDTH, HEIGHT, C_RUNS);
+	printf("%-8s", "frames");
+	for (unsigned int iEngine = 0; iEngine < C_ENGINES; iEngine++) {
+		printf("%10s", medianEngineName(engines[iEngine]));
+	}
+	puts("");
+
+	bool success = true;
+	for (unsigned int iTest = 0; iTest < sizeof(cFramesTested) / sizeof(*cFramesTested); iTest++) {
+		unsigned int cFrames = cFramesTested[iTest];
+		assert(!medianSetEngine(MEDIAN_ENGINE_SCALAR));
+		medianCompute((const uint16_t **) frames, cFrames, cPixels, expected);
+
+		printf("%-8u", cFrames);
+		for (unsigned int iEngine = 0; iEngine < C_ENGINES; iEngine++) {
+			if (medianSetEngine(engines[iEngine])) {
+				printf("%10s", "-");
+				continue;
+			}
+
+			double msStart = getMonotonicTimeInMs();
+			for (unsigned int iRun = 0; iRun < C_RUNS; iRun++) {
+				medianCompute((const uint16_t **) frames, cFrames, cPixels, out);
+			}
+			double ms = (getMonotonicTimeInMs() - msStart) / C_RUNS;
+
+			if (memcmp(out, expected, cPixels * sizeof(uint16_t))) {
+				printf("%10s", "WRONG");
+				success = false;
+			} else {
+				printf("%10.3f", ms);
+			}
+		}
+		puts("");
+	}
+
+	for (unsigned int iFrame = 0; iFrame < C_FRAMES_MAX; iFrame++) {
+		free(frames[iFrame]);
+	}
+	free(expected);
+	free(out);
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,85 @@
+// Replays synthetic recordings through the whole pipeline, one at a time, and
+// reports how fast each was processed and whether it counted the reps that
+// the recording holds. Exits with EXIT_FAILURE if any count is wrong.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "args.h"
+#include "camera.h"
+#include "filter.h"
+#include "helper.h"
+#include "pipeline.h"
+#include "state.h"
+#include "state_log.h"
+
+static const struct {
+	char *file;
+	unsigned int cReps;
+	// how long the recording lasts: 2 * idle + reps * period
+	double seconds;
+} sources[] = {
+	{"synthetic:", 10, 35},
+	{"synthetic:seed=2,noise=8", 10, 35},
+	{"synthetic:holes=0.05", 10, 35},
+	{"synthetic:reps=15,period=1.25", 15, 38.75},
+};
+
+struct result {
+	unsigned int cReps;
+	double msElapsed;
+};
+
+static bool replay(char *file, struct repLog *log, struct result *result)
+{
+	struct args args = {
+		.write = false,
+		.file = file,
+		.replay = true,
+		.ccamera_sample_size = 5,
+		.ccamera_sample_delta = 4,
+		.ccamera_threads = 1,
+		.ccamera_filters = FILTER_CHAIN_DEFAULT,
+	};
+
+	double msStart = getMonotonicTimeInMs();
+	struct pipeline *pipeline = pipelineInit(args, log, file, NULL);
+	if (!pipeline) {
+		return false;
+	}
+	int ret = stateRun(pipeline);
+	result->cReps = pipeline->cReps;
+	int fail = pipelineDestroy(pipeline);
+	result->msElapsed = getMonotonicTimeInMs() - msStart;
+	return !ret && !fail;
+}
+
+int main()
+{
+	// the sets themselves aren't of interest, only their totals
+	struct repLog *log = repLogInit("/dev/null");
+
+	bool success = true;
+	struct result results[sizeof(sources) / sizeof(*sources)];
+	for (unsigned int ii = 0; ii < sizeof(sources) / sizeof(*sources); ii++) {
+		if (!replay(sources[ii].file, log, &results[ii])) {
+			printf("%s: could not be replayed\n", sources[ii].file);
+			return EXIT_FAILURE;
+		}
+		success = success && results[ii].cReps == sources[ii].cReps;
+	}
+	repLogDestroy(log);
+
+	// after all the replays, so that their output doesn't bury it
+	puts("");
+	printf("%-32s %8s %8s %10s %10s\n", "source", "reps", "of", "frames/s", "x realtime");
+	for (unsigned int ii = 0; ii < sizeof(sources) / sizeof(*sources); ii++) {
+		double sElapsed = results[ii].msElapsed / 1000;
+		printf("%-32s %8u %8u %10.0f %10.1f%s\n", sources[ii].file, results[ii].cReps, sources[ii].cReps,
+			sources[ii].seconds * CAMERA_FPS / sElapsed, sources[ii].seconds / sElapsed,
+			results[ii].cReps == sources[ii].cReps ? "" : " WRONG");
+	}
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
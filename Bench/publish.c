@@ -0,0 +1,106 @@
+// Measures how well ccamera's lock free publishing holds up under contention.
+// ccamera reads the recording given as the only argument, or by default a
+// live synthetic camera that produces 640x480 frames as fast as ccamera can
+// denoise them. Meanwhile 1, 2 and then 4 reader threads fetch frame pairs with
+// ccameraAcquireFrames in a tight loop. Prints the pairs per second that the
+// readers got, and the frames per second that the background thread still
+// published meanwhile.
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "args.h"
+#include "ccamera.h"
+#include "filter.h"
+#include "helper.h"
+
+// how long each reader count runs for
+#define MS_RUN 3000
+#define C_READERS_MAX 4
+
+static const unsigned int cReadersTested[] = {1, 2, 4};
+
+struct reader {
+	struct ccamera *cam;
+	bool *stop;
+	pthread_t thread;
+	unsigned long long cPairs;
+};
+
+static void *readerMain(void *arg)
+{
+	struct reader *reader = arg;
+	while (!__atomic_load_n(reader->stop, __ATOMIC_RELAXED)) {
+		const struct ccameraFrame *fNew;
+		const struct ccameraFrame *fOld;
+		assert(!ccameraAcquireFrames(reader->cam, &fNew, &fOld));
+		ccameraRelease(fNew);
+		ccameraRelease(fOld);
+		reader->cPairs++;
+	}
+	return NULL;
+}
+
+// the sequence number of the latest published frame
+static unsigned long long getSeq(struct ccamera *cam)
+{
+	const struct ccameraFrame *frame = ccameraAcquireFrame(cam);
+	unsigned long long seq = frame->seq;
+	ccameraRelease(frame);
+	return seq;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 2) {
+		printf("USAGE: %s [/file/]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	struct args args = {
+		.write = false,
+		.file = argc == 2 ? argv[1] : "synthetic:width=640,height=480,fps=1000,idle=1000",
+		.ccamera_sample_size = 5,
+		.ccamera_sample_delta = 4,
+		.ccamera_threads = 1,
+		.ccamera_filters = FILTER_CHAIN_DEFAULT,
+	};
+	struct ccamera *cam = ccameraInit(args);
+	if (!cam) {
+		return EXIT_FAILURE;
+	}
+
+	printf("%-8s %14s %14s\n", "readers", "pairs/s", "published/s");
+	for (unsigned int iTest = 0; iTest < sizeof(cReadersTested) / sizeof(*cReadersTested); iTest++) {
+		unsigned int cReaders = cReadersTested[iTest];
+		bool stop = false;
+		struct reader readers[C_READERS_MAX];
+
+		unsigned long long seqStart = getSeq(cam);
+		double msStart = getMonotonicTimeInMs();
+		for (unsigned int ii = 0; ii < cReaders; ii++) {
+			readers[ii] = (struct reader) {.cam = cam, .stop = &stop, .cPairs = 0};
+			assert(!pthread_create(&readers[ii].thread, NULL, readerMain, &readers[ii]));
+		}
+
+		usleep(MS_RUN * 1000);
+		__atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+
+		unsigned long long cPairs = 0;
+		for (unsigned int ii = 0; ii < cReaders; ii++) {
+			assert(!pthread_join(readers[ii].thread, NULL));
+			cPairs += readers[ii].cPairs;
+		}
+		double sElapsed = (getMonotonicTimeInMs() - msStart) / 1000;
+		unsigned long long cFrames = getSeq(cam) - seqStart;
+
+		printf("%-8u %14.0f %14.1f\n", cReaders, (double) cPairs / sElapsed, (double) cFrames / sElapsed);
+	}
+
+	assert(!ccameraDestroy(cam));
+	return EXIT_SUCCESS;
+}
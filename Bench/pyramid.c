@@ -0,0 +1,245 @@
+// Checks pyramid.c against scalar references, then times the ways that
+// low-power has counted active pixels.
+//
+// The checks cover every width from 2 to 68 and height from 2 to 8 with random
+// frames, so that every combination of full vectors and scalar tails is hit.
+// pyramidHalve's output, and the counts from pyramidHalveAndCompare and
+// pyramidCountChanged, must all match. Exits with EXIT_FAILURE if any doesn't.
+//
+// The benchmark uses an 848x480 frame and reports the best of C_RUNS runs.
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ccamera.h"
+#include "helper.h"
+#include "pyramid.h"
+
+#define WIDTH ((size_t) 848)
+#define HEIGHT ((size_t) 480)
+#define C_RUNS 15
+
+static uint64_t state = 1;
+
+// xorshift64
+static uint16_t random16()
+{
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return (uint16_t) state;
+}
+
+// Fills `frame` with depths that are mostly random, but with plenty of zeros
+// and UINT16_MAXes, where the SIMD code could overflow
+static void fill(uint16_t *frame, size_t cPixels)
+{
+	for (size_t ii = 0; ii < cPixels; ii++) {
+		uint16_t r = random16();
+		switch (r % 8) {
+		case 0:
+			frame[ii] = 0;
+			break;
+		case 1:
+			frame[ii] = UINT16_MAX;
+			break;
+		default:
+			frame[ii] = random16();
+		}
+	}
+}
+
+// Fills `frame` with depths within 2 * threshold of `like`'s, so that
+// roughly half of them differ by more than `threshold`
+static void fillNear(uint16_t *frame, const uint16_t *like, size_t cPixels, uint16_t threshold)
+{
+	for (size_t ii = 0; ii < cPixels; ii++) {
+		int offset = (int) (random16() % (4 * threshold + 1)) - 2 * threshold;
+		int depth = like[ii] + offset;
+		depth = depth < 0 ? 0 : depth;
+		depth = depth > UINT16_MAX ? UINT16_MAX : depth;
+		frame[ii] = (uint16_t) depth;
+	}
+}
+
+static void referenceHalve(const uint16_t *in, size_t width, size_t height, uint16_t *out)
+{
+	size_t widthOut = width / 2;
+	for (size_t y = 0; y < height / 2; y++) {
+		const uint16_t *top = in + 2 * y * width;
+		const uint16_t *bottom = top + width;
+		for (size_t x = 0; x < widthOut; x++) {
+			int left = (top[2*x] + bottom[2*x] + 1) / 2;
+			int right = (top[2*x + 1] + bottom[2*x + 1] + 1) / 2;
+			out[y * widthOut + x] = (uint16_t) ((left + right + 1) / 2);
+		}
+	}
+}
+
+static size_t referenceCount(const uint16_t *a, const uint16_t *b, size_t cPixels, uint16_t threshold)
+{
+	size_t cChanged = 0;
+	for (size_t ii = 0; ii < cPixels; ii++) {
+		cChanged += abs((int) a[ii] - (int) b[ii]) > threshold;
+	}
+	return cChanged;
+}
+
+// Returns the number of sizes for which pyramid.c disagreed with the references
+static unsigned int check()
+{
+	static const uint16_t threshold = CCAMERA_ACTIVE_DEPTH;
+	unsigned int cWrong = 0;
+
+	for (size_t width = 2; width <= 68; width++) {
+		for (size_t height = 2; height <= 8; height++) {
+			size_t cPixels = width * height;
+			size_t cPixelsOut = (width / 2) * (height / 2);
+			uint16_t *in = malloc(cPixels * sizeof(uint16_t));
+			uint16_t *expected = malloc(cPixelsOut * sizeof(uint16_t));
+			uint16_t *out = malloc(cPixelsOut * sizeof(uint16_t));
+			uint16_t *previous = malloc(cPixelsOut * sizeof(uint16_t));
+			if (!in || !expected || !out || !previous) {
+				exit(EXIT_FAILURE);
+			}
+
+			fill(in, cPixels);
+			referenceHalve(in, width, height, expected);
+			fillNear(previous, expected, cPixelsOut, threshold);
+			size_t cExpected = referenceCount(expected, previous, cPixelsOut, threshold);
+
+			pyramidHalve(in, width, height, out);
+			bool right = !memcmp(out, expected, cPixelsOut * sizeof(uint16_t));
+
+			memset(out, 0, cPixelsOut * sizeof(uint16_t));
+			size_t cChanged = pyramidHalveAndCompare(in, width, height, out, previous, threshold);
+			right = right && !memcmp(out, expected, cPixelsOut * sizeof(uint16_t));
+			right = right && cChanged == cExpected;
+
+			// and count on the input frame too, which gives it more
+			// lengths than the halved frames do
+			uint16_t *near = malloc(cPixels * sizeof(uint16_t));
+			if (!near) {
+				exit(EXIT_FAILURE);
+			}
+			fillNear(near, in, cPixels, threshold);
+			cChanged = pyramidCountChanged(in, near, cPixels, threshold);
+			right = right && cChanged == referenceCount(in, near, cPixels, threshold);
+			free(near);
+
+			if (!right) {
+				printf("wrong at %zux%zu\n", width, height);
+				cWrong++;
+			}
+			free(in);
+			free(expected);
+			free(out);
+			free(previous);
+		}
+	}
+	return cWrong;
+}
+
+// the frames that the benchmarks work on, at each pyramid level
+struct frames {
+	uint16_t *levels[3];
+	uint16_t *previous[3];
+	// somewhere for the results to go, so they aren't optimized away
+	volatile size_t sink;
+};
+
+// what low-power did before the pyramid: full resolution, in floats
+static void fullResFloat(struct frames *f)
+{
+	float nActivePixels = 0;
+	for (size_t iPixel = 0; iPixel < WIDTH * HEIGHT; iPixel++) {
+		float activeness = fabsf((float) f->levels[0][iPixel] - (float) f->previous[0][iPixel]);
+		if (activeness > CCAMERA_ACTIVE_DEPTH) {
+			nActivePixels++;
+		}
+	}
+	f->sink = (size_t) nActivePixels;
+}
+
+// what low-power did on the smallest level before the count moved into ccamera
+static void levelInteger(struct frames *f)
+{
+	size_t cActivePixels = 0;
+	for (size_t iPixel = 0; iPixel < (WIDTH / 4) * (HEIGHT / 4); iPixel++) {
+		int activeness = abs((int) f->levels[2][iPixel] - (int) f->previous[2][iPixel]);
+		cActivePixels += activeness > CCAMERA_ACTIVE_DEPTH;
+	}
+	f->sink = cActivePixels;
+}
+
+static void levelSimd(struct frames *f)
+{
+	f->sink = pyramidCountChanged(f->levels[2], f->previous[2], (WIDTH / 4) * (HEIGHT / 4), CCAMERA_ACTIVE_DEPTH);
+}
+
+static void buildLevels(struct frames *f)
+{
+	pyramidHalve(f->levels[0], WIDTH, HEIGHT, f->levels[1]);
+	pyramidHalve(f->levels[1], WIDTH / 2, HEIGHT / 2, f->levels[2]);
+}
+
+static void buildLevelsFused(struct frames *f)
+{
+	pyramidHalve(f->levels[0], WIDTH, HEIGHT, f->levels[1]);
+	f->sink = pyramidHalveAndCompare(f->levels[1], WIDTH / 2, HEIGHT / 2, f->levels[2],
+		f->previous[2], CCAMERA_ACTIVE_DEPTH);
+}
+
+static const struct {
+	const char *name;
+	void (*run)(struct frames *f);
+} benches[] = {
+	{"full-res float loop", fullResFloat},
+	{"level 2 integer loop", levelInteger},
+	{"level 2 SIMD count", levelSimd},
+	{"both levels", buildLevels},
+	{"both levels, fused count", buildLevelsFused},
+};
+
+int main()
+{
+	unsigned int cWrong = check();
+	printf("checks: %s\n", cWrong ? "FAILED" : "passed");
+
+	struct frames f;
+	for (unsigned int iLevel = 0; iLevel < 3; iLevel++) {
+		size_t cPixels = (WIDTH >> iLevel) * (HEIGHT >> iLevel);
+		f.levels[iLevel] = malloc(cPixels * sizeof(uint16_t));
+		f.previous[iLevel] = malloc(cPixels * sizeof(uint16_t));
+		if (!f.levels[iLevel] || !f.previous[iLevel]) {
+			return EXIT_FAILURE;
+		}
+	}
+	fill(f.levels[0], WIDTH * HEIGHT);
+	fillNear(f.previous[0], f.levels[0], WIDTH * HEIGHT, CCAMERA_ACTIVE_DEPTH);
+	pyramidHalve(f.previous[0], WIDTH, HEIGHT, f.previous[1]);
+	pyramidHalve(f.previous[1], WIDTH / 2, HEIGHT / 2, f.previous[2]);
+	buildLevels(&f);
+
+	printf("%zux%zu, ms per frame, best of %u runs\n", WIDTH, HEIGHT, C_RUNS);
+	for (unsigned int iBench = 0; iBench < sizeof(benches) / sizeof(*benches); iBench++) {
+		double msBest = INFINITY;
+		for (unsigned int iRun = 0; iRun < C_RUNS; iRun++) {
+			double msStart = getMonotonicTimeInMs();
+			benches[iBench].run(&f);
+			double ms = getMonotonicTimeInMs() - msStart;
+			msBest = ms < msBest ? ms : msBest;
+		}
+		printf("%-28s %8.4f\n", benches[iBench].name, msBest);
+	}
+
+	for (unsigned int iLevel = 0; iLevel < 3; iLevel++) {
+		free(f.levels[iLevel]);
+		free(f.previous[iLevel]);
+	}
+	return cWrong ? EXIT_FAILURE : EXIT_SUCCESS;
+}
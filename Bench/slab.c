@@ -0,0 +1,122 @@
+// Compares the two layouts that ccamera can take its median from, with the
+// fastest engine that this CPU supports. Planar is medianCompute over one
+// pointer per frame. Slab stores each new frame into a medianSlab and then
+// takes the median from it, which is timed both together and without the
+// store. Exits with EXIT_FAILURE if the layouts' medians differ.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "helper.h"
+#include "median.h"
+
+#define C_RUNS 50
+#define C_FRAMES_MAX 11
+
+static const struct {
+	size_t width;
+	size_t height;
+} sizes[] = {
+	{848, 480},
+	{1280, 720},
+};
+
+// 5 is ccamera's default, 11 falls back to the insertion sort
+static const unsigned int cFramesTested[] = {5, 11};
+
+// ms per frame of each layout, averaged over C_RUNS. Returns false if the
+// layouts disagree.
+static bool compare(uint16_t **frames, unsigned int cFrames, size_t cPixels,
+	double *msPlanar, double *msSlab, double *msSlabMedian)
+{
+	uint16_t *planar = malloc(cPixels * sizeof(uint16_t));
+	uint16_t *slabbed = malloc(cPixels * sizeof(uint16_t));
+	struct medianSlab *slab = medianSlabInit(cFrames, cPixels);
+	if (!planar || !slabbed || !slab) {
+		exit(EXIT_FAILURE);
+	}
+
+	// each run adds the next frame and drops the oldest
+	double msStart = getMonotonicTimeInMs();
+	for (unsigned int iRun = 0; iRun < C_RUNS; iRun++) {
+		const uint16_t *window[C_FRAMES_MAX];
+		for (unsigned int ii = 0; ii < cFrames; ii++) {
+			window[ii] = frames[(iRun + ii) % C_FRAMES_MAX];
+		}
+		medianCompute(window, cFrames, cPixels, planar);
+	}
+	*msPlanar = (getMonotonicTimeInMs() - msStart) / C_RUNS;
+
+	for (unsigned int ii = 0; ii + 1 < cFrames; ii++) {
+		medianSlabStore(slab, ii, frames[ii], 0, cPixels);
+	}
+	msStart = getMonotonicTimeInMs();
+	for (unsigned int iRun = 0; iRun < C_RUNS; iRun++) {
+		unsigned int iSlot = (iRun + cFrames - 1) % cFrames;
+		medianSlabStore(slab, iSlot, frames[(iRun + cFrames - 1) % C_FRAMES_MAX], 0, cPixels);
+		medianSlabCompute(slab, 0, cFrames, 0, cPixels, slabbed);
+	}
+	*msSlab = (getMonotonicTimeInMs() - msStart) / C_RUNS;
+
+	msStart = getMonotonicTimeInMs();
+	for (unsigned int iRun = 0; iRun < C_RUNS; iRun++) {
+		medianSlabCompute(slab, 0, cFrames, 0, cPixels, slabbed);
+	}
+	*msSlabMedian = (getMonotonicTimeInMs() - msStart) / C_RUNS;
+
+	// both loops ended on the same window
+	bool same = !memcmp(planar, slabbed, cPixels * sizeof(uint16_t));
+	medianSlabDestroy(slab);
+	free(planar);
+	free(slabbed);
+	return same;
+}
+
+int main()
+{
+	medianInit();
+	printf("%s engine, ms per frame, average of %u runs\n", medianEngineName(medianGetEngine()), C_RUNS);
+	printf("%-12s %-8s %10s %14s %14s\n", "size", "frames", "planar", "slab: store +", "median alone");
+
+	bool success = true;
+	for (unsigned int iSize = 0; iSize < sizeof(sizes) / sizeof(*sizes); iSize++) {
+		size_t cPixels = sizes[iSize].width * sizes[iSize].height;
+
+		uint16_t *frames[C_FRAMES_MAX];
+		uint64_t state = 1;
+		for (unsigned int iFrame = 0; iFrame < C_FRAMES_MAX; iFrame++) {
+			frames[iFrame] = malloc(cPixels * sizeof(uint16_t));
+			if (!frames[iFrame]) {
+				return EXIT_FAILURE;
+			}
+			for (size_t ii = 0; ii < cPixels; ii++) {
+				// xorshift64
+				state ^= state << 13;
+				state ^= state >> 7;
+				state ^= state << 17;
+				frames[iFrame][ii] = (uint16_t) state;
+			}
+		}
+
+		for (unsigned int iTest = 0; iTest < sizeof(cFramesTested) / sizeof(*cFramesTested); iTest++) {
+			unsigned int cFrames = cFramesTested[iTest];
+			double msPlanar, msSlab, msSlabMedian;
+			bool same = compare(frames, cFrames, cPixels, &msPlanar, &msSlab, &msSlabMedian);
+			success = success && same;
+
+			char size[32];
+			snprintf(size, sizeof(size), "%zux%zu", sizes[iSize].width, sizes[iSize].height);
+			printf("%-12s %-8u %10.3f %14.3f %14.3f%s\n", size, cFrames,
+				msPlanar, msSlab, msSlabMedian, same ? "" : " WRONG");
+		}
+
+		for (unsigned int iFrame = 0; iFrame < C_FRAMES_MAX; iFrame++) {
+			free(frames[iFrame]);
+		}
+	}
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,465 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "archive.h"
+
+// A file is a header, then the compressed frames one after another, then the
+// index, then a trailer that says where the index is. Everything is padded to
+// a multiple of 8 bytes, so the index can be used straight out of the mapping.
+
+#define VERSION 1
+static const char magic[8] = "RCDEPTH"; // including the NUL
+
+struct header {
+	char magic[8];
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t flags;
+};
+
+struct indexEntry {
+	uint64_t offset;
+	uint64_t size;
+	double timestamp;
+};
+
+struct trailer {
+	uint64_t indexOffset;
+	uint64_t cFrames;
+	char magic[8];
+};
+
+// Prediction errors are Golomb-Rice coded with parameter k: the quotient
+// err >> k in unary, then the low k bits. Quotients of at least cQuotientMax
+// are escaped, and the error is stored in full instead.
+static const unsigned int cQuotientMax = 24;
+static const unsigned int cErrBits = 17;
+
+// Picks k as JPEG-LS does: `sum` is the total of the recent errors and `count`
+// how many there were, and k is the smallest value with count<<k >= sum.
+struct rice {
+	uint32_t sum;
+	uint32_t count;
+};
+
+static const struct rice riceInitial = {4, 1};
+
+static unsigned int riceK(const struct rice *rice)
+{
+	if (rice->sum <= rice->count) {
+		return 0;
+	}
+	// count<<k >= sum exactly when 1<<k > (sum-1)/count
+	return 32 - (unsigned int) __builtin_clz((rice->sum - 1) / rice->count);
+}
+
+static void riceUpdate(struct rice *rice, uint32_t err)
+{
+	rice->sum += err;
+	rice->count++;
+	// forget old errors gradually, so that k follows the image
+	if (rice->count == 64) {
+		rice->sum /= 2;
+		rice->count /= 2;
+	}
+}
+
+// The LOCO-I median edge detector: a guess at a pixel based on the pixels to
+// its left (a), above (b), and above and to the left (c). It comes out to the
+// median of a, b and a+b-c, which compiles without any branches.
+static int32_t predict(const uint16_t *frame, size_t width, size_t x, size_t y)
+{
+	const uint16_t *p = frame + y*width + x;
+	if (y == 0) {
+		return x ? p[-1] : 0;
+	}
+	int32_t b = p[-(ptrdiff_t) width];
+	if (x == 0) {
+		return b;
+	}
+	int32_t a = p[-1];
+	int32_t c = p[-(ptrdiff_t) width - 1];
+
+	int32_t min = a < b ? a : b;
+	int32_t max = a < b ? b : a;
+	int32_t plane = a + b - c;
+	plane = plane < max ? plane : max;
+	return plane > min ? plane : min;
+}
+
+// maps 0, -1, 1, -2, ... to 0, 1, 2, 3, ...
+static uint32_t zigzag(int32_t err)
+{
+	return err >= 0 ? (uint32_t) err * 2 : (uint32_t) -err * 2 - 1;
+}
+
+static int32_t unzigzag(uint32_t value)
+{
+	return value % 2 ? -(int32_t) (value / 2) - 1 : (int32_t) (value / 2);
+}
+
+// Writes bits least significant first
+struct bitWriter {
+	uint8_t *out;
+	size_t cbOut;
+	uint64_t bits;
+	unsigned int cBits;
+};
+
+// cBits must be at most 32
+static void putBits(struct bitWriter *writer, uint32_t bits, unsigned int cBits)
+{
+	writer->bits |= (uint64_t) bits << writer->cBits;
+	writer->cBits += cBits;
+	if (writer->cBits >= 32) {
+		uint32_t word = (uint32_t) writer->bits;
+		memcpy(writer->out + writer->cbOut, &word, sizeof(word));
+		writer->cbOut += sizeof(word);
+		writer->bits >>= 32;
+		writer->cBits -= 32;
+	}
+}
+
+static void flushBits(struct bitWriter *writer)
+{
+	while (writer->cBits > 0) {
+		writer->out[writer->cbOut++] = (uint8_t) writer->bits;
+		writer->bits >>= 8;
+		writer->cBits = writer->cBits > 8 ? writer->cBits - 8 : 0;
+	}
+}
+
+struct bitReader {
+	const uint8_t *in;
+	size_t cbIn;
+	size_t iByte;
+	uint64_t bits;
+	unsigned int cBits;
+};
+
+// Makes sure at least 57 bits are buffered. Past the end of the input, reads
+// zeros.
+static void refill(struct bitReader *reader)
+{
+	if (reader->cBits > 56) {
+		return;
+	}
+
+	if (reader->iByte + sizeof(uint64_t) <= reader->cbIn) {
+		// grab as many whole bytes as fit
+		uint64_t word;
+		memcpy(&word, reader->in + reader->iByte, sizeof(word));
+		reader->bits |= word << reader->cBits;
+		unsigned int cBytes = (63 - reader->cBits) / 8;
+		reader->iByte += cBytes;
+		reader->cBits += cBytes * 8;
+		return;
+	}
+
+	while (reader->cBits <= 56) {
+		uint64_t byte = reader->iByte < reader->cbIn ? reader->in[reader->iByte] : 0;
+		reader->iByte++;
+		reader->bits |= byte << reader->cBits;
+		reader->cBits += 8;
+	}
+}
+
+// At most 32 bits, and there must be that many buffered
+static uint32_t getBits(struct bitReader *reader, unsigned int cBits)
+{
+	uint32_t bits = (uint32_t) (reader->bits & ((1ull << cBits) - 1));
+	reader->bits >>= cBits;
+	reader->cBits -= cBits;
+	return bits;
+}
+
+// The most bytes that compressing a frame of cPixels pixels can take
+static size_t maxCompressedSize(size_t cPixels)
+{
+	size_t cBitsMax = cQuotientMax + 1 + cErrBits;
+	return (cPixels * cBitsMax + 7) / 8 + 8;
+}
+
+// Returns the number of bytes written to `out`
+static size_t compress(const uint16_t *frame, size_t width, size_t height, uint8_t *out)
+{
+	struct bitWriter writer = {out, 0, 0, 0};
+	struct rice rice = riceInitial;
+
+	for (size_t y = 0; y < height; y++) {
+		for (size_t x = 0; x < width; x++) {
+			int32_t err = frame[y*width + x] - predict(frame, width, x, y);
+			uint32_t value = zigzag(err);
+
+			unsigned int k = riceK(&rice);
+			uint32_t quotient = value >> k;
+			if (quotient < cQuotientMax) {
+				putBits(&writer, 1u << quotient, quotient + 1);
+				putBits(&writer, value & ((1u << k) - 1), k);
+			} else {
+				putBits(&writer, 1u << cQuotientMax, cQuotientMax + 1);
+				putBits(&writer, value, cErrBits);
+			}
+			riceUpdate(&rice, value);
+		}
+	}
+
+	flushBits(&writer);
+	return writer.cbOut;
+}
+
+// Returns non-zero if `in` is corrupt
+static int decompress(const uint8_t *in, size_t cbIn, size_t width, size_t height, uint16_t *frame)
+{
+	struct bitReader reader = {in, cbIn, 0, 0, 0};
+	struct rice rice = riceInitial;
+
+	for (size_t y = 0; y < height; y++) {
+		for (size_t x = 0; x < width; x++) {
+			// enough for the longest code
+			refill(&reader);
+
+			unsigned int k = riceK(&rice);
+			uint32_t escape = 1u << cQuotientMax;
+			uint32_t quotient = (uint32_t) __builtin_ctzll(reader.bits | escape);
+			uint32_t value;
+			getBits(&reader, quotient + 1);
+			if (quotient < cQuotientMax) {
+				value = (quotient << k) | getBits(&reader, k);
+			} else {
+				value = getBits(&reader, cErrBits);
+			}
+			riceUpdate(&rice, value);
+
+			int32_t pixel = predict(frame, width, x, y) + unzigzag(value);
+			if (pixel < 0 || pixel > UINT16_MAX) {
+				return 1;
+			}
+			frame[y*width + x] = (uint16_t) pixel;
+		}
+	}
+
+	// a valid frame never runs off its end
+	return reader.iByte - reader.cBits / 8 > cbIn;
+}
+
+static size_t pad8(size_t size)
+{
+	return (size + 7) / 8 * 8;
+}
+
+struct archiveWriter {
+	FILE *file;
+	size_t width, height;
+
+	// where the next frame goes
+	uint64_t offset;
+
+	struct indexEntry *index;
+	unsigned long long cFrames;
+	unsigned long long cIndexMax;
+
+	// scratch space for one compressed frame
+	uint8_t *buf;
+
+	bool failed;
+};
+
+struct archiveWriter *archiveCreate(char *file, size_t width, size_t height, uint32_t flags)
+{
+	assert(width <= UINT32_MAX && height <= UINT32_MAX);
+
+	struct archiveWriter *writer = calloc(1, sizeof(*writer));
+	assert(writer);
+	writer->width = width;
+	writer->height = height;
+
+	writer->file = fopen(file, "wb");
+	if (!writer->file) {
+		free(writer);
+		return NULL;
+	}
+
+	struct header header = {{0}, VERSION, (uint32_t) width, (uint32_t) height, flags};
+	memcpy(header.magic, magic, sizeof(magic));
+	writer->failed = fwrite(&header, sizeof(header), 1, writer->file) != 1;
+	writer->offset = sizeof(header);
+
+	writer->cIndexMax = 1024;
+	writer->index = malloc(sizeof(*writer->index) * writer->cIndexMax);
+	assert(writer->index);
+	writer->buf = malloc(pad8(maxCompressedSize(width * height)));
+	assert(writer->buf);
+
+	return writer;
+}
+
+int archiveWrite(struct archiveWriter *writer, const uint16_t *frame, double timestamp)
+{
+	size_t size = compress(frame, writer->width, writer->height, writer->buf);
+	size_t padded = pad8(size);
+	memset(writer->buf + size, 0, padded - size);
+	if (fwrite(writer->buf, 1, padded, writer->file) != padded) {
+		writer->failed = true;
+	}
+
+	if (writer->cFrames == writer->cIndexMax) {
+		writer->cIndexMax *= 2;
+		writer->index = realloc(writer->index, sizeof(*writer->index) * writer->cIndexMax);
+		assert(writer->index);
+	}
+	struct indexEntry entry = {writer->offset, size, timestamp};
+	writer->index[writer->cFrames++] = entry;
+	writer->offset += padded;
+
+	return writer->failed;
+}
+
+int archiveFinish(struct archiveWriter *writer)
+{
+	bool failed = writer->failed;
+
+	size_t cbIndex = sizeof(*writer->index) * writer->cFrames;
+	if (cbIndex && fwrite(writer->index, cbIndex, 1, writer->file) != 1) {
+		failed = true;
+	}
+
+	struct trailer trailer = {writer->offset, writer->cFrames, {0}};
+	memcpy(trailer.magic, magic, sizeof(magic));
+	if (fwrite(&trailer, sizeof(trailer), 1, writer->file) != 1) {
+		failed = true;
+	}
+	if (fclose(writer->file)) {
+		failed = true;
+	}
+
+	free(writer->index);
+	free(writer->buf);
+	free(writer);
+	return failed;
+}
+
+struct archiveReader {
+	// the whole file
+	const uint8_t *map;
+	size_t cbMap;
+
+	const struct header *header;
+	const struct indexEntry *index;
+	unsigned long long cFrames;
+};
+
+struct archiveReader *archiveOpen(char *file)
+{
+	struct archiveReader *reader = NULL;
+	void *map = MAP_FAILED;
+	struct stat st;
+
+	int fd = open(file, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) || st.st_size < (off_t) (sizeof(struct header) + sizeof(struct trailer))) {
+		goto FAIL;
+	}
+	size_t cbMap = (size_t) st.st_size;
+
+	map = mmap(NULL, cbMap, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		goto FAIL;
+	}
+	// frames are almost always read in order
+	madvise(map, cbMap, MADV_SEQUENTIAL);
+
+	const struct header *header = map;
+	const struct trailer *trailer = (const struct trailer *) ((const uint8_t *) map + cbMap - sizeof(*trailer));
+	if (memcmp(header->magic, magic, sizeof(magic)) || header->version != VERSION ||
+		!header->width || !header->height ||
+		memcmp(trailer->magic, magic, sizeof(magic))) {
+		goto FAIL;
+	}
+
+	// make sure that the index, and every frame it points to, is within
+	// the file
+	uint64_t cbIndexMax = cbMap - sizeof(*trailer) - sizeof(*header);
+	if (trailer->indexOffset % 8 || trailer->indexOffset < sizeof(*header) ||
+		trailer->cFrames > cbIndexMax / sizeof(struct indexEntry) ||
+		trailer->indexOffset + trailer->cFrames * sizeof(struct indexEntry) != cbMap - sizeof(*trailer)) {
+		goto FAIL;
+	}
+	const struct indexEntry *index = (const struct indexEntry *) ((const uint8_t *) map + trailer->indexOffset);
+	for (uint64_t ii = 0; ii < trailer->cFrames; ii++) {
+		if (index[ii].offset > trailer->indexOffset ||
+			index[ii].size > trailer->indexOffset - index[ii].offset) {
+			goto FAIL;
+		}
+	}
+
+	reader = malloc(sizeof(*reader));
+	assert(reader);
+	reader->map = map;
+	reader->cbMap = cbMap;
+	reader->header = header;
+	reader->index = index;
+	reader->cFrames = trailer->cFrames;
+
+	// the mapping stays valid without the descriptor
+	close(fd);
+	return reader;
+
+FAIL:
+	if (map != MAP_FAILED) {
+		munmap(map, (size_t) st.st_size);
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	return NULL;
+}
+
+void archiveClose(struct archiveReader *reader)
+{
+	munmap((void *) reader->map, reader->cbMap);
+	free(reader);
+}
+
+size_t archiveGetFrameWidth(struct archiveReader *reader)
+{
+	return reader->header->width;
+}
+
+size_t archiveGetFrameHeight(struct archiveReader *reader)
+{
+	return reader->header->height;
+}
+
+uint32_t archiveGetFlags(struct archiveReader *reader)
+{
+	return reader->header->flags;
+}
+
+unsigned long long archiveGetFrameCount(struct archiveReader *reader)
+{
+	return reader->cFrames;
+}
+
+double archiveGetTimestamp(struct archiveReader *reader, unsigned long long iFrame)
+{
+	assert(iFrame < reader->cFrames);
+	return reader->index[iFrame].timestamp;
+}
+
+int archiveRead(struct archiveReader *reader, unsigned long long iFrame, uint16_t *frame)
+{
+	assert(iFrame < reader->cFrames);
+	const struct indexEntry *entry = &reader->index[iFrame];
+	return decompress(reader->map + entry->offset, entry->size,
+		reader->header->width, reader->header->height, frame);
+}
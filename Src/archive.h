@@ -0,0 +1,50 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+// A lossless file format for 16 bit depth frames.
+//
+// Each frame is compressed on its own: every pixel is predicted from its
+// neighbours to the left and above, and the prediction error is Golomb-Rice
+// coded with a parameter that adapts as the frame goes. An index at the end of
+// the file gives every frame's offset and timestamp, so any frame can be
+// decoded without touching the others.
+//
+// Files are written in the host's byte order, which is assumed to be little
+// endian.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// the usual file name extension for archives
+#define ARCHIVE_SUFFIX ".rcda"
+
+// archiveCreate flag: the frames have already been denoised
+#define ARCHIVE_DENOISED 1u
+
+struct archiveWriter;
+struct archiveReader;
+
+// Returns NULL on failure
+struct archiveWriter *archiveCreate(char *file, size_t width, size_t height, uint32_t flags);
+// Returns non-zero on failure. `timestamp` is in ms.
+int archiveWrite(struct archiveWriter *writer, const uint16_t *frame, double timestamp);
+// Writes the index and closes the file. Without this, the file is unreadable.
+// Returns non-zero on failure.
+int archiveFinish(struct archiveWriter *writer);
+
+// Maps an archive into memory. Returns NULL if the file can't be read or isn't
+// an archive.
+struct archiveReader *archiveOpen(char *file);
+void archiveClose(struct archiveReader *reader);
+
+size_t archiveGetFrameWidth(struct archiveReader *reader);
+size_t archiveGetFrameHeight(struct archiveReader *reader);
+uint32_t archiveGetFlags(struct archiveReader *reader);
+unsigned long long archiveGetFrameCount(struct archiveReader *reader);
+double archiveGetTimestamp(struct archiveReader *reader, unsigned long long iFrame);
+
+// Decodes frame iFrame into `frame`. Returns non-zero if it's corrupt.
+int archiveRead(struct archiveReader *reader, unsigned long long iFrame, uint16_t *frame);
+
+#endif
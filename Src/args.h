@@ -6,9 +6,45 @@
 struct args {
 	bool write;
 	char *file;
+	// if true (and not `write`), `file` is processed as fast as possible
+	// instead of in real time. Frame timestamps then stand in for the
+	// clock.
+	bool replay;
+	// With `write`, the serial number of the device to record from, or
+	// NULL for the first one attached
+	char *device;
 
 	unsigned int ccamera_sample_size;
 	unsigned int ccamera_sample_delta;
+	// if true, ccamera updates its median incrementally as frames arrive
+	// instead of recomputing it from scratch for every frame
+	bool ccamera_incremental;
+	// how many threads compute each median; zero means one per CPU
+	unsigned int ccamera_threads;
+	// if true (and not incremental), ccamera keeps the frames it takes the
+	// median of in an interleaved medianSlab
+	bool ccamera_slab;
+	// the stages ccamera runs on every frame; see filter.h
+	char *ccamera_filters;
+
+	// the file that finished sets are appended to
+	char *log_file;
+
+	// if not NULL, every denoised frame is also written to this archive
+	char *archive_file;
+
+	// If true, each of the `batch_cFiles` recordings (or directories of
+	// recordings) in `batch_files` is replayed in a pipeline of its own,
+	// with up to `batch_jobs` running at once. `file` is unused. A
+	// `batch_jobs` of zero means one per CPU.
+	bool batch;
+	char **batch_files;
+	unsigned int batch_cFiles;
+	unsigned int batch_jobs;
+
+	// If true, every attached device gets a pipeline of its own; see
+	// stations.h. `file` is the directory that they record to.
+	bool stations;
 };
 
 #endif
@@ -0,0 +1,251 @@
+#include <assert.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "archive.h"
+#include "batch.h"
+#include "camera.h"
+#include "helper.h"
+#include "pipeline.h"
+#include "state.h"
+#include "state_log.h"
+
+#define RECORDING_SUFFIX ".bag"
+
+// what became of one recording
+struct result {
+	char *file;
+	bool success;
+	unsigned int cSets;
+	unsigned int cReps;
+	unsigned long long msElapsed;
+};
+
+struct batch {
+	struct args args;
+	struct repLog *log;
+
+	// one per recording, in the order that they were listed
+	struct result *results;
+	unsigned int cResults;
+
+	// the index of the next result that a worker should fill in
+	unsigned int iNext;
+};
+
+// A growable list of malloc'ed file names
+struct fileList {
+	char **files;
+	unsigned int cFiles;
+	unsigned int cMax;
+};
+
+static void fileListAppend(struct fileList *list, char *file)
+{
+	if (list->cFiles == list->cMax) {
+		list->cMax = list->cMax ? list->cMax * 2 : 16;
+		list->files = realloc(list->files, sizeof(*list->files) * list->cMax);
+		assert(list->files);
+	}
+	list->files[list->cFiles++] = file;
+}
+
+static bool hasSuffix(const char *name, const char *suffix)
+{
+	size_t len = strlen(name);
+	size_t lenSuffix = strlen(suffix);
+	return len > lenSuffix && !strcmp(name + len - lenSuffix, suffix);
+}
+
+static bool isRecording(const char *name)
+{
+	return hasSuffix(name, RECORDING_SUFFIX) || hasSuffix(name, ARCHIVE_SUFFIX);
+}
+
+static int compareFiles(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// Appends the recordings in directory `dir` to `list`, sorted by name. Returns
+// false if the directory can't be read.
+static bool appendDirectory(struct fileList *list, char *dir)
+{
+	DIR *dirp = opendir(dir);
+	if (!dirp) {
+		return false;
+	}
+
+	unsigned int iFirst = list->cFiles;
+	struct dirent *entry;
+	while ((entry = readdir(dirp))) {
+		if (!isRecording(entry->d_name)) {
+			continue;
+		}
+
+		size_t len = strlen(dir) + 1 + strlen(entry->d_name) + 1;
+		char *file = malloc(len);
+		assert(file);
+		snprintf(file, len, "%s/%s", dir, entry->d_name);
+		fileListAppend(list, file);
+	}
+	closedir(dirp);
+
+	// readdir's order is arbitrary
+	qsort(list->files + iFirst, list->cFiles - iFirst, sizeof(*list->files), compareFiles);
+	return true;
+}
+
+// Expands `paths` into a list of recordings. Returns false if any of them
+// can't be read.
+static bool listRecordings(char **paths, unsigned int cPaths, struct fileList *list)
+{
+	for (unsigned int iPath = 0; iPath < cPaths; iPath++) {
+		if (!strncmp(paths[iPath], CAMERA_SYNTHETIC_PREFIX, strlen(CAMERA_SYNTHETIC_PREFIX))) {
+			// not a file, but it replays like one
+			char *file = strdup(paths[iPath]);
+			assert(file);
+			fileListAppend(list, file);
+			continue;
+		}
+
+		struct stat info;
+		if (stat(paths[iPath], &info)) {
+			printf("%s: no such file or directory\n", paths[iPath]);
+			return false;
+		}
+
+		if (!S_ISDIR(info.st_mode)) {
+			char *file = strdup(paths[iPath]);
+			assert(file);
+			fileListAppend(list, file);
+		} else if (!appendDirectory(list, paths[iPath])) {
+			printf("%s: could not read directory\n", paths[iPath]);
+			return false;
+		}
+	}
+	return true;
+}
+
+static void processRecording(struct batch *batch, struct result *result)
+{
+	struct args args = batch->args;
+	args.file = result->file;
+
+	unsigned long long tStart = getTimeInMs();
+
+	// Nobody is watching a batch run, so don't bother with the debug
+	// video. (All of the pipelines would be writing the same file anyway.)
+	struct pipeline *pipeline = pipelineInit(args, batch->log, result->file, NULL);
+	if (!pipeline) {
+		printf("%s: could not be replayed\n", result->file);
+		return;
+	}
+
+	int ret = stateRun(pipeline);
+
+	result->success = ret == 0;
+	result->cSets = pipeline->cSets;
+	result->cReps = pipeline->cReps;
+	assert(!pipelineDestroy(pipeline));
+
+	result->msElapsed = getTimeInMs() - tStart;
+}
+
+static void *workerMain(void *arg)
+{
+	struct batch *batch = arg;
+
+	while (true) {
+		unsigned int iResult = __atomic_fetch_add(&batch->iNext, 1, __ATOMIC_RELAXED);
+		if (iResult >= batch->cResults) {
+			break;
+		}
+		processRecording(batch, &batch->results[iResult]);
+	}
+
+	return NULL;
+}
+
+int batchRun(struct args args)
+{
+	int ret = EXIT_FAILURE;
+
+	struct fileList list = {NULL, 0, 0};
+	if (!listRecordings(args.batch_files, args.batch_cFiles, &list)) {
+		goto DONE;
+	}
+	if (!list.cFiles) {
+		puts("There are no recordings to replay");
+		goto DONE;
+	}
+
+	unsigned int cWorkers = args.batch_jobs;
+	if (!cWorkers) {
+		long cCpus = sysconf(_SC_NPROCESSORS_ONLN);
+		cWorkers = cCpus > 0 ? (unsigned int) cCpus : 1;
+	}
+	cWorkers = cWorkers < list.cFiles ? cWorkers : list.cFiles;
+
+	struct batch batch;
+	batch.args = args;
+	batch.log = repLogInit(args.log_file);
+	batch.cResults = list.cFiles;
+	batch.iNext = 0;
+	batch.results = calloc(batch.cResults, sizeof(*batch.results));
+	assert(batch.results);
+	for (unsigned int ii = 0; ii < batch.cResults; ii++) {
+		batch.results[ii].file = list.files[ii];
+	}
+
+	printf("Replaying %u recordings with %u workers\n", batch.cResults, cWorkers);
+	unsigned long long tStart = getTimeInMs();
+
+	pthread_t *workers = malloc(sizeof(*workers) * cWorkers);
+	assert(workers);
+	for (unsigned int ii = 0; ii < cWorkers; ii++) {
+		int fail = pthread_create(&workers[ii], NULL, &workerMain, &batch);
+		assert(!fail);
+	}
+	for (unsigned int ii = 0; ii < cWorkers; ii++) {
+		assert(!pthread_join(workers[ii], NULL));
+	}
+	free(workers);
+
+	unsigned long long msTotal = getTimeInMs() - tStart;
+
+	// summarize
+	unsigned int cFailed = 0;
+	unsigned int cSets = 0;
+	unsigned int cReps = 0;
+	puts("");
+	for (unsigned int ii = 0; ii < batch.cResults; ii++) {
+		struct result *result = &batch.results[ii];
+		if (!result->success) {
+			printf("%s: FAILED\n", result->file);
+			cFailed++;
+			continue;
+		}
+		printf("%s: %u reps in %u sets (%.1f s)\n", result->file,
+			result->cReps, result->cSets, (double) result->msElapsed / 1000.0);
+		cSets += result->cSets;
+		cReps += result->cReps;
+	}
+	printf("Total: %u reps in %u sets from %u recordings (%u failed) in %.1f s\n",
+		cReps, cSets, batch.cResults, cFailed, (double) msTotal / 1000.0);
+
+	free(batch.results);
+	repLogDestroy(batch.log);
+	ret = cFailed ? EXIT_FAILURE : EXIT_SUCCESS;
+DONE:
+	for (unsigned int ii = 0; ii < list.cFiles; ii++) {
+		free(list.files[ii]);
+	}
+	free(list.files);
+	return ret;
+}
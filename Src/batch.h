@@ -0,0 +1,14 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+// Batch mode replays many recordings at once, each in its own pipeline, and
+// logs all of their sets to a single rep log.
+
+#include "args.h"
+
+// Replays every recording named by args.batch_files. Directories are expanded
+// to the .bag files directly inside them. Returns EXIT_SUCCESS if every
+// recording was processed.
+int batchRun(struct args args);
+
+#endif
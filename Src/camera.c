@@ -1,231 +1,213 @@
-#include <stdbool.h>
 #include <assert.h>
-#include <librealsense2/h/rs_frame.h>
-#include <librealsense2/h/rs_option.h>
-#include <librealsense2/h/rs_pipeline.h>
-#include <librealsense2/rs.h>
 #include <stdbool.h>
 #include <stdint.h>
-#include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
 
 #include "args.h"
-#include "objs.h"
 #include "camera.h"
-
-#define STREAM          RS2_STREAM_DEPTH  // rs2_stream is a types of data provided by RealSense device           //
-#define FORMAT          RS2_FORMAT_Z16    // rs2_format is identifies how binary data is encoded within a frame   //
-#define WIDTH           640               // Defines the number of columns for each frame or zero for auto resolve//
-#define HEIGHT          0                 // Defines the number of lines for each frame or zero for auto resolve  //
-#define STREAM_INDEX    0                 // Defines the stream index, used for multiple streams of the same type //
-
-void print_error(rs2_error* e)
+#include "camera_backend.h"
+#include "helper.h"
+
+// in order of preference; the last one accepts everything
+static const struct cameraBackend *backends[] = {
+	&cameraBackendSynthetic,
+	&cameraBackendArchive,
+	&cameraBackendRealsense,
+};
+
+struct camera {
+	const struct cameraBackend *backend;
+	void *state;
+
+	size_t frame_width;
+	size_t frame_height;
+
+	// See cameraSetFps. When the backend couldn't switch itself, frames
+	// with a timestamp before msNextFrame are dropped.
+	unsigned int fps;
+	bool dropping;
+	double msNextFrame;
+
+	// The number of the last frame that the backend handed over, if there
+	// has been one, and how many it has skipped since cameraAcquireFrame
+	// last returned a frame. See cameraFrameInfo.cDropped.
+	bool anyNumbered;
+	unsigned long long numberLast;
+	unsigned long long cDropped;
+
+	// Handles for the frames that are currently checked out. A handle is
+	// free when its `refs` is zero. Only cameraAcquireFrame takes a
+	// reference to a free handle.
+	struct cameraFrame handles[CAMERA_MAX_FRAMES];
+};
+
+struct camera *cameraInit(struct args args)
 {
-	printf("rs_error was raised when calling %s(%s):\n", rs2_get_failed_function(e), rs2_get_failed_args(e));
-	printf("    %s\n", rs2_get_error_message(e));
-}
+	const struct cameraBackend *backend = NULL;
+	for (size_t ii = 0; !backend; ii++) {
+		assert(ii < sizeof(backends) / sizeof(*backends));
+		if (backends[ii]->accepts(args)) {
+			backend = backends[ii];
+		}
+	}
 
-struct objs objs;
-size_t frame_width = 0;
-size_t frame_height = 0;
+	struct camera *cam = calloc(1, sizeof(*cam));
+	assert(cam);
+	cam->backend = backend;
 
-bool initializeWithFirstDevice(struct args args)
-{
-	objs = objs_default_value();
-
-	objs.ctx = rs2_create_context(RS2_API_VERSION, &objs.err);
-	if (objs.err) {
-		objs.ctx = NULL;
-		goto FAIL;
+	// on failure, this has already cleaned up after itself
+	cam->state = backend->init(args, &cam->frame_width, &cam->frame_height);
+	if (!cam->state) {
+		free(cam);
+		return NULL;
 	}
 
-	objs.pipeline = rs2_create_pipeline(objs.ctx, &objs.err);
-	if (objs.err) {
-		objs.pipeline = NULL;
-		goto FAIL;
+	for (unsigned int iHandle = 0; iHandle < CAMERA_MAX_FRAMES; iHandle++) {
+		cam->handles[iHandle].camera = cam;
 	}
+	cam->fps = CAMERA_FPS;
+	cam->dropping = false;
+	cam->msNextFrame = 0;
+	cam->anyNumbered = false;
+	cam->numberLast = 0;
+	cam->cDropped = 0;
 
-	objs.config = rs2_create_config(&objs.err);
-	if (objs.err) {
-		objs.config = NULL;
-		goto FAIL;
-	}
+	return cam;
+}
 
-	// Request a specific configuration
-	rs2_config_enable_stream(objs.config, STREAM, STREAM_INDEX, WIDTH, HEIGHT, FORMAT, CAMERA_FPS, &objs.err);
-	if (objs.err) {
-		goto FAIL;
+int cameraDestroy(struct camera *cam)
+{
+	for (unsigned int iHandle = 0; iHandle < CAMERA_MAX_FRAMES; iHandle++) {
+		// if this fails, someone never released a frame
+		assert(!cam->handles[iHandle].refs);
 	}
 
-	if(args.write) {
-		objs.device_list = rs2_query_devices(objs.ctx, &objs.err);
-		if (objs.err) {
-			objs.device_list = NULL;
-			goto FAIL;
-		}
+	cam->backend->destroy(cam->state);
+	free(cam);
+	return 0;
+}
 
-		int dev_count = rs2_get_device_count(objs.device_list, &objs.err);
-		if (objs.err) {
-			goto FAIL;
-		}
-		if (dev_count == 0) {
-			puts("There are no attached devices");
-			goto FAIL;
+static unsigned int getFreeHandle(struct camera *cam)
+{
+	for (unsigned int iHandle = 0; iHandle < CAMERA_MAX_FRAMES; iHandle++) {
+		if (!__atomic_load_n(&cam->handles[iHandle].refs, __ATOMIC_ACQUIRE)) {
+			return iHandle;
 		}
+	}
 
-		objs.dev = rs2_create_device(objs.device_list, 0, &objs.err);
-		if (objs.err) {
-			objs.dev = NULL;
-			goto FAIL;
-		}
+	// someone is holding on to more than CAMERA_MAX_FRAMES frames
+	abort();
+}
 
-		rs2_config_enable_record_to_file(objs.config, args.file, &objs.err);
-		if (objs.err) {
-			goto FAIL;
-		}
-		objs.pipeline_profile = rs2_pipeline_start_with_config(objs.pipeline, objs.config, &objs.err);
-		if (objs.err) {
-			goto FAIL;
-		}
-	} else {
-		rs2_config_enable_device_from_file(objs.config, args.file, &objs.err);
-		if (objs.err) {
-			goto FAIL;
-		}
+// Counts the frames that the backend skipped before `frame`
+static void countDropped(struct camera *cam, const struct cameraFrame *frame)
+{
+	unsigned long long number = frame->info.number;
+	// a file that starts over starts its numbers over too
+	if (cam->anyNumbered && number > cam->numberLast) {
+		cam->cDropped += number - cam->numberLast - 1;
+	}
+	cam->anyNumbered = true;
+	cam->numberLast = number;
+}
 
-		objs.pipeline_profile = rs2_pipeline_start_with_config(objs.pipeline, objs.config, &objs.err);
-		if (objs.err) {
-			goto FAIL;
+struct cameraFrame *cameraAcquireFrame(struct camera *cam)
+{
+	unsigned int iHandle = getFreeHandle(cam);
+	struct cameraFrame *handle = &cam->handles[iHandle];
+	while (true) {
+		if (!cam->backend->acquire(cam->state, handle, iHandle)) {
+			return NULL;
 		}
-
-		objs.dev = rs2_pipeline_profile_get_device(objs.pipeline_profile, &objs.err);
-		if (objs.err) {
-			goto FAIL;
+		countDropped(cam, handle);
+		if (!cam->dropping || handle->info.timestamp >= cam->msNextFrame) {
+			break;
+		}
+		if (cam->backend->release) {
+			cam->backend->release(cam->state, handle->frame);
 		}
 	}
 
-	objs.stream_profile_list = rs2_pipeline_profile_get_streams(objs.pipeline_profile, &objs.err);
-	if (objs.err) {
-		goto FAIL;
+	if (cam->dropping) {
+		// Allow for jitter of half a frame at the stream's own rate;
+		// otherwise a frame that's a little early would cost a whole
+		// extra frame.
+		cam->msNextFrame = handle->info.timestamp + 1000.0 / cam->fps - 500.0 / CAMERA_FPS;
 	}
 
-	objs.stream_profile = rs2_get_stream_profile(objs.stream_profile_list, 0, &objs.err);
-	if (objs.err) {
-		goto FAIL;
-	}
+	handle->info.msAcquired = getMonotonicTimeInMs();
+	handle->info.cDropped = cam->cDropped;
+	cam->cDropped = 0;
 
-	int tmpWidth, tmpHeight;
-	rs2_get_video_stream_resolution(objs.stream_profile, &tmpWidth, &tmpHeight, &objs.err);
-	if (objs.err) {
-		goto FAIL;
-	}
-	assert(tmpWidth > 0 && tmpHeight > 0);
-	frame_width = (size_t) tmpWidth;
-	frame_height = (size_t) tmpHeight;
-
-	return true;
-FAIL:
-	if (objs.err) {
-		print_error(objs.err);
-	}
-	objs_delete(objs);
-	return false;
+	__atomic_store_n(&handle->refs, 1, __ATOMIC_RELEASE);
+	return handle;
 }
 
-
-int cameraInit(struct args args)
+void cameraAddRef(struct cameraFrame *frame)
 {
-	int ret = EXIT_FAILURE;
-	bool success;
-	rs2_error* e = NULL;
-
+	unsigned int refs = __atomic_fetch_add(&frame->refs, 1, __ATOMIC_RELAXED);
+	assert(refs > 0);
+}
 
-	success = initializeWithFirstDevice(args);
-	if (!success) {
-		goto FAIL;
-	}
+void cameraRelease(struct cameraFrame *frame)
+{
+	// once the count hits zero the handle may be reused immediately, so
+	// grab everything we need from it first.
+	struct camera *cam = frame->camera;
+	void *private = frame->frame;
 
-	return EXIT_SUCCESS;
-FAIL:
-	if (e) {
-		print_error(e);
+	unsigned int refs = __atomic_fetch_sub(&frame->refs, 1, __ATOMIC_ACQ_REL);
+	assert(refs > 0);
+	if (refs == 1 && cam->backend->release) {
+		cam->backend->release(cam->state, private);
 	}
-	objs_delete(objs);
-	return ret;
 }
 
-int cameraDestroy()
+unsigned int cameraGetFps(struct camera *cam)
 {
-	objs_delete(objs);
-	return 0;
+	return cam->fps;
 }
 
-int cameraGetFrame(uint16_t *frameOut)
+void cameraSetFps(struct camera *cam, unsigned int fps)
 {
-	assert(frameOut != NULL);
-
-	rs2_error* e = NULL; //todo: just use objs.err? We have to initialize it to NULL though, I think.
-	int fail = EXIT_FAILURE;
-	rs2_frame* frames = rs2_pipeline_wait_for_frames(objs.pipeline, RS2_DEFAULT_TIMEOUT, &e);
-	if (e) {
-		frames = NULL;
-		goto DONE;
+	assert(fps > 0 && fps <= CAMERA_FPS);
+	for (unsigned int iHandle = 0; iHandle < CAMERA_MAX_FRAMES; iHandle++) {
+		assert(!cam->handles[iHandle].refs);
 	}
 
-        int cFrames = rs2_embedded_frames_count(frames, &e);
-	if (e) {
-		goto DONE;
+	cam->fps = fps;
+	cam->dropping = false;
+	// a backend that switches itself numbers its frames at the new rate
+	cam->anyNumbered = false;
+	if (!cam->backend->setFps || !cam->backend->setFps(cam->state, fps)) {
+		cam->dropping = fps != CAMERA_FPS;
+		cam->msNextFrame = 0;
 	}
+}
 
-	bool brk = false;
-	for (int iFrame = 0; iFrame < cFrames && !brk; iFrame++) {
-		rs2_frame* frame = rs2_extract_frame(frames, iFrame, &e);
-		if (e) {
-			frame = NULL;
-			brk = true;
-			goto CONTINUE;
-		}
-
-		bool isDepthFrame = rs2_is_frame_extendable_to(frame, RS2_EXTENSION_DEPTH_FRAME, &e);
-		if (e) {
-			brk = true;
-			goto CONTINUE;
-		}
+bool cameraEndOfStream(struct camera *cam)
+{
+	return cam->backend->endOfStream(cam->state);
+}
 
-		if (isDepthFrame) {
-			const uint16_t* data = (const uint16_t*)(rs2_get_frame_data(frame, &e));
-			size_t numPixels = frame_width * frame_height;
-			for (size_t i = 0; i < numPixels; i++) {
-				frameOut[i] = data[i];
-			}
-			brk = true;
-			fail = EXIT_SUCCESS;
-		}
-	CONTINUE:
-		if (frame) {
-			rs2_release_frame(frame);
-		}
-	}
-DONE:
-	if (frames) {
-		rs2_release_frame(frames);
-	}
-	if (e) {
-		print_error(e);
-	}
+bool cameraIsDenoised(struct camera *cam)
+{
+	return cam->backend->isDenoised && cam->backend->isDenoised(cam->state);
+}
 
-	return fail;
+const char *cameraGetBackendName(struct camera *cam)
+{
+	return cam->backend->name;
 }
 
-size_t cameraGetFrameWidth()
+size_t cameraGetFrameWidth(struct camera *cam)
 {
-	assert(frame_width != 0);
-	return frame_width;
+	assert(cam->frame_width != 0);
+	return cam->frame_width;
 }
 
-size_t cameraGetFrameHeight()
+size_t cameraGetFrameHeight(struct camera *cam)
 {
-	assert(frame_width != 0);
-	return frame_height;
+	assert(cam->frame_width != 0);
+	return cam->frame_height;
 }
@@ -8,13 +8,110 @@
 
 #define CAMERA_FPS 30
 
-int cameraInit(struct args args);
-int cameraDestroy();
+// A connection to one camera, or to one recording. Any number of these may be
+// open at once.
+//
+// args.file says where frames come from:
+// - a name starting with CAMERA_SYNTHETIC_PREFIX: generated frames (see below)
+// - a name ending in ARCHIVE_SUFFIX: an archive (see archive.h)
+// - anything else: a librealsense .bag file, or with args.write, the attached
+//   device args.device (see cameraListDevices), which records to the file.
+//   Every cameraSetFps restarts the device, which then records to a new file
+//   beside the first: "name.1.bag" after "name.bag", and so on.
+struct camera;
 
-size_t cameraGetFrameWidth();
-size_t cameraGetFrameHeight();
+// Synthetic frames show a flat background with a body in front of it doing
+// pushups. The prefix may be followed by comma separated key=value pairs:
+//
+// width, height, fps: the stream's format (848, 480, CAMERA_FPS)
+// reps: how many pushups are done (10)
+// period: how long each takes, in seconds (1.5)
+// idle: seconds of stillness before the first rep and after the last (10)
+// depth: distance to the background, in mm (2000)
+// amplitude: how far the body moves, in mm (300)
+// noise: each pixel is off by up to this many mm (3)
+// holes: fraction of pixels that read as zero, like shadows on a real camera
+//        (0)
+// seed: for the noise (1)
+//
+// The same parameters always generate the same frames, so replays of them are
+// reproducible. Real time playback repeats forever, like a .bag file, and
+// like a live camera, loses any frame that isn't acquired before the next one
+// is due.
+#define CAMERA_SYNTHETIC_PREFIX "synthetic:"
 
-// Waits for the next frame and writes it to frameOut
-int cameraGetFrame(uint16_t *frameOut);
+// Sets *serials to a malloc'ed array of the serial numbers of every attached
+// device, each malloc'ed too, and returns how many there are. Returns 0, with
+// *serials NULL, if there are none or they can't be listed.
+unsigned int cameraListDevices(char ***serials);
+
+// Returns NULL on failure
+struct camera *cameraInit(struct args args);
+int cameraDestroy(struct camera *cam);
+
+size_t cameraGetFrameWidth(struct camera *cam);
+size_t cameraGetFrameHeight(struct camera *cam);
+
+// The rate that frames currently arrive at: CAMERA_FPS unless cameraSetFps has
+// changed it
+unsigned int cameraGetFps(struct camera *cam);
+
+// Switches to `fps` frames per second; CAMERA_FPS goes back to the stream's
+// own rate. Backends that can change their own rate do so (a synthetic camera
+// generates fewer frames, a device is restarted at the new rate); for the
+// rest, cameraAcquireFrame drops frames so that those it returns are about
+// 1/fps apart. No frames may be held while switching.
+void cameraSetFps(struct camera *cam, unsigned int fps);
+
+// Everything about a frame besides its pixels
+struct cameraFrameInfo {
+	// when the frame was captured, in ms, as reported by librealsense (or
+	// recorded in the archive, or generated)
+	double timestamp;
+	// The frame's number, as reported by librealsense (or its position in
+	// the archive, or in the generated stream). Consecutive frames at the
+	// rate the stream runs at have consecutive numbers; numbers start over
+	// when a file loops.
+	unsigned long long number;
+	// how many frames the stream skipped right before this one, going by
+	// the numbers. Frames left out on purpose to honour cameraSetFps don't
+	// count.
+	unsigned long long cDropped;
+	// getMonotonicTimeInMs() when cameraAcquireFrame got the frame
+	double msAcquired;
+};
+
+// A depth frame from the camera. `data` points directly at librealsense's
+// buffer (or for other sources, the camera's), and stays valid until the last
+// reference to the frame is released.
+struct cameraFrame {
+	const uint16_t *data;
+	struct cameraFrameInfo info;
+
+	// private to camera
+	struct camera *camera;
+	void *frame;
+	unsigned int refs;
+};
+
+// the maximum number of frames that may be held at once, per camera
+#define CAMERA_MAX_FRAMES 32
+
+// Waits for the next frame and returns it with a single reference, or returns
+// NULL on failure or at the end of the stream.
+struct cameraFrame *cameraAcquireFrame(struct camera *cam);
+void cameraAddRef(struct cameraFrame *frame);
+void cameraRelease(struct cameraFrame *frame);
+
+// True once every frame of a replayed file has been acquired. Live cameras and
+// real time playback never end.
+bool cameraEndOfStream(struct camera *cam);
+
+// True if the frames have already been denoised, i.e. they come from an
+// archive that was written by ccamera.
+bool cameraIsDenoised(struct camera *cam);
+
+// e.g. "librealsense"
+const char *cameraGetBackendName(struct camera *cam);
 
 #endif
@@ -0,0 +1,148 @@
+// The archive backend: plays a file written by archive.c. Like a .bag, it is
+// either replayed once as fast as possible, or played in real time forever.
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "archive.h"
+#include "args.h"
+#include "camera_backend.h"
+#include "helper.h"
+
+struct archive {
+	struct archiveReader *reader;
+	size_t width;
+	size_t height;
+
+	// true when replaying a file as fast as possible; see args.replay
+	bool replay;
+	bool endOfStream;
+
+	// the archive frame that acquire returns next
+	unsigned long long iFrame;
+	// Real time playback only: the time at which frame 0 was (or would
+	// have been) played, and how much to add to the archive's timestamps.
+	// Both grow each time the archive loops.
+	double msStart;
+	double msOffset;
+	// frames are decoded into buffers[iHandle]
+	uint16_t *buffers[CAMERA_MAX_FRAMES];
+};
+
+static bool accepts(struct args args)
+{
+	size_t len = strlen(args.file);
+	size_t lenSuffix = strlen(ARCHIVE_SUFFIX);
+	return !args.write && len > lenSuffix && !strcmp(args.file + len - lenSuffix, ARCHIVE_SUFFIX);
+}
+
+static void *init(struct args args, size_t *width, size_t *height)
+{
+	struct archiveReader *reader = archiveOpen(args.file);
+	if (!reader) {
+		printf("%s is not an archive\n", args.file);
+		return NULL;
+	}
+
+	struct archive *ar = calloc(1, sizeof(*ar));
+	assert(ar);
+	ar->reader = reader;
+	ar->width = archiveGetFrameWidth(reader);
+	ar->height = archiveGetFrameHeight(reader);
+	ar->replay = args.replay;
+	ar->endOfStream = false;
+	ar->iFrame = 0;
+	ar->msStart = getMonotonicTimeInMs();
+	ar->msOffset = 0;
+
+	*width = ar->width;
+	*height = ar->height;
+	return ar;
+}
+
+static void destroy(void *state)
+{
+	struct archive *ar = state;
+	for (unsigned int iHandle = 0; iHandle < CAMERA_MAX_FRAMES; iHandle++) {
+		free(ar->buffers[iHandle]);
+	}
+	archiveClose(ar->reader);
+	free(ar);
+}
+
+static bool acquire(void *state, struct cameraFrame *frame, unsigned int iHandle)
+{
+	struct archive *ar = state;
+	struct archiveReader *reader = ar->reader;
+	unsigned long long cFrames = archiveGetFrameCount(reader);
+
+	if (ar->iFrame == cFrames) {
+		if (ar->replay || !cFrames) {
+			ar->endOfStream = true;
+			return false;
+		}
+
+		// start over, one frame period after the last frame
+		double msLength = archiveGetTimestamp(reader, cFrames - 1) -
+			archiveGetTimestamp(reader, 0) + 1000.0 / CAMERA_FPS;
+		ar->msOffset += msLength;
+		ar->iFrame = 0;
+	}
+
+	double timestamp = archiveGetTimestamp(reader, ar->iFrame) + ar->msOffset;
+	if (!ar->replay) {
+		// wait until the frame is due
+		double msDue = ar->msStart + timestamp - archiveGetTimestamp(reader, 0);
+		double now = getMonotonicTimeInMs();
+		if (msDue > now) {
+			usleep((useconds_t) ((msDue - now) * 1000));
+		}
+	}
+
+	if (!ar->buffers[iHandle]) {
+		ar->buffers[iHandle] = malloc(sizeof(uint16_t) * ar->width * ar->height);
+		assert(ar->buffers[iHandle]);
+	}
+
+	if (archiveRead(reader, ar->iFrame, ar->buffers[iHandle])) {
+		// treat it like the end of the recording
+		printf("archive frame %llu is corrupt\n", ar->iFrame);
+		ar->endOfStream = true;
+		return false;
+	}
+
+	frame->data = ar->buffers[iHandle];
+	frame->info.timestamp = timestamp;
+	frame->info.number = ar->iFrame++;
+	frame->frame = NULL;
+	return true;
+}
+
+static bool endOfStream(void *state)
+{
+	struct archive *ar = state;
+	return ar->endOfStream;
+}
+
+static bool isDenoised(void *state)
+{
+	struct archive *ar = state;
+	return archiveGetFlags(ar->reader) & ARCHIVE_DENOISED;
+}
+
+const struct cameraBackend cameraBackendArchive = {
+	.name = "archive",
+	.accepts = accepts,
+	.init = init,
+	.destroy = destroy,
+	.acquire = acquire,
+	.release = NULL,
+	.setFps = NULL,
+	.endOfStream = endOfStream,
+	.isDenoised = isDenoised,
+};
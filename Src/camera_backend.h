@@ -0,0 +1,53 @@
+#ifndef CAMERA_BACKEND_H
+#define CAMERA_BACKEND_H
+
+// The interface between camera.c and the things that actually produce frames.
+// camera.c owns the frame handles and their reference counts; a backend only
+// fills them in.
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "args.h"
+#include "camera.h"
+
+struct cameraBackend {
+	const char *name;
+
+	// True if this is the backend that should handle `args`. The first
+	// backend that accepts them is the only one that is tried.
+	bool (*accepts)(struct args args);
+
+	// Returns the backend's state, or NULL on failure. Must set *width
+	// and *height.
+	void *(*init)(struct args args, size_t *width, size_t *height);
+	void (*destroy)(void *state);
+
+	// Waits for the next frame and fills in `frame`'s data, info.timestamp,
+	// info.number and private `frame` pointer. `iHandle` is the index of the handle, which
+	// is less than CAMERA_MAX_FRAMES; a backend that decodes into its own
+	// buffers can keep one per handle. Returns false on failure or at the
+	// end of the stream.
+	bool (*acquire)(void *state, struct cameraFrame *frame, unsigned int iHandle);
+	// Called with the private `frame` pointer once the last reference to a
+	// frame is released. May be NULL.
+	void (*release)(void *state, void *frame);
+
+	// Switches the stream to `fps` frames per second, with no frames
+	// held. Returns false if the backend can't, in which case camera.c
+	// drops frames instead. May be NULL, meaning it can't.
+	bool (*setFps)(void *state, unsigned int fps);
+
+	bool (*endOfStream)(void *state);
+	// May be NULL, meaning false
+	bool (*isDenoised)(void *state);
+};
+
+// .bag files and devices, through librealsense (camera_realsense.c)
+extern const struct cameraBackend cameraBackendRealsense;
+// lossless archives; see archive.h (camera_archive.c)
+extern const struct cameraBackend cameraBackendArchive;
+// generated frames; see CAMERA_SYNTHETIC_PREFIX (camera_synthetic.c)
+extern const struct cameraBackend cameraBackendSynthetic;
+
+#endif
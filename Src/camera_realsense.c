@@ -0,0 +1,571 @@
+// The librealsense backend: a device, or a .bag file that one recorded.
+
+#include <assert.h>
+#include <librealsense2/h/rs_frame.h>
+#include <librealsense2/h/rs_option.h>
+#include <librealsense2/h/rs_pipeline.h>
+#include <librealsense2/rs.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "args.h"
+#include "camera_backend.h"
+#include "objs.h"
+
+#define STREAM          RS2_STREAM_DEPTH  // rs2_stream is a types of data provided by RealSense device           //
+#define FORMAT          RS2_FORMAT_Z16    // rs2_format is identifies how binary data is encoded within a frame   //
+#define WIDTH           640               // Defines the number of columns for each frame or zero for auto resolve//
+#define HEIGHT          0                 // Defines the number of lines for each frame or zero for auto resolve  //
+#define STREAM_INDEX    0                 // Defines the stream index, used for multiple streams of the same type //
+
+#define RECORDING_SUFFIX ".bag"
+
+void print_error(rs2_error* e)
+{
+	printf("rs_error was raised when calling %s(%s):\n", rs2_get_failed_function(e), rs2_get_failed_args(e));
+	printf("    %s\n", rs2_get_error_message(e));
+}
+
+struct realsense {
+	struct objs objs;
+
+	// true when replaying a file as fast as possible; see args.replay
+	bool replay;
+	bool endOfStream;
+
+	// The index of the depth frame within the framesets returned by the
+	// pipeline, or -1 if it isn't known yet.
+	int iDepth;
+
+	// The stream's resolution, which setFps keeps
+	int width;
+	int height;
+
+	// Live devices only, otherwise NULL: the device's serial number, and the
+	// file that the stream was first recorded to. cRestarts is how many
+	// times setFps has restarted the pipeline since.
+	char *serial;
+	char *file;
+	unsigned int cRestarts;
+};
+
+// Returns the serial number of `dev`, which belongs to `dev`, or NULL on error
+static const char *getSerial(const rs2_device *dev, rs2_error **e)
+{
+	const char *serial = rs2_get_device_info(dev, RS2_CAMERA_INFO_SERIAL_NUMBER, e);
+	return *e ? NULL : serial;
+}
+
+unsigned int cameraListDevices(char ***serials)
+{
+	struct objs objs = objs_default_value();
+	unsigned int cSerials = 0;
+	*serials = NULL;
+
+	objs.ctx = rs2_create_context(RS2_API_VERSION, &objs.err);
+	if (objs.err) {
+		objs.ctx = NULL;
+		goto DONE;
+	}
+	objs.device_list = rs2_query_devices(objs.ctx, &objs.err);
+	if (objs.err) {
+		objs.device_list = NULL;
+		goto DONE;
+	}
+	int cDevices = rs2_get_device_count(objs.device_list, &objs.err);
+	if (objs.err || cDevices <= 0) {
+		goto DONE;
+	}
+
+	*serials = malloc(sizeof(**serials) * (size_t) cDevices);
+	assert(*serials);
+	for (int iDevice = 0; iDevice < cDevices; iDevice++) {
+		rs2_device *dev = rs2_create_device(objs.device_list, iDevice, &objs.err);
+		if (objs.err) {
+			goto DONE;
+		}
+		const char *serial = getSerial(dev, &objs.err);
+		if (serial) {
+			(*serials)[cSerials] = strdup(serial);
+			assert((*serials)[cSerials]);
+			cSerials++;
+		}
+		rs2_delete_device(dev);
+		if (objs.err) {
+			goto DONE;
+		}
+	}
+
+DONE:
+	if (objs.err) {
+		print_error(objs.err);
+		while (cSerials) {
+			free((*serials)[--cSerials]);
+		}
+		free(*serials);
+		*serials = NULL;
+	}
+	objs_delete(objs);
+	return cSerials;
+}
+
+// Sets objs->dev to the device in objs->device_list with serial number
+// `serial`, or if that's NULL, to the first one, and has the pipeline stream
+// from it. Returns false if there is no such device.
+static bool openDevice(struct objs *objs, const char *serial)
+{
+	int cDevices = rs2_get_device_count(objs->device_list, &objs->err);
+	if (objs->err) {
+		return false;
+	}
+
+	for (int iDevice = 0; iDevice < cDevices && !objs->dev; iDevice++) {
+		rs2_device *dev = rs2_create_device(objs->device_list, iDevice, &objs->err);
+		if (objs->err) {
+			return false;
+		}
+		const char *devSerial = getSerial(dev, &objs->err);
+		if (!devSerial) {
+			rs2_delete_device(dev);
+			return false;
+		}
+
+		if (serial && strcmp(serial, devSerial)) {
+			rs2_delete_device(dev);
+			continue;
+		}
+
+		// with several devices attached, the pipeline would otherwise
+		// pick one by itself
+		rs2_config_enable_device(objs->config, devSerial, &objs->err);
+		objs->dev = dev;
+		if (objs->err) {
+			return false;
+		}
+	}
+
+	if (!objs->dev) {
+		if (serial) {
+			printf("There is no attached device %s\n", serial);
+		} else {
+			puts("There are no attached devices");
+		}
+		return false;
+	}
+	return true;
+}
+
+static bool accepts(struct args args)
+{
+	(void) args;
+	return true;
+}
+
+static void *init(struct args args, size_t *width, size_t *height)
+{
+	struct objs objs = objs_default_value();
+
+	objs.ctx = rs2_create_context(RS2_API_VERSION, &objs.err);
+	if (objs.err) {
+		objs.ctx = NULL;
+		goto FAIL;
+	}
+
+	objs.pipeline = rs2_create_pipeline(objs.ctx, &objs.err);
+	if (objs.err) {
+		objs.pipeline = NULL;
+		goto FAIL;
+	}
+
+	objs.config = rs2_create_config(&objs.err);
+	if (objs.err) {
+		objs.config = NULL;
+		goto FAIL;
+	}
+
+	// Request a specific configuration
+	rs2_config_enable_stream(objs.config, STREAM, STREAM_INDEX, WIDTH, HEIGHT, FORMAT, CAMERA_FPS, &objs.err);
+	if (objs.err) {
+		goto FAIL;
+	}
+
+	if(args.write) {
+		objs.device_list = rs2_query_devices(objs.ctx, &objs.err);
+		if (objs.err) {
+			objs.device_list = NULL;
+			goto FAIL;
+		}
+
+		if (!openDevice(&objs, args.device)) {
+			goto FAIL;
+		}
+
+		rs2_config_enable_record_to_file(objs.config, args.file, &objs.err);
+		if (objs.err) {
+			goto FAIL;
+		}
+		objs.pipeline_profile = rs2_pipeline_start_with_config(objs.pipeline, objs.config, &objs.err);
+		if (objs.err) {
+			goto FAIL;
+		}
+	} else {
+		// when replaying, play the file once; reaching its end is the end
+		// of the stream.
+		rs2_config_enable_device_from_file_repeat_option(objs.config, args.file, !args.replay, &objs.err);
+		if (objs.err) {
+			goto FAIL;
+		}
+
+		objs.pipeline_profile = rs2_pipeline_start_with_config(objs.pipeline, objs.config, &objs.err);
+		if (objs.err) {
+			goto FAIL;
+		}
+
+		objs.dev = rs2_pipeline_profile_get_device(objs.pipeline_profile, &objs.err);
+		if (objs.err) {
+			goto FAIL;
+		}
+
+		if (args.replay) {
+			// Without real time playback, librealsense reads the
+			// file exactly as fast as we consume frames.
+			rs2_playback_device_set_real_time(objs.dev, 0, &objs.err);
+			if (objs.err) {
+				goto FAIL;
+			}
+		}
+	}
+
+	objs.stream_profile_list = rs2_pipeline_profile_get_streams(objs.pipeline_profile, &objs.err);
+	if (objs.err) {
+		goto FAIL;
+	}
+
+	objs.stream_profile = rs2_get_stream_profile(objs.stream_profile_list, 0, &objs.err);
+	if (objs.err) {
+		goto FAIL;
+	}
+
+	int tmpWidth, tmpHeight;
+	rs2_get_video_stream_resolution(objs.stream_profile, &tmpWidth, &tmpHeight, &objs.err);
+	if (objs.err) {
+		goto FAIL;
+	}
+	assert(tmpWidth > 0 && tmpHeight > 0);
+	*width = (size_t) tmpWidth;
+	*height = (size_t) tmpHeight;
+
+	struct realsense *rs = malloc(sizeof(*rs));
+	assert(rs);
+	rs->replay = args.replay;
+	rs->endOfStream = false;
+	rs->iDepth = -1;
+	rs->width = tmpWidth;
+	rs->height = tmpHeight;
+	rs->serial = NULL;
+	rs->file = NULL;
+	rs->cRestarts = 0;
+	if (args.write) {
+		const char *serial = getSerial(objs.dev, &objs.err);
+		if (!serial) {
+			free(rs);
+			goto FAIL;
+		}
+		rs->serial = strdup(serial);
+		assert(rs->serial);
+		rs->file = strdup(args.file);
+		assert(rs->file);
+	}
+	rs->objs = objs;
+	return rs;
+FAIL:
+	if (objs.err) {
+		print_error(objs.err);
+	}
+	objs_delete(objs);
+	return NULL;
+}
+
+
+static void destroy(void *state)
+{
+	struct realsense *rs = state;
+	objs_delete(rs->objs);
+	free(rs->serial);
+	free(rs->file);
+	free(rs);
+}
+
+// The file that a live stream records to after its iRestart'th restart, for
+// iRestart > 0: "name.1.bag" for a first recording "name.bag", and so on.
+// Returns a malloc'ed name.
+static char *getRestartFile(const char *file, unsigned int iRestart)
+{
+	size_t len = strlen(file);
+	size_t lenSuffix = strlen(RECORDING_SUFFIX);
+	size_t lenStem = len > lenSuffix && !strcmp(file + len - lenSuffix, RECORDING_SUFFIX) ? len - lenSuffix : len;
+
+	// room for the dot and any unsigned int
+	size_t cbName = len + 12;
+	char *name = malloc(cbName);
+	assert(name);
+	snprintf(name, cbName, "%.*s.%u%s", (int) lenStem, file, iRestart, file + lenStem);
+	return name;
+}
+
+// A device only changes its rate when its pipeline is restarted, and the
+// pipeline's recording would start over with it. So instead, every restart
+// records to a file of its own (see getRestartFile), at the new rate. The
+// resolution stays the same, since everything downstream was sized for it.
+// Files always play at the rate that they were recorded at.
+static bool setFps(void *state, unsigned int fps)
+{
+	struct realsense *rs = state;
+	if (!rs->serial) {
+		return false;
+	}
+
+	rs2_error *e = NULL;
+	char *file = getRestartFile(rs->file, rs->cRestarts + 1);
+	rs2_config *config = rs2_create_config(&e);
+	if (e) {
+		config = NULL;
+		goto FAIL;
+	}
+	rs2_config_enable_stream(config, STREAM, STREAM_INDEX, rs->width, rs->height, FORMAT, (int) fps, &e);
+	if (e) {
+		goto FAIL;
+	}
+	rs2_config_enable_device(config, rs->serial, &e);
+	if (e) {
+		goto FAIL;
+	}
+	rs2_config_enable_record_to_file(config, file, &e);
+	if (e) {
+		goto FAIL;
+	}
+
+	rs2_pipeline_stop(rs->objs.pipeline, &e);
+	if (e) {
+		goto FAIL;
+	}
+	rs2_pipeline_profile *profile = rs2_pipeline_start_with_config(rs->objs.pipeline, config, &e);
+	if (e) {
+		// The device has stopped, and starting it at the old rate
+		// again would record over the old file
+		print_error(e);
+		abort();
+	}
+
+	rs2_delete_pipeline_profile(rs->objs.pipeline_profile);
+	rs->objs.pipeline_profile = profile;
+	rs2_delete_config(rs->objs.config);
+	rs->objs.config = config;
+	// these belonged to the old profile
+	rs->objs.stream_profile_list = NULL;
+	rs->objs.stream_profile = NULL;
+
+	rs->iDepth = -1;
+	rs->cRestarts++;
+	printf("librealsense: recording at %u fps to %s\n", fps, file);
+	free(file);
+	return true;
+FAIL:
+	print_error(e);
+	if (config) {
+		rs2_delete_config(config);
+	}
+	free(file);
+	return false;
+}
+
+static bool isDepthFrame(rs2_frame *frame, rs2_error **e)
+{
+	const rs2_stream_profile *profile = rs2_get_frame_stream_profile(frame, e);
+	if (*e) {
+		return false;
+	}
+
+	rs2_stream stream;
+	rs2_format format;
+	int index, uid, framerate;
+	rs2_get_stream_profile_data(profile, &stream, &format, &index, &uid, &framerate, e);
+	if (*e) {
+		return false;
+	}
+
+	return stream == STREAM && format == FORMAT && index == STREAM_INDEX;
+}
+
+// Returns frame iFrame of the frameset `frames` if it is the depth frame, or
+// NULL if it is not. The caller must release the returned frame.
+static rs2_frame *extractIfDepth(rs2_frame *frames, int iFrame, rs2_error **e)
+{
+	rs2_frame *frame = rs2_extract_frame(frames, iFrame, e);
+	if (*e) {
+		return NULL;
+	}
+
+	bool match = isDepthFrame(frame, e);
+	if (*e || !match) {
+		rs2_release_frame(frame);
+		return NULL;
+	}
+	return frame;
+}
+
+// Returns the depth frame within `frames`, which is either a frameset or the
+// depth frame itself. The caller must release the returned frame.
+static rs2_frame *findDepthFrame(struct realsense *rs, rs2_frame *frames, rs2_error **e)
+{
+	bool composite = rs2_is_frame_extendable_to(frames, RS2_EXTENSION_COMPOSITE_FRAME, e);
+	if (*e) {
+		return NULL;
+	}
+	if (!composite) {
+		rs2_frame_add_ref(frames, e);
+		return *e ? NULL : frames;
+	}
+
+	int cFrames = rs2_embedded_frames_count(frames, e);
+	if (*e) {
+		return NULL;
+	}
+
+	// The layout of the pipeline's framesets doesn't change while it is
+	// streaming, so the depth frame is almost always where it was last time.
+	if (rs->iDepth >= 0 && rs->iDepth < cFrames) {
+		rs2_frame *frame = extractIfDepth(frames, rs->iDepth, e);
+		if (frame || *e) {
+			return frame;
+		}
+	}
+
+	for (int iFrame = 0; iFrame < cFrames; iFrame++) {
+		rs2_frame *frame = extractIfDepth(frames, iFrame, e);
+		if (frame || *e) {
+			rs->iDepth = iFrame;
+			return frame;
+		}
+	}
+
+	return NULL;
+}
+
+// Waits for the next frameset from a non real time playback. Returns NULL if
+// there was an error, or if the whole file has been played.
+static rs2_frame *waitForPlayback(struct realsense *rs, rs2_error **e)
+{
+	rs2_frame *frames = NULL;
+	while (!rs->endOfStream) {
+		int success = rs2_pipeline_try_wait_for_frames(rs->objs.pipeline, &frames, 1000, e);
+		if (*e) {
+			return NULL;
+		}
+		if (success) {
+			return frames;
+		}
+
+		// if the playback has stopped, nothing else is coming
+		rs2_playback_status status = rs2_playback_device_get_current_status(rs->objs.dev, e);
+		if (*e) {
+			return NULL;
+		}
+		rs->endOfStream = status == RS2_PLAYBACK_STATUS_STOPPED;
+	}
+	return NULL;
+}
+
+static bool acquire(void *state, struct cameraFrame *frame, unsigned int iHandle)
+{
+	struct realsense *rs = state;
+	(void) iHandle;
+
+	rs2_error* e = NULL;
+	rs2_frame* depth = NULL;
+	bool success = false;
+
+	rs2_frame* frames = NULL;
+	if (rs->replay) {
+		frames = waitForPlayback(rs, &e);
+		if (!frames) {
+			goto DONE;
+		}
+	} else {
+		frames = rs2_pipeline_wait_for_frames(rs->objs.pipeline, RS2_DEFAULT_TIMEOUT, &e);
+		if (e) {
+			frames = NULL;
+			goto DONE;
+		}
+	}
+
+	depth = findDepthFrame(rs, frames, &e);
+	if (!depth) {
+		goto DONE;
+	}
+
+	// We may hold on to several frames at once; tell librealsense not to
+	// count them against its frame pool.
+	rs2_keep_frame(depth);
+
+	const uint16_t* data = (const uint16_t*)(rs2_get_frame_data(depth, &e));
+	if (e) {
+		goto DONE;
+	}
+
+	double timestamp = rs2_get_frame_timestamp(depth, &e);
+	if (e) {
+		goto DONE;
+	}
+	unsigned long long number = rs2_get_frame_number(depth, &e);
+	if (e) {
+		goto DONE;
+	}
+
+	frame->data = data;
+	frame->info.timestamp = timestamp;
+	frame->info.number = number;
+	frame->frame = depth;
+	depth = NULL;
+	success = true;
+
+DONE:
+	if (depth) {
+		rs2_release_frame(depth);
+	}
+	if (frames) {
+		rs2_release_frame(frames);
+	}
+	if (e) {
+		print_error(e);
+	}
+
+	return success;
+}
+
+static void release(void *state, void *frame)
+{
+	(void) state;
+	rs2_release_frame(frame);
+}
+
+static bool endOfStream(void *state)
+{
+	struct realsense *rs = state;
+	return rs->endOfStream;
+}
+
+const struct cameraBackend cameraBackendRealsense = {
+	.name = "librealsense",
+	.accepts = accepts,
+	.init = init,
+	.destroy = destroy,
+	.acquire = acquire,
+	.release = release,
+	.setFps = setFps,
+	.endOfStream = endOfStream,
+	.isDenoised = NULL,
+};
@@ -0,0 +1,318 @@
+// The synthetic backend: generates frames of someone doing pushups, as
+// described in camera.h.
+
+#include <assert.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "args.h"
+#include "camera_backend.h"
+#include "helper.h"
+
+struct params {
+	unsigned long width;
+	unsigned long height;
+	double fps;
+	unsigned long reps;
+	double period;
+	double idle;
+	double depth;
+	double amplitude;
+	unsigned long noise;
+	double holes;
+	unsigned long seed;
+};
+
+struct synthetic {
+	struct params params;
+
+	// true when replaying as fast as possible; see args.replay
+	bool replay;
+	bool endOfStream;
+
+	// how many frames one playthrough lasts
+	unsigned long long cFrames;
+	// the frame that acquire generates next. Keeps counting when real time
+	// playback starts over.
+	unsigned long long iFrame;
+	// how far iFrame advances each time; see setFps
+	unsigned long long step;
+	// the number that the next frame gets; see cameraFrameInfo
+	unsigned long long number;
+	// real time playback only: when frame 0 was played
+	double msStart;
+
+	// the body covers [xMin, xMax) x [yMin, yMax)
+	size_t xMin;
+	size_t xMax;
+	size_t yMin;
+	size_t yMax;
+
+	// frames are generated into buffers[iHandle]
+	uint16_t *buffers[CAMERA_MAX_FRAMES];
+};
+
+// Sets one of `params` from "key=value". Returns false if either is invalid.
+static bool parseParam(struct params *params, const char *param)
+{
+	const char *eq = strchr(param, '=');
+	if (!eq || eq[1] == '\0') {
+		return false;
+	}
+	size_t lenKey = (size_t) (eq - param);
+	const char *value = eq + 1;
+	char *end;
+
+	struct {
+		const char *key;
+		unsigned long *integer;
+		double *real;
+	} keys[] = {
+		{"width", &params->width, NULL},
+		{"height", &params->height, NULL},
+		{"fps", NULL, &params->fps},
+		{"reps", &params->reps, NULL},
+		{"period", NULL, &params->period},
+		{"idle", NULL, &params->idle},
+		{"depth", NULL, &params->depth},
+		{"amplitude", NULL, &params->amplitude},
+		{"noise", &params->noise, NULL},
+		{"holes", NULL, &params->holes},
+		{"seed", &params->seed, NULL},
+	};
+	for (size_t ii = 0; ii < sizeof(keys) / sizeof(*keys); ii++) {
+		if (strlen(keys[ii].key) != lenKey || strncmp(keys[ii].key, param, lenKey)) {
+			continue;
+		}
+		if (keys[ii].integer) {
+			*keys[ii].integer = strtoul(value, &end, 10);
+		} else {
+			*keys[ii].real = strtod(value, &end);
+		}
+		return *end == '\0';
+	}
+	return false;
+}
+
+// Parses everything after CAMERA_SYNTHETIC_PREFIX. Returns false if any of it
+// is invalid.
+static bool parseParams(struct params *params, const char *spec)
+{
+	*params = (struct params) {
+		.width = 848,
+		.height = 480,
+		.fps = CAMERA_FPS,
+		.reps = 10,
+		.period = 1.5,
+		.idle = 10,
+		.depth = 2000,
+		.amplitude = 300,
+		.noise = 3,
+		.holes = 0,
+		.seed = 1,
+	};
+
+	char *copy = strdup(spec);
+	assert(copy);
+	bool success = true;
+	char *save;
+	for (char *param = strtok_r(copy, ",", &save); param; param = strtok_r(NULL, ",", &save)) {
+		if (!parseParam(params, param)) {
+			printf("invalid synthetic camera parameter: %s\n", param);
+			success = false;
+		}
+	}
+	free(copy);
+
+	if (params->width < 16 || params->width > 4096 ||
+	    params->height < 16 || params->height > 4096 ||
+	    !(params->fps > 0) || !(params->period > 0) || !(params->idle >= 0) ||
+	    params->noise > 1000 ||
+	    !(params->depth - params->amplitude - (double) params->noise >= 1) ||
+	    !(params->depth + (double) params->noise <= UINT16_MAX) ||
+	    !(params->holes >= 0 && params->holes <= 1)) {
+		puts("synthetic camera parameters are out of range");
+		success = false;
+	}
+	return success;
+}
+
+// Returns a pseudorandom number that depends only on `x` (splitmix64)
+static uint64_t mix(uint64_t x)
+{
+	x += 0x9E3779B97F4A7C15ull;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+	return x ^ (x >> 31);
+}
+
+// how far the body has moved towards the camera at time `t`, in mm
+static double displacement(const struct params *params, double t)
+{
+	double tActive = t - params->idle;
+	if (tActive < 0 || tActive >= (double) params->reps * params->period) {
+		return 0;
+	}
+	return params->amplitude * (1 - cos(2 * M_PI * tActive / params->period)) / 2;
+}
+
+static void generate(struct synthetic *syn, unsigned long long iFrame, uint16_t *frame)
+{
+	const struct params *params = &syn->params;
+	size_t width = params->width;
+	size_t height = params->height;
+
+	double t = (double) (iFrame % syn->cFrames) / params->fps;
+	double offset = displacement(params, t);
+
+	// Noise is uniform in [-noise, noise]. A pixel is a hole if the top
+	// bits of its random number are below holeThreshold.
+	uint64_t range = 2 * params->noise + 1;
+	uint32_t holeThreshold = (uint32_t) (params->holes * UINT32_MAX);
+	uint64_t state = mix(params->seed ^ mix(iFrame % syn->cFrames));
+
+	for (size_t y = 0; y < height; y++) {
+		bool bodyRow = y >= syn->yMin && y < syn->yMax;
+		for (size_t x = 0; x < width; x++) {
+			double depth = params->depth;
+			if (bodyRow && x >= syn->xMin && x < syn->xMax) {
+				depth -= offset;
+			}
+
+			// xorshift64*
+			state ^= state >> 12;
+			state ^= state << 25;
+			state ^= state >> 27;
+			uint64_t random = state * 0x2545F4914F6CDD1Dull;
+
+			if ((uint32_t) (random >> 32) < holeThreshold) {
+				frame[y * width + x] = 0;
+				continue;
+			}
+			double noise = (double) ((random & UINT32_MAX) % range) - (double) params->noise;
+			frame[y * width + x] = (uint16_t) (depth + noise);
+		}
+	}
+}
+
+static bool accepts(struct args args)
+{
+	return !args.write && !strncmp(args.file, CAMERA_SYNTHETIC_PREFIX, strlen(CAMERA_SYNTHETIC_PREFIX));
+}
+
+static void *init(struct args args, size_t *width, size_t *height)
+{
+	struct params params;
+	if (!parseParams(&params, args.file + strlen(CAMERA_SYNTHETIC_PREFIX))) {
+		return NULL;
+	}
+
+	struct synthetic *syn = calloc(1, sizeof(*syn));
+	assert(syn);
+	syn->params = params;
+	syn->replay = args.replay;
+	syn->endOfStream = false;
+	syn->iFrame = 0;
+	syn->step = 1;
+	syn->number = 0;
+	syn->msStart = getMonotonicTimeInMs();
+
+	double seconds = 2 * params.idle + (double) params.reps * params.period;
+	syn->cFrames = (unsigned long long) ceil(seconds * params.fps);
+	if (!syn->cFrames) {
+		syn->cFrames = 1;
+	}
+
+	// the body fills the middle of the frame
+	syn->xMin = params.width / 4;
+	syn->xMax = params.width * 3 / 4;
+	syn->yMin = params.height * 21 / 100;
+	syn->yMax = params.height * 83 / 100;
+
+	*width = params.width;
+	*height = params.height;
+	return syn;
+}
+
+static void destroy(void *state)
+{
+	struct synthetic *syn = state;
+	for (unsigned int iHandle = 0; iHandle < CAMERA_MAX_FRAMES; iHandle++) {
+		free(syn->buffers[iHandle]);
+	}
+	free(syn);
+}
+
+static bool acquire(void *state, struct cameraFrame *frame, unsigned int iHandle)
+{
+	struct synthetic *syn = state;
+	if (syn->replay && syn->iFrame >= syn->cFrames) {
+		syn->endOfStream = true;
+		return false;
+	}
+
+	double timestamp = (double) syn->iFrame * 1000 / syn->params.fps;
+	if (!syn->replay) {
+		double msDue = syn->msStart + timestamp;
+		double now = getMonotonicTimeInMs();
+		if (msDue > now) {
+			// wait until the frame is due
+			usleep((useconds_t) ((msDue - now) * 1000));
+		} else {
+			// Like a real camera, only keep the newest frame: any
+			// that were replaced before anyone asked for them are
+			// lost.
+			double msStep = (double) syn->step * 1000 / syn->params.fps;
+			unsigned long long cLost = (unsigned long long) ((now - msDue) / msStep);
+			syn->iFrame += cLost * syn->step;
+			syn->number += cLost;
+			timestamp = (double) syn->iFrame * 1000 / syn->params.fps;
+		}
+	}
+
+	if (!syn->buffers[iHandle]) {
+		syn->buffers[iHandle] = malloc(sizeof(uint16_t) * syn->params.width * syn->params.height);
+		assert(syn->buffers[iHandle]);
+	}
+	generate(syn, syn->iFrame, syn->buffers[iHandle]);
+	syn->iFrame += syn->step;
+
+	frame->data = syn->buffers[iHandle];
+	frame->info.timestamp = timestamp;
+	frame->info.number = syn->number++;
+	frame->frame = NULL;
+	return true;
+}
+
+// Only generates every step'th frame of the same timeline, the way a camera
+// running at a lower rate would only capture some of them
+static bool setFps(void *state, unsigned int fps)
+{
+	struct synthetic *syn = state;
+	double step = fps < CAMERA_FPS ? round(syn->params.fps / fps) : 1;
+	syn->step = step >= 1 ? (unsigned long long) step : 1;
+	return true;
+}
+
+static bool endOfStream(void *state)
+{
+	struct synthetic *syn = state;
+	return syn->endOfStream;
+}
+
+const struct cameraBackend cameraBackendSynthetic = {
+	.name = "synthetic",
+	.accepts = accepts,
+	.init = init,
+	.destroy = destroy,
+	.acquire = acquire,
+	.release = NULL,
+	.setFps = setFps,
+	.endOfStream = endOfStream,
+	.isDenoised = NULL,
+};
@@ -1,226 +1,1126 @@
 #include <assert.h>
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "archive.h"
 #include "camera.h"
 #include "ccamera.h"
+#include "filter.h"
 #include "helper.h"
+#include "median.h"
+#include "pyramid.h"
+#include "workerpool.h"
 
-static unsigned int sample_size;
-static unsigned int sample_delta;
-static unsigned int cFrames;
+struct ccamera {
+	struct camera *camera;
+	struct framePool *pool;
 
-// a buffer for intermediate calculations of size sufficient to store an entire
-// frame.
-static uint16_t *scratch;
+	unsigned int sample_size;
+	unsigned int sample_delta;
+	unsigned int cFrames;
+	bool incremental;
 
-// the cFrames most recent frames from the camera. Large indicies are newer.
-static uint16_t **frames;
+	// the cFrames most recent frames from the camera. Large indicies are
+	// newer. These are borrowed from the camera; the pixel data is never
+	// copied.
+	struct cameraFrame **frames;
 
+	// Every denoised frame lives in one of these slots. A slot is free when
+	// its `refs` is zero; only the background thread ever takes a reference
+	// to a free slot, so it can safely compute into any free slot it finds.
+	//
+	// There are enough slots for the history, the frame being computed, and
+	// CCAMERA_MAX_VIEWS views held by readers. Their buffers come from
+	// `pool`.
+	struct ccameraFrame *slots;
+	unsigned int cSlots;
 
-static uint16_t *frameNew, *frameOld;
+	// The sample_delta+1 most recently published frames; large indicies
+	// are newer. Each is the median of a window that starts one frame later
+	// than the one before it, so history[0] is frameOld and
+	// history[sample_delta] is frameNew. Each entry holds one reference to
+	// its slot. Only used by the background thread.
+	struct ccameraFrame **history;
+	unsigned int cHistory;
 
-// mutRecent is a mutex specifically for accessing frameNew and frameOld
-static pthread_mutex_t mutRecent = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
+	// The most recently published frame, i.e. the current frameNew.
+	struct ccameraFrame *published;
+	unsigned long long seqNext;
 
-static pthread_t background;
-static bool stopRequested;
+	// In incremental mode, the per pixel sorted contents of the window that
+	// frameNew is the median of.
+	struct medianWindow *window;
+
+	// In slab mode, frameNew's window, i.e. the newest sample_size frames,
+	// interleaved. iSlabOldest is the slot with the oldest of them.
+	struct medianSlab *slab;
+	unsigned int iSlabOldest;
+
+	// Everything after the median. When there is anything, the median
+	// goes to `raw` first, and the chain writes the frame from there.
+	struct filterChain *filters;
+	uint16_t *raw;
+
+	// the size of each of the published frame's levels, and how long
+	// building levels 1 and up has taken
+	size_t levelWidths[CCAMERA_LEVELS];
+	size_t levelHeights[CCAMERA_LEVELS];
+	double msLevels;
+	unsigned long long cLevels;
+
+	// How many frames the camera has dropped, which only the background
+	// thread changes, and the total and worst time between the camera
+	// handing a frame over and it having been denoised, for every frame
+	// added to the history. The latter belong to mutPublish.
+	unsigned long long cDropped;
+	double msLatency;
+	double msLatencyMax;
+
+	// The rate that the camera should run at (see ccameraSetFps), and the
+	// rate that it does. Only the background thread touches `fps`.
+	unsigned int fpsRequested;
+	unsigned int fps;
+
+	// Each median is split into one band of rows per thread. A band only
+	// ever touches its own part of every frame and of `window`.
+	struct workerPool *workers;
+
+	// Replay mode (see ccameraIsReplay). seqTaken is the sequence number of
+	// the last frame handed to a reader; the background thread doesn't
+	// publish a new frame until the current one has been taken. msTaken is
+	// that frame's camera timestamp. None of this is used outside of
+	// replay mode.
+	bool replay;
+	bool endOfStream;
+	unsigned long long seqTaken;
+	double msTaken;
+
+	// Held whenever the history changes. condPublish is broadcast whenever
+	// a frame is published, and in replay mode, whenever one is taken.
+	pthread_mutex_t mutPublish;
+	pthread_cond_t condPublish;
+
+	// if not NULL, every published frame is also written here
+	struct archiveWriter *archive;
+
+	pthread_t background;
+	bool stopRequested;
+};
 
 static void *backgroundMain(void *);
 
-int ccameraInit(struct args args)
+// pixels per cache line
+#define BAND_ALIGN (64 / sizeof(uint16_t))
+
+// how long getFreeSlot waits for a reader to release a view before giving up
+#define MS_SLOT_WAIT_MAX 1000
+
+// The next frame to compute, as handed to each of the workers
+struct medianJob {
+	struct ccamera *cam;
+	enum {
+		// from `frames`, starting at iStart
+		JOB_COMPUTE,
+		// by moving `window` from frameEvicted to frameAdded
+		JOB_UPDATE,
+		// by storing frameAdded over the oldest frame in `slab`
+		JOB_SLAB,
+	} kind;
+	uint16_t *frameOut;
+	unsigned int iStart;
+	const uint16_t *frameEvicted;
+	const uint16_t *frameAdded;
+};
+
+// The number of pixels in the camera's frames. The median works on these; it's
+// only the frames that come out of the filter chain that may be smaller.
+static size_t getNumRawPixels(struct ccamera *cam)
 {
-	int fail;
+	return cameraGetFrameWidth(cam->camera) * cameraGetFrameHeight(cam->camera);
+}
 
-	fail = cameraInit(args);
-	if (fail) {
-		return fail;
+// the first pixel of band iBand of cBands
+static size_t bandStart(struct ccamera *cam, unsigned int iBand, unsigned int cBands)
+{
+	if (iBand == cBands) {
+		return getNumRawPixels(cam);
 	}
 
-	sample_size = args.ccamera_sample_size;
-	sample_delta = args.ccamera_sample_delta;
-	stopRequested = false;
+	size_t y = cameraGetFrameHeight(cam->camera) * iBand / cBands;
+	size_t iPixel = y * cameraGetFrameWidth(cam->camera);
+	return iPixel - iPixel % BAND_ALIGN;
+}
+
+// Sets [*iFirst, *iFirst + *cPixels) to the pixels in band iBand of cBands.
+// Bands are roughly equal runs of rows, nudged so that each one starts on a
+// cache line and no two of them ever write to the same line.
+static void getBand(struct ccamera *cam, unsigned int iBand, unsigned int cBands, size_t *iFirst, size_t *cPixels)
+{
+	*iFirst = bandStart(cam, iBand, cBands);
+	*cPixels = bandStart(cam, iBand + 1, cBands) - *iFirst;
+}
 
-	cFrames = sample_size + sample_delta;
+static void medianBand(void *arg, unsigned int iBand, unsigned int cBands)
+{
+	struct medianJob *job = arg;
+	struct ccamera *cam = job->cam;
+	size_t iFirst, cPixels;
+	getBand(cam, iBand, cBands, &iFirst, &cPixels);
 
-	frames = malloc(sizeof(*frames) * cFrames);
-	assert(frames);
+	if (job->kind == JOB_UPDATE) {
+		medianWindowUpdateRange(cam->window, iFirst, cPixels, job->frameEvicted, job->frameAdded, job->frameOut);
+		return;
+	}
+	if (job->kind == JOB_SLAB) {
+		unsigned int iSlot = cam->iSlabOldest;
+		medianSlabStore(cam->slab, iSlot, job->frameAdded, iFirst, cPixels);
+		// the order of the window doesn't matter, so the median can
+		// start at the newest frame just as well as the oldest
+		medianSlabCompute(cam->slab, iSlot, cam->sample_size, iFirst, cPixels, job->frameOut);
+		return;
+	}
 
-	for (unsigned int i = 0; i < cFrames; i++) {
-		frames[i] = malloc(ccameraGetFrameSize());
-		assert(frames[i]);
-		assert(!cameraGetFrame(frames[i]));
+	const uint16_t *data[cam->sample_size];
+	for (unsigned int ii = 0; ii < cam->sample_size; ii++) {
+		data[ii] = cam->frames[job->iStart + ii]->data + iFirst;
 	}
+	medianCompute(data, cam->sample_size, cPixels, job->frameOut + iFirst);
+}
 
-	frameNew = malloc(sizeof(*frameNew) * ccameraGetNumPixels());
-	frameOld = malloc(sizeof(*frameOld) * ccameraGetNumPixels());
-	scratch = malloc(sizeof(*frameOld) * ccameraGetNumPixels());
-	assert(frameNew && frameOld && scratch);
+// After calling this function, frameOut[i] is the median of frames[j][i] for j
+// in [iStart, iStart+sample_size)
+static void computeMedian(struct ccamera *cam, uint16_t *frameOut, unsigned int iStart)
+{
+	if (cam->sample_size == 1) {
+		memcpy(frameOut, cam->frames[iStart]->data, sizeof(*frameOut) * getNumRawPixels(cam));
+		return;
+	}
 
-	fail = pthread_create(&background, NULL, &backgroundMain, NULL);
-	assert(!fail);
+	struct medianJob job = {cam, JOB_COMPUTE, frameOut, iStart, NULL, NULL};
+	workerPoolRun(cam->workers, medianBand, &job);
+}
 
-	return 0;
+// Incremental mode: moves `window` along by one frame, and writes its new
+// median to frameOut
+static void updateMedian(struct ccamera *cam, const uint16_t *frameEvicted, const uint16_t *frameAdded, uint16_t *frameOut)
+{
+	struct medianJob job = {cam, JOB_UPDATE, frameOut, 0, frameEvicted, frameAdded};
+	workerPoolRun(cam->workers, medianBand, &job);
 }
 
-int ccameraDestroy()
+// Slab mode: replaces the oldest frame in `slab` with frameAdded, and writes
+// the median of the result to frameOut
+static void slabMedian(struct ccamera *cam, const uint16_t *frameAdded, uint16_t *frameOut)
 {
-	// the mutex does not need to be locked for this function because:
-	// A: we don't need the mutex to wait for other threads to exit
-	// B: locking may prevent other threads from exiting
-	// C: after other threads have exited, there's no point in locking
+	struct medianJob job = {cam, JOB_SLAB, frameOut, 0, NULL, frameAdded};
+	workerPoolRun(cam->workers, medianBand, &job);
+	cam->iSlabOldest = (cam->iSlabOldest + 1) % cam->sample_size;
+}
 
-	stopRequested = true;
-	struct timespec stop = {time(NULL) + 2, 0};
-	int fail = pthread_timedjoin_np(background, NULL, &stop);
-	assert(!fail);
+// Where the median (or the raw frame, without one) should be written for
+// `frame`: straight into it, unless the filter chain has more to do
+static uint16_t *getMedianOut(struct ccamera *cam, struct ccameraFrame *frame)
+{
+	return filterChainHasStages(cam->filters) ? cam->raw : frame->buf;
+}
 
-	assert(!pthread_mutex_destroy(&mutRecent));
+// Runs the rest of the filter chain, after the median has been written to
+// getMedianOut(cam, frame) in msMedian ms
+static void applyFilters(struct ccamera *cam, struct ccameraFrame *frame, double msMedian)
+{
+	if (cam->sample_size > 1) {
+		filterChainAddMedianTime(cam->filters, msMedian);
+	}
+	if (filterChainHasStages(cam->filters)) {
+		filterChainApply(cam->filters, cam->raw, frame->buf);
+	}
+}
+
+// Computes levels 1 and up of `frame` from its data, and its cActive. Must be
+// called just before `frame` is added to the history.
+static void buildLevels(struct ccamera *cam, struct ccameraFrame *frame)
+{
+	double msStart = getMonotonicTimeInMs();
 
-	for (unsigned int i = 0; i < cFrames; i++) {
-		free(frames[i]);
+	// what will be frame->older once it's in the history. Until the
+	// history is full, that may not exist yet.
+	unsigned int iSmallest = CCAMERA_LEVELS - 1;
+	const uint16_t *older = NULL;
+	if (cam->cHistory > 1 && cam->history[1]) {
+		older = cam->history[1]->levels[iSmallest];
 	}
-	free(frames);
-	free(frameNew);
-	free(frameOld);
-	free(scratch);
 
-	assert(!cameraDestroy());
+	bool counted = false;
+	frame->cActive = 0;
+	for (unsigned int iLevel = 1; iLevel < CCAMERA_LEVELS; iLevel++) {
+		if (frame->levels[iLevel] == frame->levels[iLevel-1]) {
+			continue;
+		}
+		const uint16_t *previous = iLevel == iSmallest ? older : NULL;
+		size_t cActive = pyramidHalveAndCompare(frame->levels[iLevel-1], cam->levelWidths[iLevel-1],
+			cam->levelHeights[iLevel-1], (uint16_t *) frame->levels[iLevel], previous, CCAMERA_ACTIVE_DEPTH);
+		if (previous) {
+			frame->cActive = cActive;
+			counted = true;
+		}
+	}
 
-	return 0;
+	// the smallest level is the same as a bigger one
+	if (older && !counted) {
+		frame->cActive = pyramidCountChanged(frame->levels[iSmallest], older,
+			ccameraGetLevelNumPixels(cam, iSmallest), CCAMERA_ACTIVE_DEPTH);
+	}
+
+	cam->msLevels += getMonotonicTimeInMs() - msStart;
+	cam->cLevels++;
+}
+
+// Fills in `frame`'s info, now that it has been denoised
+static void stampFrame(struct ccamera *cam, struct ccameraFrame *frame)
+{
+	frame->info.camera = cam->frames[cam->cFrames-1]->info;
+	frame->info.msDenoised = getMonotonicTimeInMs();
 }
 
-static void pixelSort(uint16_t *buf, size_t cPix)
+// cameraAcquireFrame, keeping count of the frames that the camera drops
+static struct cameraFrame *acquireFrame(struct ccamera *cam)
 {
-	// if this fails, the function needs to be optimized for large inputs
-	assert(cPix < 30);
+	struct cameraFrame *frame = cameraAcquireFrame(cam->camera);
+	if (frame) {
+		__atomic_fetch_add(&cam->cDropped, frame->info.cDropped, __ATOMIC_RELAXED);
+	}
+	return frame;
+}
 
-	//  insertion sort
-	for(size_t ii = 1; ii < cPix; ii++) {
-		// buf is sorted for indicies strictly less than ii
+// Takes a reference to `frame`, unless it has already been freed. Returns true
+// on success.
+static bool tryRef(struct ccameraFrame *frame)
+{
+	unsigned int refs = __atomic_load_n(&frame->refs, __ATOMIC_ACQUIRE);
+	while (refs) {
+		if (__atomic_compare_exchange_n(&frame->refs, &refs, refs + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+			return true;
+		}
+	}
+	return false;
+}
 
-		uint16_t tmp = buf[ii];
+static void unref(struct ccameraFrame *frame)
+{
+	unsigned int refs = __atomic_fetch_sub(&frame->refs, 1, __ATOMIC_RELEASE);
+	assert(refs > 0);
+}
 
-		// shift right-most elements right by one until we've found the
-		// spot for `tmp`
-		size_t ij = ii;
-		while(ij > 0 && tmp < buf[ij-1]) {
-			buf[ij] = buf[ij - 1];
-			ij--;
+// Returns a slot that no one else has a reference to. The slot's contents may
+// be overwritten freely until it is published.
+static struct ccameraFrame *getFreeSlot(struct ccamera *cam)
+{
+	double msStart = 0;
+	while (true) {
+		for (unsigned int iSlot = 0; iSlot < cam->cSlots; iSlot++) {
+			if (!__atomic_load_n(&cam->slots[iSlot].refs, __ATOMIC_ACQUIRE)) {
+				return &cam->slots[iSlot];
+			}
 		}
 
-		buf[ij] = tmp;
+		// There are more than CCAMERA_MAX_VIEWS views. Wait for a reader
+		// to release one, but not forever: a reader that never does
+		// would otherwise hang the background thread without a word.
+		double msNow = getMonotonicTimeInMs();
+		msStart = msStart ? msStart : msNow;
+		if (msNow - msStart > MS_SLOT_WAIT_MAX) {
+			printf("ccamera: no frame was released for %u ms; more than %u views are held\n",
+				MS_SLOT_WAIT_MAX, CCAMERA_MAX_VIEWS);
+			abort();
+		}
+		sched_yield();
 	}
 }
 
-// After calling this function, frameOut[i] is the median of frames[j][i] for j
-// in [iStart, iStart+sample_size)
-//
-// scratch is a temporary storage buffer of sufficient size to store at least sample_size+iStart pixels.
-static void computeMedian(uint16_t *frameOut, unsigned int iStart, uint16_t *scratch)
+// Adds `frame` to the history as the new frameNew, without making it visible
+// to readers yet. Needs mutPublish.
+static void addToHistory(struct ccamera *cam, struct ccameraFrame *frame)
+{
+	struct ccameraFrame **history = cam->history;
+	frame->seq = cam->seqNext++;
+
+	// rotate `history`; the oldest frame drops out and loses the reference
+	// that the history held.
+	if (history[0]) {
+		unref(history[0]);
+	}
+	for (unsigned int iHistory = 1; iHistory < cam->cHistory; iHistory++) {
+		history[iHistory-1] = history[iHistory];
+	}
+	history[cam->cHistory-1] = frame;
+
+	frame->older = history[0];
+	__atomic_store_n(&frame->refs, 1, __ATOMIC_RELEASE);
+
+	double msLatency = frame->info.msDenoised - frame->info.camera.msAcquired;
+	cam->msLatency += msLatency;
+	cam->msLatencyMax = msLatency > cam->msLatencyMax ? msLatency : cam->msLatencyMax;
+}
+
+// Adds `frame` to the history as the new frameNew, makes it visible to
+// readers, and wakes any that are waiting for it. Needs mutPublish.
+static void publishLocked(struct ccamera *cam, struct ccameraFrame *frame)
+{
+	addToHistory(cam, frame);
+	__atomic_store_n(&cam->published, frame, __ATOMIC_RELEASE);
+	assert(!pthread_cond_broadcast(&cam->condPublish));
+}
+
+static void publish(struct ccamera *cam, struct ccameraFrame *frame)
+{
+	assert(!pthread_mutex_lock(&cam->mutPublish));
+	publishLocked(cam, frame);
+	assert(!pthread_mutex_unlock(&cam->mutPublish));
+}
+
+// Writes the frame that is about to be published to the archive, if there is
+// one.
+static void archiveNext(struct ccamera *cam, struct ccameraFrame *frame)
+{
+	if (cam->archive) {
+		int fail = archiveWrite(cam->archive, frame->buf, frame->info.camera.timestamp);
+		assert(!fail);
+	}
+}
+
+// publish(), but in replay mode first waits until the current frame has been
+// handed to a reader.
+static void publishNext(struct ccamera *cam, struct ccameraFrame *frame)
+{
+	if (!cam->replay) {
+		publish(cam, frame);
+		return;
+	}
+
+	assert(!pthread_mutex_lock(&cam->mutPublish));
+	while (!cam->stopRequested && cam->seqTaken != cam->published->seq) {
+		assert(!pthread_cond_wait(&cam->condPublish, &cam->mutPublish));
+	}
+	publishLocked(cam, frame);
+	assert(!pthread_mutex_unlock(&cam->mutPublish));
+}
+
+// Fills the history with every window that fits in `frames`, and starts the
+// incremental window and the slab over from them. Only the last of the new
+// frames is published, so readers never see a frameNew and frameOld from
+// different sets of `frames`.
+static void seedHistory(struct ccamera *cam)
 {
-	unsigned int iEnd    = iStart + sample_size;
-	unsigned int iMedian = iStart + sample_size / 2;
-	size_t cPixels = ccameraGetNumPixels();
+	for (unsigned int i = 0; i < cam->cHistory; i++) {
+		struct ccameraFrame *frame = getFreeSlot(cam);
+		double msStart = getMonotonicTimeInMs();
+		computeMedian(cam, getMedianOut(cam, frame), i);
+		applyFilters(cam, frame, getMonotonicTimeInMs() - msStart);
+		buildLevels(cam, frame);
+		stampFrame(cam, frame);
+		archiveNext(cam, frame);
+		if (i + 1 < cam->cHistory) {
+			assert(!pthread_mutex_lock(&cam->mutPublish));
+			addToHistory(cam, frame);
+			assert(!pthread_mutex_unlock(&cam->mutPublish));
+		} else {
+			publish(cam, frame);
+		}
+	}
 
-	for (size_t iPixel = 0; iPixel < cPixels; iPixel++) {
-		for (unsigned int iFrame = iStart; iFrame < iEnd; iFrame++) {
-			scratch[iFrame] = frames[iFrame][iPixel];
+	if (cam->incremental) {
+		const uint16_t *data[cam->sample_size];
+		for (unsigned int ii = 0; ii < cam->sample_size; ii++) {
+			data[ii] = cam->frames[cam->sample_delta + ii]->data;
+		}
+		if (cam->window) {
+			medianWindowDestroy(cam->window);
 		}
+		cam->window = medianWindowInit(data, cam->sample_size, getNumRawPixels(cam));
+	}
 
-		pixelSort(scratch, sample_size);
-		frameOut[iPixel] = scratch[iMedian];
+	if (cam->slab) {
+		for (unsigned int ii = 0; ii < cam->sample_size; ii++) {
+			medianSlabStore(cam->slab, ii, cam->frames[cam->sample_delta + ii]->data, 0, getNumRawPixels(cam));
+		}
+		cam->iSlabOldest = 0;
 	}
 }
 
-void *backgroundMain(void *foo)
+// Switches the camera to `fps`. Everything in `frames` and the history was
+// sampled at the old rate, so both start over from the first new frame. Waiting
+// for cFrames new ones instead would hold back the next publication by over a
+// second at low rates. Every entry of `frames` refers to that one frame, so it
+// is published as is, and the usual rotation then replaces the copies one new
+// frame at a time.
+static void switchFps(struct ccamera *cam, unsigned int fps)
 {
-	(void) foo;
+	double msStart = getMonotonicTimeInMs();
+	for (unsigned int i = 0; i < cam->cFrames; i++) {
+		cameraRelease(cam->frames[i]);
+	}
+	cameraSetFps(cam->camera, fps);
+	double msCamera = getMonotonicTimeInMs() - msStart;
 
-	unsigned long long before = 0;
-	unsigned long long after = 0;
-	unsigned int dropped = 0;
-	while(!stopRequested) {
-		// rotate `frames` array
-		uint16_t *tmp = frames[0];
-		for (unsigned int iFrame = 1; iFrame < cFrames; iFrame++) {
-			frames[iFrame-1] = frames[iFrame];
+	// only live streams switch, and they never end
+	struct cameraFrame *first = acquireFrame(cam);
+	assert(first);
+	cam->frames[0] = first;
+	for (unsigned int i = 1; i < cam->cFrames; i++) {
+		cameraAddRef(first);
+		cam->frames[i] = first;
+	}
+	seedHistory(cam);
+	cam->fps = fps;
+
+	printf("ccamera: switched to %u fps in %.1f ms (camera: %.1f ms)\n", fps,
+		getMonotonicTimeInMs() - msStart, msCamera);
+}
+
+struct ccamera *ccameraInit(struct args args)
+{
+	struct ccamera *cam = calloc(1, sizeof(*cam));
+	assert(cam);
+
+	cam->camera = cameraInit(args);
+	if (!cam->camera) {
+		free(cam);
+		return NULL;
+	}
+
+	cam->sample_size = args.ccamera_sample_size;
+	cam->sample_delta = args.ccamera_sample_delta;
+	cam->incremental = args.ccamera_incremental;
+	cam->filters = filterChainInit(args.ccamera_filters, cameraGetFrameWidth(cam->camera),
+		cameraGetFrameHeight(cam->camera));
+	if (!cam->filters) {
+		assert(!cameraDestroy(cam->camera));
+		free(cam);
+		return NULL;
+	}
+	printf("ccamera: filters: %s\n", args.ccamera_filters);
+	cam->raw = NULL;
+	if (filterChainHasStages(cam->filters)) {
+		cam->raw = malloc(sizeof(*cam->raw) * getNumRawPixels(cam));
+		assert(cam->raw);
+	}
+
+	if (!filterChainHasMedian(cam->filters)) {
+		cam->sample_size = 1;
+		cam->incremental = false;
+	} else if (cameraIsDenoised(cam->camera)) {
+		// denoising again would only blur motion
+		puts("ccamera: recording is already denoised");
+		cam->sample_size = 1;
+		cam->incremental = false;
+	}
+	cam->replay = args.replay && !args.write;
+	cam->endOfStream = false;
+	cam->stopRequested = false;
+
+	cam->cFrames = cam->sample_size + cam->sample_delta;
+	cam->cHistory = cam->sample_delta + 1;
+	cam->cSlots = cam->cHistory + 1 + CCAMERA_MAX_VIEWS;
+	cam->seqNext = 0;
+	cam->cDropped = 0;
+	cam->msLatency = 0;
+	cam->msLatencyMax = 0;
+
+	cam->mutPublish = (pthread_mutex_t) PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
+	// ccameraWaitFrame's deadlines are on the monotonic clock, so that
+	// setting the system time can't stretch or cut short a wait.
+	pthread_condattr_t condAttr;
+	assert(!pthread_condattr_init(&condAttr));
+	assert(!pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC));
+	assert(!pthread_cond_init(&cam->condPublish, &condAttr));
+	assert(!pthread_condattr_destroy(&condAttr));
+
+	// the sample that incremental mode evicts from the window must still be
+	// in `frames` after it has been rotated.
+	assert(!cam->incremental || cam->sample_delta > 0);
+
+	printf("ccamera: reading frames from %s\n", cameraGetBackendName(cam->camera));
+	medianInit();
+	if (cam->incremental) {
+		puts("ccamera: using incremental median");
+	} else if (cam->sample_size > 1) {
+		printf("ccamera: using %s median engine\n", medianEngineName(medianGetEngine()));
+	}
+
+	cam->frames = malloc(sizeof(*cam->frames) * cam->cFrames);
+	assert(cam->frames);
+
+	// the camera has to be able to hand out a new frame while we hold
+	// all of these
+	assert(cam->cFrames < CAMERA_MAX_FRAMES);
+	for (unsigned int i = 0; i < cam->cFrames; i++) {
+		cam->frames[i] = acquireFrame(cam);
+		if (!cam->frames[i]) {
+			// the recording is too short to denoise even once
+			while (i--) {
+				cameraRelease(cam->frames[i]);
+			}
+			free(cam->frames);
+			free(cam->raw);
+			filterChainDestroy(cam->filters);
+			assert(!cameraDestroy(cam->camera));
+			free(cam);
+			return NULL;
+		}
+	}
+
+	cam->archive = NULL;
+	if (args.archive_file) {
+		cam->archive = archiveCreate(args.archive_file, ccameraGetFrameWidth(cam),
+			ccameraGetFrameHeight(cam), ARCHIVE_DENOISED);
+		if (!cam->archive) {
+			printf("Could not create archive %s\n", args.archive_file);
+			for (unsigned int i = 0; i < cam->cFrames; i++) {
+				cameraRelease(cam->frames[i]);
+			}
+			free(cam->frames);
+			free(cam->raw);
+			filterChainDestroy(cam->filters);
+			assert(!cameraDestroy(cam->camera));
+			free(cam);
+			return NULL;
+		}
+	}
+
+	unsigned int cThreads = args.ccamera_threads;
+	if (!cThreads) {
+		long cCpus = sysconf(_SC_NPROCESSORS_ONLN);
+		cThreads = cCpus > 0 ? (unsigned int) cCpus : 1;
+	}
+	// every band needs at least one row
+	if (cThreads > cameraGetFrameHeight(cam->camera)) {
+		cThreads = (unsigned int) cameraGetFrameHeight(cam->camera);
+	}
+	cam->workers = workerPoolInit(cThreads);
+	if (cThreads > 1) {
+		printf("ccamera: computing medians on %u threads\n", cThreads);
+	}
+
+	cam->pool = framePoolInit(ccameraGetFrameSize(cam), sizeof(struct ccameraFrameInfo),
+		cam->cSlots + CCAMERA_POOL_FRAMES);
+	assert(cam->pool);
+
+	cam->levelWidths[0] = ccameraGetFrameWidth(cam);
+	cam->levelHeights[0] = ccameraGetFrameHeight(cam);
+	size_t cLevelPixels = 0;
+	for (unsigned int iLevel = 1; iLevel < CCAMERA_LEVELS; iLevel++) {
+		size_t width = cam->levelWidths[iLevel-1];
+		size_t height = cam->levelHeights[iLevel-1];
+		if (width >= 2 && height >= 2) {
+			width /= 2;
+			height /= 2;
+			cLevelPixels += width * height;
+		}
+		cam->levelWidths[iLevel] = width;
+		cam->levelHeights[iLevel] = height;
+	}
+	cam->msLevels = 0;
+	cam->cLevels = 0;
+
+	cam->slots = malloc(sizeof(*cam->slots) * cam->cSlots);
+	assert(cam->slots);
+	for (unsigned int i = 0; i < cam->cSlots; i++) {
+		struct ccameraFrame *slot = &cam->slots[i];
+		slot->buf = framePoolAlloc(cam->pool);
+		assert(slot->buf);
+		slot->data = slot->buf;
+
+		// levels 1 and up share one allocation
+		slot->levelBuf = malloc(sizeof(*slot->levelBuf) * (cLevelPixels ? cLevelPixels : 1));
+		assert(slot->levelBuf);
+		slot->levels[0] = slot->buf;
+		uint16_t *level = slot->levelBuf;
+		for (unsigned int iLevel = 1; iLevel < CCAMERA_LEVELS; iLevel++) {
+			if (cam->levelWidths[iLevel] == cam->levelWidths[iLevel-1]) {
+				slot->levels[iLevel] = slot->levels[iLevel-1];
+				continue;
+			}
+			slot->levels[iLevel] = level;
+			level += cam->levelWidths[iLevel] * cam->levelHeights[iLevel];
+		}
+		slot->cActive = 0;
+		slot->seq = 0;
+		slot->refs = 0;
+		slot->older = NULL;
+	}
+
+	cam->history = calloc(cam->cHistory, sizeof(*cam->history));
+	assert(cam->history);
+
+	cam->window = NULL;
+	cam->slab = NULL;
+	cam->iSlabOldest = 0;
+	if (args.ccamera_slab && !cam->incremental && cam->sample_size > 1) {
+		cam->slab = medianSlabInit(cam->sample_size, getNumRawPixels(cam));
+	}
+	cam->fps = CAMERA_FPS;
+	cam->fpsRequested = CAMERA_FPS;
+
+	seedHistory(cam);
+	// the first reader gets the newest of those
+	cam->seqTaken = cam->published->seq - 1;
+	cam->msTaken = cam->published->info.camera.timestamp;
+
+	int fail = pthread_create(&cam->background, NULL, &backgroundMain, cam);
+	assert(!fail);
+
+	return cam;
+}
+
+int ccameraDestroy(struct ccamera *cam)
+{
+	assert(!pthread_mutex_lock(&cam->mutPublish));
+	cam->stopRequested = true;
+	assert(!pthread_cond_broadcast(&cam->condPublish));
+	assert(!pthread_mutex_unlock(&cam->mutPublish));
+
+	struct timespec stop = {time(NULL) + 2, 0};
+	int fail = pthread_timedjoin_np(cam->background, NULL, &stop);
+	assert(!fail);
+
+	if (cam->archive) {
+		fail = archiveFinish(cam->archive);
+		assert(!fail);
+	}
+
+	for (unsigned int i = 0; i < cam->cHistory; i++) {
+		unref(cam->history[i]);
+	}
+	free(cam->history);
+
+	for (unsigned int i = 0; i < cam->cSlots; i++) {
+		// if this fails, someone never released a view
+		assert(cam->slots[i].refs == 0);
+		framePoolRelease(cam->pool, cam->slots[i].buf);
+		free(cam->slots[i].levelBuf);
+	}
+	free(cam->slots);
+	framePoolDestroy(cam->pool);
+
+	for (unsigned int i = 0; i < cam->cFrames; i++) {
+		cameraRelease(cam->frames[i]);
+	}
+	free(cam->frames);
+	if (cam->window) {
+		medianWindowDestroy(cam->window);
+	}
+	if (cam->slab) {
+		medianSlabDestroy(cam->slab);
+	}
+	workerPoolDestroy(cam->workers);
+
+	struct filterStats stats[FILTER_MAX_STAGES];
+	unsigned int cStats = filterChainGetStats(cam->filters, stats);
+	for (unsigned int ii = 0; ii < cStats; ii++) {
+		if (stats[ii].cFrames) {
+			printf("ccamera: %s took %.3f ms per frame\n", stats[ii].name, stats[ii].msTotal / (double) stats[ii].cFrames);
+		}
+	}
+	if (cam->cLevels) {
+		printf("ccamera: levels took %.3f ms per frame\n", cam->msLevels / (double) cam->cLevels);
+	}
+	struct ccameraStats camStats = ccameraGetStats(cam);
+	if (camStats.cFrames) {
+		printf("ccamera: frames were denoised %.1f ms after the camera handed them over (at most %.1f ms)\n",
+			camStats.msLatency, camStats.msLatencyMax);
+	}
+	if (camStats.cDropped) {
+		printf("ccamera: the camera dropped %llu frames\n", camStats.cDropped);
+	}
+	filterChainDestroy(cam->filters);
+	free(cam->raw);
+
+	assert(!cameraDestroy(cam->camera));
+	free(cam);
+
+	return 0;
+}
+
+void *backgroundMain(void *arg)
+{
+	struct ccamera *cam = arg;
+	struct cameraFrame **frames = cam->frames;
+	unsigned int cFrames = cam->cFrames;
+
+	while(!cam->stopRequested) {
+		unsigned int fps = __atomic_load_n(&cam->fpsRequested, __ATOMIC_ACQUIRE);
+		if (fps != cam->fps) {
+			switchFps(cam, fps);
 		}
-		frames[cFrames-1] = tmp;
 
-		// get new frame
-		before = getTimeInMs();
 		// this runs ~instantaneously unless it has to wait for a new frame
-		assert(!cameraGetFrame(frames[cFrames-1]));
-		after = getTimeInMs();
+		struct cameraFrame *frame = acquireFrame(cam);
+		if (!frame) {
+			assert(cameraEndOfStream(cam->camera));
+			assert(!pthread_mutex_lock(&cam->mutPublish));
+			cam->endOfStream = true;
+			assert(!pthread_cond_broadcast(&cam->condPublish));
+			assert(!pthread_mutex_unlock(&cam->mutPublish));
+			break;
+		}
 
-		dropped -= 5;
-		dropped = dropped > 0 ? dropped : 0;
-		if (after - before <= 1) {
-			// we didn't have to wait for the next frame.
-			// (we should have to wait 10+ ms)
-			dropped += 10;
-			// assert(dropped < 50); // fail if we've been dropping a lot of frames
+		// drop the oldest frame and rotate `frames` array
+		cameraRelease(frames[0]);
+		for (unsigned int iFrame = 1; iFrame < cFrames; iFrame++) {
+			frames[iFrame-1] = frames[iFrame];
 		}
+		frames[cFrames-1] = frame;
 
-		// update frame{Old,New}
-		pthread_mutex_lock(&mutRecent);
-		computeMedian(frameOld, 0, scratch);
-		computeMedian(frameNew, sample_delta, scratch);
-		pthread_mutex_unlock(&mutRecent);
+		// compute the next frameNew. Readers can't see a free slot, so
+		// none of this blocks them.
+		struct ccameraFrame *next = getFreeSlot(cam);
+		uint16_t *out = getMedianOut(cam, next);
+		double msStart = getMonotonicTimeInMs();
+		if (cam->incremental) {
+			// after the rotation, frames[sample_delta-1] is the frame
+			// that just left frameNew's window
+			updateMedian(cam, frames[cam->sample_delta-1]->data, frames[cFrames-1]->data, out);
+		} else if (cam->slab) {
+			slabMedian(cam, frames[cFrames-1]->data, out);
+		} else {
+			computeMedian(cam, out, cam->sample_delta);
+		}
+		applyFilters(cam, next, getMonotonicTimeInMs() - msStart);
+		buildLevels(cam, next);
+		stampFrame(cam, next);
 
+		archiveNext(cam, next);
+		publishNext(cam, next);
 	}
 
 	return NULL;
 }
 
 
-size_t ccameraGetFrameWidth()
+size_t ccameraGetFrameWidth(struct ccamera *cam)
 {
-	return cameraGetFrameWidth();
+	return filterChainGetWidth(cam->filters);
 }
 
-size_t ccameraGetFrameHeight()
+size_t ccameraGetFrameHeight(struct ccamera *cam)
 {
-	return cameraGetFrameHeight();
+	return filterChainGetHeight(cam->filters);
 }
 
-size_t ccameraGetNumPixels()
+size_t ccameraGetLevelWidth(struct ccamera *cam, unsigned int iLevel)
 {
-	return ccameraGetFrameWidth() * ccameraGetFrameHeight();
+	assert(iLevel < CCAMERA_LEVELS);
+	return cam->levelWidths[iLevel];
 }
 
-size_t ccameraGetFrameSize()
+size_t ccameraGetLevelHeight(struct ccamera *cam, unsigned int iLevel)
 {
-	size_t size = sizeof(**frames) * ccameraGetNumPixels();
+	assert(iLevel < CCAMERA_LEVELS);
+	return cam->levelHeights[iLevel];
+}
+
+size_t ccameraGetLevelNumPixels(struct ccamera *cam, unsigned int iLevel)
+{
+	return ccameraGetLevelWidth(cam, iLevel) * ccameraGetLevelHeight(cam, iLevel);
+}
+
+size_t ccameraGetNumPixels(struct ccamera *cam)
+{
+	return ccameraGetFrameWidth(cam) * ccameraGetFrameHeight(cam);
+}
+
+size_t ccameraGetFrameSize(struct ccamera *cam)
+{
+	size_t size = sizeof(uint16_t) * ccameraGetNumPixels(cam);
 	return size;
 }
 
-void ccameraGetFrame(uint16_t* frameOut)
+struct framePool *ccameraGetFramePool(struct ccamera *cam)
+{
+	return cam->pool;
+}
+
+// Returns the frame after the one that was handed out last, waiting for it if
+// necessary, or NULL at the end of the stream. If `outOld` isn't NULL, also
+// takes a reference to the frame's `older` there. That has to happen before the
+// lock is released: once the frame has been taken, the background thread may
+// publish again, which drops `older` from the history.
+static struct ccameraFrame *takeNextFrame(struct ccamera *cam, struct ccameraFrame **outOld)
 {
-	assert(!pthread_mutex_lock(&mutRecent));
+	assert(!pthread_mutex_lock(&cam->mutPublish));
+	while (!cam->endOfStream && cam->published->seq == cam->seqTaken) {
+		assert(!pthread_cond_wait(&cam->condPublish, &cam->mutPublish));
+	}
+
+	struct ccameraFrame *frame = NULL;
+	if (cam->published->seq != cam->seqTaken) {
+		// `published` is in the history and the background thread
+		// can't replace it until we've taken it, so this can't fail
+		frame = cam->published;
+		assert(tryRef(frame));
+		if (outOld) {
+			*outOld = frame->older;
+			assert(tryRef(frame->older));
+		}
+		cam->seqTaken = frame->seq;
+		cam->msTaken = frame->info.camera.timestamp;
+		assert(!pthread_cond_broadcast(&cam->condPublish));
+	}
 
-	memcpy(frameOut, frameNew, ccameraGetFrameSize());
+	assert(!pthread_mutex_unlock(&cam->mutPublish));
+	return frame;
+}
 
-	assert(!pthread_mutex_unlock(&mutRecent));
+const struct ccameraFrame *ccameraAcquireFrame(struct ccamera *cam)
+{
+	if (cam->replay) {
+		return takeNextFrame(cam, NULL);
+	}
+
+	while (true) {
+		// `published` can only be freed after sample_delta more frames
+		// have been published, so this almost never loops.
+		struct ccameraFrame *frame = __atomic_load_n(&cam->published, __ATOMIC_ACQUIRE);
+		if (tryRef(frame)) {
+			return frame;
+		}
+	}
 }
 
-void ccameraGetFrames(uint16_t* outNew, uint16_t* outOld)
+int ccameraAcquireFrames(struct ccamera *cam, const struct ccameraFrame **outNew, const struct ccameraFrame **outOld)
 {
-	assert(!pthread_mutex_lock(&mutRecent));
+	if (cam->replay) {
+		struct ccameraFrame *fOld;
+		struct ccameraFrame *fNew = takeNextFrame(cam, &fOld);
+		if (!fNew) {
+			return 1;
+		}
+		*outNew = fNew;
+		*outOld = fOld;
+		return 0;
+	}
 
-	ccameraCopyFrame(frameNew, outNew);
-	ccameraCopyFrame(frameOld, outOld);
+	while (true) {
+		struct ccameraFrame *fNew = (struct ccameraFrame *) ccameraAcquireFrame(cam);
+		if (!fNew) {
+			return 1;
+		}
 
-	assert(!pthread_mutex_unlock(&mutRecent));
+		// fNew->older was in the history when fNew was published, but
+		// the background thread may have recycled it since. If so its
+		// sequence number gives it away.
+		struct ccameraFrame *fOld = fNew->older;
+		if (tryRef(fOld)) {
+			if (fOld->seq + cam->sample_delta == fNew->seq) {
+				*outNew = fNew;
+				*outOld = fOld;
+				return 0;
+			}
+			unref(fOld);
+		}
+		unref(fNew);
+	}
+}
+
+void ccameraRelease(const struct ccameraFrame *frame)
+{
+	unref((struct ccameraFrame *) frame);
+}
+
+int ccameraGetFrame(struct ccamera *cam, uint16_t* frameOut)
+{
+	const struct ccameraFrame *frame = ccameraAcquireFrame(cam);
+	if (!frame) {
+		return 1;
+	}
+
+	memcpy(frameOut, frame->data, ccameraGetFrameSize(cam));
+	ccameraRelease(frame);
+	return 0;
+}
+
+int ccameraGetFrames(struct ccamera *cam, uint16_t* outNew, uint16_t* outOld)
+{
+	const struct ccameraFrame *fNew, *fOld;
+	if (ccameraAcquireFrames(cam, &fNew, &fOld)) {
+		return 1;
+	}
+
+	memcpy(outNew, fNew->data, ccameraGetFrameSize(cam));
+	memcpy(outOld, fOld->data, ccameraGetFrameSize(cam));
+
+	ccameraRelease(fNew);
+	ccameraRelease(fOld);
+	return 0;
+}
+
+struct ccameraSubscription {
+	struct ccamera *cam;
+	// the frame that should be handed out next
+	unsigned long long seqWanted;
+	unsigned long long cSkipped;
+};
+
+struct ccameraSubscription *ccameraSubscribe(struct ccamera *cam)
+{
+	struct ccameraSubscription *sub = malloc(sizeof(*sub));
+	assert(sub);
+	sub->cam = cam;
+	sub->cSkipped = 0;
+
+	assert(!pthread_mutex_lock(&cam->mutPublish));
+	sub->seqWanted = cam->published->seq;
+	assert(!pthread_mutex_unlock(&cam->mutPublish));
+	return sub;
+}
+
+void ccameraUnsubscribe(struct ccameraSubscription *sub)
+{
+	if (sub->cSkipped) {
+		printf("ccamera: a subscriber fell behind and missed %llu frames\n", sub->cSkipped);
+	}
+	free(sub);
+}
+
+const struct ccameraFrame *ccameraWaitFrame(struct ccameraSubscription *sub, unsigned int msTimeout)
+{
+	struct ccamera *cam = sub->cam;
+	if (cam->replay) {
+		// takeNextFrame already hands out every frame exactly once
+		return takeNextFrame(cam, NULL);
+	}
+
+	struct timespec stop;
+	assert(!clock_gettime(CLOCK_MONOTONIC, &stop));
+	stop.tv_sec += msTimeout / 1000;
+	stop.tv_nsec += (long) (msTimeout % 1000) * 1000000;
+	if (stop.tv_nsec >= 1000000000) {
+		stop.tv_sec++;
+		stop.tv_nsec -= 1000000000;
+	}
+
+	assert(!pthread_mutex_lock(&cam->mutPublish));
+	while (cam->published->seq < sub->seqWanted) {
+		int fail = pthread_cond_timedwait(&cam->condPublish, &cam->mutPublish, &stop);
+		if (fail == ETIMEDOUT) {
+			assert(!pthread_mutex_unlock(&cam->mutPublish));
+			return NULL;
+		}
+		assert(!fail);
+	}
+
+	// The history can't change while we hold the lock, and its frames are
+	// numbered consecutively. It always reaches back to `published` at
+	// least. Hand out seqWanted, or if that's already gone, the oldest
+	// frame there is.
+	struct ccameraFrame **history = cam->history;
+	unsigned long long seqOldest = history[0]->seq;
+	unsigned long long seqWanted = sub->seqWanted;
+	if (seqWanted < seqOldest) {
+		sub->cSkipped += seqOldest - seqWanted;
+		seqWanted = seqOldest;
+	}
+	struct ccameraFrame *frame = history[seqWanted - seqOldest];
+	assert(frame->seq == seqWanted);
+	assert(tryRef(frame));
+	sub->seqWanted = seqWanted + 1;
+
+	assert(!pthread_mutex_unlock(&cam->mutPublish));
+	return frame;
+}
+
+struct ccameraStats ccameraGetStats(struct ccamera *cam)
+{
+	struct ccameraStats stats;
+	assert(!pthread_mutex_lock(&cam->mutPublish));
+	stats.cFrames = cam->seqNext;
+	stats.msLatency = cam->seqNext ? cam->msLatency / (double) cam->seqNext : 0;
+	stats.msLatencyMax = cam->msLatencyMax;
+	stats.msLatencyTotal = cam->msLatency;
+	assert(!pthread_mutex_unlock(&cam->mutPublish));
+
+	stats.cDropped = __atomic_load_n(&cam->cDropped, __ATOMIC_RELAXED);
+	return stats;
+}
+
+uint16_t *ccameraCopyToPool(struct ccamera *cam, const struct ccameraFrame *frame)
+{
+	uint16_t *copy = framePoolAlloc(cam->pool);
+	if (copy) {
+		memcpy(copy, frame->data, ccameraGetFrameSize(cam));
+		*ccameraGetFrameInfo(cam, copy) = frame->info;
+	}
+	return copy;
+}
+
+struct ccameraFrameInfo *ccameraGetFrameInfo(struct ccamera *cam, const uint16_t *frame)
+{
+	return framePoolGetInfo(cam->pool, frame);
+}
+
+void ccameraSetFps(struct ccamera *cam, unsigned int fps)
+{
+	assert(fps > 0 && fps <= CAMERA_FPS);
+	if (!cam->replay) {
+		__atomic_store_n(&cam->fpsRequested, fps, __ATOMIC_RELEASE);
+	}
+}
+
+bool ccameraIsReplay(struct ccamera *cam)
+{
+	return cam->replay;
+}
+
+bool ccameraEndOfStream(struct ccamera *cam)
+{
+	assert(!pthread_mutex_lock(&cam->mutPublish));
+	bool ret = cam->endOfStream && cam->published->seq == cam->seqTaken;
+	assert(!pthread_mutex_unlock(&cam->mutPublish));
+	return ret;
+}
+
+// The timestamp of the last frame handed out in replay mode
+static unsigned long long getTakenTimeInMs(struct ccamera *cam)
+{
+	assert(!pthread_mutex_lock(&cam->mutPublish));
+	double timestamp = cam->msTaken;
+	assert(!pthread_mutex_unlock(&cam->mutPublish));
+
+	assert(timestamp >= 0);
+	return (unsigned long long) timestamp;
+}
+
+unsigned long long ccameraGetTimeInMs(struct ccamera *cam)
+{
+	if (!cam->replay) {
+		return (unsigned long long) getMonotonicTimeInMs();
+	}
+	return getTakenTimeInMs(cam);
+}
+
+unsigned long long ccameraGetFrameTimeInMs(struct ccamera *cam, const struct ccameraFrameInfo *info)
+{
+	double timestamp = cam->replay ? info->camera.timestamp : info->camera.msAcquired;
+	assert(timestamp >= 0);
+	return (unsigned long long) timestamp;
+}
+
+unsigned long long ccameraGetDateInS(struct ccamera *cam)
+{
+	if (!cam->replay) {
+		return getTimeInMs() / 1000;
+	}
+	return getTakenTimeInMs(cam) / 1000;
 }
 
-void ccameraComputeFrameAverages(uint16_t** frames, unsigned int cFrames, double *averages)
+void ccameraComputeFrameAverages(struct ccamera *cam, uint16_t** frames, unsigned int cFrames, double *averages)
 {
-	size_t cPixels = ccameraGetNumPixels();
+	size_t cPixels = ccameraGetNumPixels(cam);
 
 	for (unsigned int iF = 0; iF < cFrames; iF++) {
 		double total = 0;
@@ -4,36 +4,195 @@
 // This `Clean Camera` module is a wrapper around `camera` that denoises data,
 // and adds a couple of other helpful features.
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "args.h"
+#include "camera.h"
+#include "framepool.h"
 
-int ccameraInit(struct args args);
-int ccameraDestroy();
+// One denoised stream. Each has its own camera and background thread, so any
+// number of them may run at once.
+struct ccamera;
 
-size_t ccameraGetFrameWidth();
-size_t ccameraGetFrameHeight();
-size_t ccameraGetNumPixels();
-size_t ccameraGetFrameSize();
+// Returns NULL on failure
+struct ccamera *ccameraInit(struct args args);
+int ccameraDestroy(struct ccamera *cam);
 
-static uint16_t ccameraGetPixelFromFrame(uint16_t *frame, size_t x, size_t y) __attribute__((unused));
-static uint16_t ccameraGetPixelFromFrame(uint16_t *frame, size_t x, size_t y)
+size_t ccameraGetFrameWidth(struct ccamera *cam);
+size_t ccameraGetFrameHeight(struct ccamera *cam);
+size_t ccameraGetNumPixels(struct ccamera *cam);
+size_t ccameraGetFrameSize(struct ccamera *cam);
+
+static uint16_t ccameraGetPixelFromFrame(struct ccamera *cam, uint16_t *frame, size_t x, size_t y) __attribute__((unused));
+static uint16_t ccameraGetPixelFromFrame(struct ccamera *cam, uint16_t *frame, size_t x, size_t y)
 {
-	return frame[y*ccameraGetFrameWidth() + x];
+	return frame[y*ccameraGetFrameWidth(cam) + x];
 }
 
-static void ccameraCopyFrame(uint16_t* fIn, uint16_t* fOut) __attribute__((unused));
-static void ccameraCopyFrame(uint16_t* fIn, uint16_t* fOut)
+static void ccameraCopyFrame(struct ccamera *cam, uint16_t* fIn, uint16_t* fOut) __attribute__((unused));
+static void ccameraCopyFrame(struct ccamera *cam, uint16_t* fIn, uint16_t* fOut)
 {
-	memcpy(fOut, fIn, ccameraGetFrameSize());
+	memcpy(fOut, fIn, ccameraGetFrameSize(cam));
 }
 
-void ccameraGetFrame(uint16_t* frameOut);
-void ccameraGetFrames(uint16_t* frameNew, uint16_t* frameOld);
+// Every frame is published at this many resolutions. Level 0 is the frame
+// itself, and each level after that is half the width and height of the one
+// before it, so level 2 has 1/16 of the pixels. A level that would be empty
+// is instead the same as the one before it.
+#define CCAMERA_LEVELS 3
+
+// A pixel of the smallest level is active when it differs from the same pixel
+// of frameOld's by more than this many mm
+#define CCAMERA_ACTIVE_DEPTH 40
+
+size_t ccameraGetLevelWidth(struct ccamera *cam, unsigned int iLevel);
+size_t ccameraGetLevelHeight(struct ccamera *cam, unsigned int iLevel);
+size_t ccameraGetLevelNumPixels(struct ccamera *cam, unsigned int iLevel);
+
+// Everything about a published frame besides its pixels
+struct ccameraFrameInfo {
+	// The newest camera frame that went into this one. Its cDropped
+	// counts the camera frames that were lost just before it.
+	struct cameraFrameInfo camera;
+	// getMonotonicTimeInMs() when the frame had been denoised, just
+	// before it was published
+	double msDenoised;
+};
+
+// A denoised frame published by ccamera.
+//
+// Views returned by ccameraAcquireFrame(s) are borrowed: ccamera keeps
+// ownership of the frame and won't modify or recycle it until every view of it
+// has been given back with ccameraRelease. Views may be held by any thread
+// and for as long as needed, but at most CCAMERA_MAX_VIEWS may be held at once.
+struct ccameraFrame {
+	const uint16_t *data;
+	// levels[0] is `data`; see CCAMERA_LEVELS
+	const uint16_t *levels[CCAMERA_LEVELS];
+	// The number of active pixels in the smallest level, compared to the
+	// frameOld that ccameraAcquireFrames pairs this frame with. ccamera
+	// counts them while it builds the levels.
+	size_t cActive;
+	// frames are numbered consecutively in the order they were published
+	unsigned long long seq;
+	struct ccameraFrameInfo info;
+
+	// private to ccamera
+	uint16_t *buf;
+	uint16_t *levelBuf;
+	unsigned int refs;
+	struct ccameraFrame *older;
+};
+
+#define CCAMERA_MAX_VIEWS 8
+
+// Neither of these functions block or copy any pixel data, except in replay
+// mode. frameOld lags frameNew by ccamera_sample_delta frames.
+//
+// Only replayed streams end (see ccameraIsReplay). Once one has,
+// ccameraAcquireFrame returns NULL and ccameraAcquireFrames returns nonzero.
+// A live stream never ends, not even when it is read from a file, which
+// starts over instead, so then neither ever fails.
+const struct ccameraFrame *ccameraAcquireFrame(struct ccamera *cam);
+int ccameraAcquireFrames(struct ccamera *cam, const struct ccameraFrame **frameNew, const struct ccameraFrame **frameOld);
+void ccameraRelease(const struct ccameraFrame *frame);
+
+// A reader that sees every published frame exactly once, in order, and can
+// sleep until the next one is published instead of polling. Each subscription
+// belongs to one thread.
+struct ccameraSubscription;
+
+// Starts with the current frameNew
+struct ccameraSubscription *ccameraSubscribe(struct ccamera *cam);
+void ccameraUnsubscribe(struct ccameraSubscription *sub);
+
+// Waits up to msTimeout ms for the next frame and returns a view of it, or
+// returns NULL on timeout. A subscriber that falls more than sample_delta
+// frames behind skips the frames that have already left the history. In replay
+// mode this is ccameraAcquireFrame, which never times out but returns NULL at
+// the end of the stream instead. A live stream has no end, so a live NULL
+// always means a timeout.
+const struct ccameraFrame *ccameraWaitFrame(struct ccameraSubscription *sub, unsigned int msTimeout);
+
+// Like ccameraAcquireFrame(s), but copies the frames to caller owned buffers.
+// Return nonzero at the end of a replayed stream.
+int ccameraGetFrame(struct ccamera *cam, uint16_t* frameOut);
+int ccameraGetFrames(struct ccamera *cam, uint16_t* frameNew, uint16_t* frameOld);
+
+struct ccameraStats {
+	// how many frames have been published, counting those that only
+	// filled the history
+	unsigned long long cFrames;
+	// how many frames the camera has dropped
+	unsigned long long cDropped;
+	// the average and worst time between the camera handing a frame over
+	// and it having been denoised, in ms
+	double msLatency;
+	double msLatencyMax;
+	// that time summed over all cFrames frames, for averaging it over any
+	// interval between two calls
+	double msLatencyTotal;
+};
+
+// May be called from any thread
+struct ccameraStats ccameraGetStats(struct ccamera *cam);
+
+// Copies `frame`'s pixels and info to a new frame from the frame pool.
+// Returns NULL if the pool is empty.
+uint16_t *ccameraCopyToPool(struct ccamera *cam, const struct ccameraFrame *frame);
+
+// The info of a frame from the frame pool, as ccameraCopyToPool left it
+struct ccameraFrameInfo *ccameraGetFrameInfo(struct ccamera *cam, const uint16_t *frame);
+
+// Asks for camera frames at `fps` (at most CAMERA_FPS) from now on, to save
+// power while there is nothing to see. The switch happens on the background
+// thread a frame or so later. Once it has, every published frame comes from
+// frames at the new rate, so frameOld then lags frameNew by sample_delta
+// frames at that rate. Ignored in replay mode, where frames cost nothing to
+// wait for and results shouldn't depend on timing.
+void ccameraSetFps(struct ccamera *cam, unsigned int fps);
+
+// True when replaying a recording faster than real time (args.replay).
+//
+// Frames are then handed out in lockstep: every ccameraAcquire* or ccameraGet*
+// call returns the frame after the one that the previous call returned,
+// waiting for it if needed, so no frame is skipped or seen twice. Readers
+// should not sleep between frames, and should do their processing on the
+// thread that reads the frames so that the results don't depend on timing.
+bool ccameraIsReplay(struct ccamera *cam);
+
+// True once the last frame of a replayed recording has been handed out
+bool ccameraEndOfStream(struct ccamera *cam);
+
+// The current time in ms. In replay mode this is the timestamp of the last
+// frame that was handed out, otherwise it is getMonotonicTimeInMs(); either
+// way, only the differences between times mean anything. Use this for
+// anything that should behave the same in a replay as it did live.
+unsigned long long ccameraGetTimeInMs(struct ccamera *cam);
+
+// When `info`'s frame was captured, by the same clock as ccameraGetTimeInMs.
+// Live, that is when the camera handed it over.
+unsigned long long ccameraGetFrameTimeInMs(struct ccamera *cam, const struct ccameraFrameInfo *info);
+
+// The number of seconds since the epoch, for logs. In replay mode this comes
+// from the timestamp of the last frame that was handed out.
+unsigned long long ccameraGetDateInS(struct ccamera *cam);
+
+// The number of frames that readers may take from the frame pool at once. The
+// states never hold more than 9 s of video: starting keeps 5 s of frames plus
+// up to 2 s of new ones, and hands all of those to counting. Counting's debug
+// video may be waiting to encode up to 2 s more.
+#define CCAMERA_POOL_FRAMES (30 * 9)
+
+// Every frame buffer that the pipeline needs comes from this pool, which is
+// allocated once by ccameraInit. It also backs ccamera's own denoised frames.
+// Each frame's info is a struct ccameraFrameInfo.
+struct framePool *ccameraGetFramePool(struct ccamera *cam);
 
 // todo: figure out how to declare frame data as const
-void ccameraComputeFrameAverages(uint16_t** frames, unsigned int cFrames, double *averages);
+void ccameraComputeFrameAverages(struct ccamera *cam, uint16_t** frames, unsigned int cFrames, double *averages);
 
 #endif
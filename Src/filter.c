@@ -0,0 +1,286 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter.h"
+#include "helper.h"
+
+struct stage;
+typedef void (*stageFunction)(struct stage *stage, const uint16_t *in, uint16_t *out);
+
+struct stage {
+	const char *name;
+	stageFunction apply;
+
+	// the size of the stage's input and output frames
+	size_t widthIn;
+	size_t heightIn;
+	size_t widthOut;
+	size_t heightOut;
+
+	// ema: the weight of the new depth, out of 256, and each pixel's
+	// filtered depth times 256 (or zero if it hasn't seen one yet)
+	uint32_t alpha;
+	uint32_t *state;
+
+	// decimate
+	unsigned int factor;
+
+	struct filterStats stats;
+};
+
+struct filterChain {
+	bool median;
+
+	// every stage after the median
+	struct stage stages[FILTER_MAX_STAGES];
+	unsigned int cStages;
+
+	struct filterStats medianStats;
+
+	// the size of the output
+	size_t width;
+	size_t height;
+
+	// stages alternate between the caller's frame and this
+	uint16_t *scratch;
+};
+
+static void emaApply(struct stage *stage, const uint16_t *in, uint16_t *out)
+{
+	size_t cPixels = stage->widthIn * stage->heightIn;
+	uint32_t *state = stage->state;
+	int64_t alpha = stage->alpha;
+
+	for (size_t ii = 0; ii < cPixels; ii++) {
+		uint32_t depth = (uint32_t) in[ii] << 8;
+		uint32_t old = state[ii];
+		int64_t step = ((int64_t) depth - old) * alpha / 256;
+		uint32_t next = (uint32_t) (old + step);
+
+		// the first depth a pixel sees is taken as is, and holes are
+		// left out entirely
+		next = old ? next : depth;
+		next = depth ? next : old;
+		state[ii] = next;
+		out[ii] = (uint16_t) (next >> 8);
+	}
+}
+
+static void holesApply(struct stage *stage, const uint16_t *in, uint16_t *out)
+{
+	size_t width = stage->widthIn;
+
+	for (size_t y = 0; y < stage->heightIn; y++) {
+		const uint16_t *rowIn = in + y * width;
+		uint16_t *rowOut = out + y * width;
+
+		// the start of the row takes its first depth, if it has one
+		uint16_t last = 0;
+		for (size_t x = 0; x < width && !last; x++) {
+			last = rowIn[x];
+		}
+
+		for (size_t x = 0; x < width; x++) {
+			last = rowIn[x] ? rowIn[x] : last;
+			rowOut[x] = last;
+		}
+	}
+}
+
+static void decimateApply(struct stage *stage, const uint16_t *in, uint16_t *out)
+{
+	unsigned int factor = stage->factor;
+	size_t widthIn = stage->widthIn;
+	size_t widthOut = stage->widthOut;
+
+	uint32_t sums[widthOut];
+	uint32_t counts[widthOut];
+	for (size_t yOut = 0; yOut < stage->heightOut; yOut++) {
+		memset(sums, 0, sizeof(sums));
+		memset(counts, 0, sizeof(counts));
+
+		for (size_t dy = 0; dy < factor; dy++) {
+			const uint16_t *row = in + (yOut * factor + dy) * widthIn;
+			for (size_t xOut = 0; xOut < widthOut; xOut++) {
+				for (size_t dx = 0; dx < factor; dx++) {
+					uint16_t depth = row[xOut * factor + dx];
+					sums[xOut] += depth;
+					counts[xOut] += depth != 0;
+				}
+			}
+		}
+
+		for (size_t xOut = 0; xOut < widthOut; xOut++) {
+			uint32_t count = counts[xOut];
+			out[yOut * widthOut + xOut] = (uint16_t) (count ? (sums[xOut] + count / 2) / count : 0);
+		}
+	}
+}
+
+// Parses "name" or "name=value" into `stage`, given the size of its input.
+// Returns false if it isn't a valid stage.
+static bool parseStage(struct stage *stage, char *text, size_t width, size_t height)
+{
+	char *value = strchr(text, '=');
+	if (value) {
+		*value++ = '\0';
+	}
+	char *end = NULL;
+
+	memset(stage, 0, sizeof(*stage));
+	stage->widthIn = width;
+	stage->heightIn = height;
+	stage->widthOut = width;
+	stage->heightOut = height;
+
+	if (!strcmp(text, "ema")) {
+		double alpha = value ? strtod(value, &end) : 0.4;
+		if ((end && *end) || !(alpha > 0 && alpha <= 1)) {
+			return false;
+		}
+		stage->name = "ema";
+		stage->apply = emaApply;
+		stage->alpha = (uint32_t) (alpha * 256 + 0.5);
+		stage->alpha = stage->alpha ? stage->alpha : 1;
+		stage->state = calloc(width * height, sizeof(*stage->state));
+		assert(stage->state);
+	} else if (!strcmp(text, "holes") && !value) {
+		stage->name = "holes";
+		stage->apply = holesApply;
+	} else if (!strcmp(text, "decimate")) {
+		long factor = value ? strtol(value, &end, 10) : 2;
+		if ((end && *end) || factor < 2 || factor > 8 ||
+		    width / (size_t) factor == 0 || height / (size_t) factor == 0) {
+			return false;
+		}
+		stage->name = "decimate";
+		stage->apply = decimateApply;
+		stage->factor = (unsigned int) factor;
+		stage->widthOut = width / stage->factor;
+		stage->heightOut = height / stage->factor;
+	} else {
+		return false;
+	}
+
+	stage->stats.name = stage->name;
+	return true;
+}
+
+struct filterChain *filterChainInit(const char *spec, size_t width, size_t height)
+{
+	struct filterChain *chain = calloc(1, sizeof(*chain));
+	assert(chain);
+	chain->medianStats.name = "median";
+
+	// the camera's frames, not the output's
+	size_t cPixels = width * height;
+
+	char *copy = strdup(spec);
+	assert(copy);
+	bool first = true;
+	char *save;
+	for (char *text = strtok_r(copy, ",", &save); text; text = strtok_r(NULL, ",", &save)) {
+		if (!strcmp(text, "median")) {
+			if (!first) {
+				puts("filters: median must come first");
+				goto FAIL;
+			}
+			chain->median = true;
+			first = false;
+			continue;
+		}
+		first = false;
+
+		// The median comes first, so it is known by now whether the
+		// stats need room for it
+		if (chain->cStages + chain->median == FILTER_MAX_STAGES) {
+			printf("filters: at most %d stages are allowed\n", FILTER_MAX_STAGES);
+			goto FAIL;
+		}
+		struct stage *stage = &chain->stages[chain->cStages];
+		if (!parseStage(stage, text, width, height)) {
+			printf("filters: invalid stage %s\n", text);
+			goto FAIL;
+		}
+		chain->cStages++;
+		width = stage->widthOut;
+		height = stage->heightOut;
+	}
+
+	free(copy);
+	chain->width = width;
+	chain->height = height;
+	chain->scratch = malloc(sizeof(*chain->scratch) * cPixels);
+	assert(chain->scratch);
+	return chain;
+FAIL:
+	free(copy);
+	filterChainDestroy(chain);
+	return NULL;
+}
+
+void filterChainDestroy(struct filterChain *chain)
+{
+	for (unsigned int ii = 0; ii < chain->cStages; ii++) {
+		free(chain->stages[ii].state);
+	}
+	free(chain->scratch);
+	free(chain);
+}
+
+bool filterChainHasMedian(struct filterChain *chain)
+{
+	return chain->median;
+}
+
+bool filterChainHasStages(struct filterChain *chain)
+{
+	return chain->cStages > 0;
+}
+
+size_t filterChainGetWidth(struct filterChain *chain)
+{
+	return chain->width;
+}
+
+size_t filterChainGetHeight(struct filterChain *chain)
+{
+	return chain->height;
+}
+
+void filterChainApply(struct filterChain *chain, uint16_t *frame, uint16_t *frameOut)
+{
+	uint16_t *buffers[2] = {frame, chain->scratch};
+	for (unsigned int ii = 0; ii < chain->cStages; ii++) {
+		struct stage *stage = &chain->stages[ii];
+		const uint16_t *in = buffers[ii % 2];
+		uint16_t *out = ii + 1 == chain->cStages ? frameOut : buffers[(ii + 1) % 2];
+
+		double msStart = getMonotonicTimeInMs();
+		stage->apply(stage, in, out);
+		stage->stats.msTotal += getMonotonicTimeInMs() - msStart;
+		stage->stats.cFrames++;
+	}
+}
+
+void filterChainAddMedianTime(struct filterChain *chain, double ms)
+{
+	chain->medianStats.msTotal += ms;
+	chain->medianStats.cFrames++;
+}
+
+unsigned int filterChainGetStats(struct filterChain *chain, struct filterStats stats[FILTER_MAX_STAGES])
+{
+	unsigned int cStats = 0;
+	if (chain->median) {
+		stats[cStats++] = chain->medianStats;
+	}
+	for (unsigned int ii = 0; ii < chain->cStages; ii++) {
+		stats[cStats++] = chain->stages[ii].stats;
+	}
+	return cStats;
+}
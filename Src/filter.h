@@ -0,0 +1,62 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+// The chain of filters that ccamera runs on every frame, chosen at startup with
+// a comma separated list of stages:
+//
+// median: the temporal median of ccamera_sample_size frames. Removes most
+//         noise, but adds half a window of latency. Only allowed first, since
+//         it works on the camera's own frames; ccamera computes it itself.
+// ema=A: a recursive exponential filter: each pixel moves a fraction A (0.4 if
+//        omitted) of the way towards its new depth. Costs O(1) per pixel and
+//        adds almost no latency. Zero depths are ignored.
+// holes: replaces zero depths with the nearest non-zero depth to their left
+//        (or right, at the start of a row)
+// decimate=F: shrinks the frame by a factor of F (2 if omitted) in each
+//             direction, averaging the non-zero depths of each FxF block
+//
+// Every stage after `median` runs on ccamera's background thread, in order.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define FILTER_CHAIN_DEFAULT "median"
+
+#define FILTER_MAX_STAGES 8
+
+struct filterChain;
+
+// How long one stage has taken so far
+struct filterStats {
+	const char *name;
+	unsigned long long cFrames;
+	double msTotal;
+};
+
+// Returns NULL, after printing why, if `spec` is invalid. `width` and `height`
+// are the size of the camera's frames.
+struct filterChain *filterChainInit(const char *spec, size_t width, size_t height);
+void filterChainDestroy(struct filterChain *chain);
+
+// True if the chain starts with `median`
+bool filterChainHasMedian(struct filterChain *chain);
+// True if there are any stages other than `median`. If not,
+// filterChainApply has nothing to do.
+bool filterChainHasStages(struct filterChain *chain);
+
+// the size of the chain's output frames
+size_t filterChainGetWidth(struct filterChain *chain);
+size_t filterChainGetHeight(struct filterChain *chain);
+
+// Runs every stage after `median` on `frame`, which is the size of the
+// camera's frames and may be overwritten, and writes the result to frameOut.
+void filterChainApply(struct filterChain *chain, uint16_t *frame, uint16_t *frameOut);
+
+// Adds `ms` to the median's stats, which ccamera measures itself
+void filterChainAddMedianTime(struct filterChain *chain, double ms);
+
+// Fills in stats[i] for each stage, and returns the number of stages
+unsigned int filterChainGetStats(struct filterChain *chain, struct filterStats stats[FILTER_MAX_STAGES]);
+
+#endif
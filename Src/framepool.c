@@ -0,0 +1,149 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "framepool.h"
+
+struct framePool {
+	// cFrames frames, `stride` bytes apart
+	char *slab;
+	size_t stride;
+	unsigned int cFrames;
+
+	// cFrames blocks of info, infoSize bytes apart
+	char *infos;
+	size_t infoSize;
+
+	// refs[i] is the number of references to frame i
+	unsigned int *refs;
+
+	// A stack of the indicies of the free frames; the top is at
+	// free[cFree-1]. Belongs to `mut`, as do the stats.
+	unsigned int *free;
+	unsigned int cFree;
+	pthread_mutex_t mut;
+
+	struct framePoolStats stats;
+};
+
+struct framePool *framePoolInit(size_t frameSize, size_t infoSize, unsigned int cFrames)
+{
+	struct framePool *pool = malloc(sizeof(*pool));
+	assert(pool);
+
+	pool->stride = (frameSize + FRAMEPOOL_ALIGN - 1) / FRAMEPOOL_ALIGN * FRAMEPOOL_ALIGN;
+	pool->cFrames = cFrames;
+
+	// The OS only backs the parts of the slab that actually get used, so a
+	// generously sized pool costs little until it's needed.
+	void *slab;
+	if (posix_memalign(&slab, FRAMEPOOL_ALIGN, pool->stride * cFrames)) {
+		free(pool);
+		return NULL;
+	}
+	pool->slab = slab;
+
+	pool->infoSize = infoSize;
+	size_t cInfoBytes = infoSize * cFrames;
+	pool->infos = malloc(cInfoBytes ? cInfoBytes : 1);
+	assert(pool->infos);
+
+	pool->refs = calloc(cFrames, sizeof(*pool->refs));
+	assert(pool->refs);
+	pool->free = malloc(sizeof(*pool->free) * cFrames);
+	assert(pool->free);
+
+	// hand out low addresses first
+	for (unsigned int ii = 0; ii < cFrames; ii++) {
+		pool->free[ii] = cFrames - 1 - ii;
+	}
+	pool->cFree = cFrames;
+	pool->mut = (pthread_mutex_t) PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
+
+	pool->stats = (struct framePoolStats) {0};
+	pool->stats.cFrames = cFrames;
+
+	return pool;
+}
+
+void framePoolDestroy(struct framePool *pool)
+{
+	// if this fails, someone never released a frame
+	assert(pool->cFree == pool->cFrames);
+
+	free(pool->free);
+	free(pool->refs);
+	free(pool->infos);
+	free(pool->slab);
+	free(pool);
+}
+
+static unsigned int indexOf(struct framePool *pool, const uint16_t *frame)
+{
+	size_t offset = (size_t) ((const char *) frame - pool->slab);
+	assert(offset % pool->stride == 0);
+
+	size_t index = offset / pool->stride;
+	assert(index < pool->cFrames);
+	return (unsigned int) index;
+}
+
+uint16_t *framePoolAlloc(struct framePool *pool)
+{
+	uint16_t *frame = NULL;
+
+	assert(!pthread_mutex_lock(&pool->mut));
+	if (pool->cFree) {
+		unsigned int index = pool->free[--pool->cFree];
+		assert(!pool->refs[index]);
+		__atomic_store_n(&pool->refs[index], 1, __ATOMIC_RELAXED);
+		frame = (uint16_t *) (pool->slab + pool->stride * index);
+
+		struct framePoolStats *stats = &pool->stats;
+		stats->cAllocs++;
+		stats->cInUse++;
+		if (stats->cInUse > stats->cPeakInUse) {
+			stats->cPeakInUse = stats->cInUse;
+		}
+	} else {
+		pool->stats.cExhausted++;
+	}
+	assert(!pthread_mutex_unlock(&pool->mut));
+
+	return frame;
+}
+
+void framePoolAddRef(struct framePool *pool, const uint16_t *frame)
+{
+	unsigned int refs = __atomic_fetch_add(&pool->refs[indexOf(pool, frame)], 1, __ATOMIC_RELAXED);
+	assert(refs > 0);
+}
+
+void framePoolRelease(struct framePool *pool, const uint16_t *frame)
+{
+	unsigned int index = indexOf(pool, frame);
+	unsigned int refs = __atomic_fetch_sub(&pool->refs[index], 1, __ATOMIC_ACQ_REL);
+	assert(refs > 0);
+	if (refs > 1) {
+		return;
+	}
+
+	assert(!pthread_mutex_lock(&pool->mut));
+	assert(pool->cFree < pool->cFrames);
+	pool->free[pool->cFree++] = index;
+	pool->stats.cInUse--;
+	assert(!pthread_mutex_unlock(&pool->mut));
+}
+
+void *framePoolGetInfo(struct framePool *pool, const uint16_t *frame)
+{
+	return pool->infos + pool->infoSize * indexOf(pool, frame);
+}
+
+struct framePoolStats framePoolGetStats(struct framePool *pool)
+{
+	assert(!pthread_mutex_lock(&pool->mut));
+	struct framePoolStats stats = pool->stats;
+	assert(!pthread_mutex_unlock(&pool->mut));
+	return stats;
+}
@@ -0,0 +1,50 @@
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+// A fixed number of frame buffers, carved out of a single allocation up
+// front, that are then handed out and taken back without touching the heap.
+//
+// Frames are refcounted: anyone holding a frame can add a reference to share
+// it, and it returns to the pool when the last reference is released. A frame
+// is identified by its data pointer, so it can be passed around as a plain
+// `uint16_t *`. Each frame also has a block of info of a size chosen by the
+// pool's owner, which travels with it the same way. All functions are thread
+// safe.
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// every frame starts on a multiple of this many bytes
+#define FRAMEPOOL_ALIGN 64
+
+struct framePool;
+
+struct framePoolStats {
+	unsigned int cFrames;
+	unsigned int cInUse;
+	unsigned int cPeakInUse;
+
+	// number of successful framePoolAlloc calls
+	unsigned long long cAllocs;
+	// number of framePoolAlloc calls that found the pool empty
+	unsigned long long cExhausted;
+};
+
+// Returns NULL if the memory for the pool can't be allocated
+struct framePool *framePoolInit(size_t frameSize, size_t infoSize, unsigned int cFrames);
+// Every frame must have been released
+void framePoolDestroy(struct framePool *pool);
+
+// Returns a frame with a single reference, or NULL if every frame is in use.
+// Its contents are undefined.
+uint16_t *framePoolAlloc(struct framePool *pool);
+void framePoolAddRef(struct framePool *pool, const uint16_t *frame);
+void framePoolRelease(struct framePool *pool, const uint16_t *frame);
+
+// `frame`'s infoSize bytes of info. Like its pixels, they are undefined when
+// it's allocated.
+void *framePoolGetInfo(struct framePool *pool, const uint16_t *frame);
+
+struct framePoolStats framePoolGetStats(struct framePool *pool);
+
+#endif
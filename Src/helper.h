@@ -2,8 +2,10 @@
 #define HELPER_H
 
 #include <sys/time.h>
+#include <time.h>
 
 // returns the number of milliseconds that have passed since the epoch
+static unsigned long long getTimeInMs() __attribute__((unused));
 static unsigned long long getTimeInMs()
 {
 	struct timeval currentTime;
@@ -14,5 +16,14 @@ static unsigned long long getTimeInMs()
 	       (unsigned long long) currentTime.tv_usec / (unsigned long long) 1000;
 }
 
+// Milliseconds since some arbitrary point, from a clock that never jumps. For
+// timing how long things take.
+static double getMonotonicTimeInMs() __attribute__((unused));
+static double getMonotonicTimeInMs()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double) now.tv_sec * 1000 + (double) now.tv_nsec / 1e6;
+}
 
 #endif
@@ -0,0 +1,170 @@
+#include <assert.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include "luma.h"
+
+typedef void (*rowConverter)(const struct luma *luma, const uint16_t *in, uint8_t *out, size_t width);
+
+struct luma {
+	struct lumaMapping mapping;
+
+	// lut[depth] is the brightness of `depth`
+	uint8_t lut[UINT16_MAX + 1];
+
+	// for linear mappings, brightness = min(depth, inputMax) * scale,
+	// truncated, then xor'd with `invertMask`
+	float scale;
+	uint8_t invertMask;
+
+	rowConverter convert;
+};
+
+static void lutRow(const struct luma *luma, const uint16_t *in, uint8_t *out, size_t width)
+{
+	for (size_t ii = 0; ii < width; ii++) {
+		out[ii] = luma->lut[in[ii]];
+	}
+}
+
+#ifdef __SSE2__
+
+// The linear mapping, 16 pixels at a time. Produces exactly what the LUT
+// would: it's the same single precision multiply.
+static void sse2Row(const struct luma *luma, const uint16_t *in, uint8_t *out, size_t width)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i max = _mm_set1_epi16((short) luma->mapping.inputMax);
+	const __m128 scale = _mm_set1_ps(luma->scale);
+	const __m128i mask = _mm_set1_epi8((char) luma->invertMask);
+
+	size_t ii = 0;
+	for (; ii + 16 <= width; ii += 16) {
+		__m128i v[2];
+		for (int jj = 0; jj < 2; jj++) {
+			__m128i x = _mm_loadu_si128((const __m128i *) (in + ii + 8*jj));
+			// SSE2 has no unsigned 16 bit min, but x - subs(x, max)
+			// is the same thing
+			x = _mm_sub_epi16(x, _mm_subs_epu16(x, max));
+
+			__m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(x, zero));
+			__m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(x, zero));
+			v[jj] = _mm_packs_epi32(
+				_mm_cvttps_epi32(_mm_mul_ps(lo, scale)),
+				_mm_cvttps_epi32(_mm_mul_ps(hi, scale)));
+		}
+
+		__m128i bytes = _mm_xor_si128(_mm_packus_epi16(v[0], v[1]), mask);
+		_mm_storeu_si128((__m128i *) (out + ii), bytes);
+	}
+
+	lutRow(luma, in + ii, out + ii, width - ii);
+}
+
+// Compiled for AVX2 regardless of the build flags, and only ever used after
+// checking for it at runtime.
+__attribute__((target("avx2")))
+static void avx2Row(const struct luma *luma, const uint16_t *in, uint8_t *out, size_t width)
+{
+	const __m256i max = _mm256_set1_epi16((short) luma->mapping.inputMax);
+	const __m256 scale = _mm256_set1_ps(luma->scale);
+	const __m128i mask = _mm_set1_epi8((char) luma->invertMask);
+
+	size_t ii = 0;
+	for (; ii + 16 <= width; ii += 16) {
+		__m256i x = _mm256_loadu_si256((const __m256i *) (in + ii));
+		x = _mm256_min_epu16(x, max);
+
+		__m256 lo = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(x)));
+		__m256 hi = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(x, 1)));
+		__m256i packed = _mm256_packs_epi32(
+			_mm256_cvttps_epi32(_mm256_mul_ps(lo, scale)),
+			_mm256_cvttps_epi32(_mm256_mul_ps(hi, scale)));
+		// packs works within each 128 bit lane, so put the four
+		// groups of four back in order
+		packed = _mm256_permute4x64_epi64(packed, 0xD8);
+
+		__m128i bytes = _mm_packus_epi16(_mm256_castsi256_si128(packed),
+			_mm256_extracti128_si256(packed, 1));
+		_mm_storeu_si128((__m128i *) (out + ii), _mm_xor_si128(bytes, mask));
+	}
+
+	lutRow(luma, in + ii, out + ii, width - ii);
+}
+
+#endif
+
+struct luma *lumaInit(struct lumaMapping mapping)
+{
+	assert(mapping.inputMax > 0);
+	assert(mapping.gamma > 0);
+
+	struct luma *luma = malloc(sizeof(*luma));
+	assert(luma);
+	luma->mapping = mapping;
+	luma->scale = (float) UINT8_MAX / mapping.inputMax;
+	luma->invertMask = mapping.invert ? UINT8_MAX : 0;
+
+	bool linear = mapping.gamma == 1;
+	for (unsigned int depth = 0; depth <= UINT16_MAX; depth++) {
+		uint16_t value = depth <= mapping.inputMax ? (uint16_t) depth : mapping.inputMax;
+
+		uint8_t small;
+		if (linear) {
+			small = (uint8_t) (value * luma->scale);
+		} else {
+			float fraction = (float) value / mapping.inputMax;
+			small = (uint8_t) (UINT8_MAX * powf(fraction, mapping.gamma));
+		}
+		luma->lut[depth] = (uint8_t) (small ^ luma->invertMask);
+	}
+
+	if (lumaSetEngine(luma, LUMA_ENGINE_AVX2) && lumaSetEngine(luma, LUMA_ENGINE_SSE2)) {
+		assert(!lumaSetEngine(luma, LUMA_ENGINE_LUT));
+	}
+
+	return luma;
+}
+
+void lumaDestroy(struct luma *luma)
+{
+	free(luma);
+}
+
+int lumaSetEngine(struct luma *luma, enum lumaEngine engine)
+{
+	bool linear = luma->mapping.gamma == 1;
+	switch (engine) {
+	case LUMA_ENGINE_LUT:
+		luma->convert = lutRow;
+		return 0;
+#ifdef __SSE2__
+	case LUMA_ENGINE_SSE2:
+		if (!linear) {
+			return 1;
+		}
+		luma->convert = sse2Row;
+		return 0;
+	case LUMA_ENGINE_AVX2:
+		__builtin_cpu_init();
+		if (!linear || !__builtin_cpu_supports("avx2")) {
+			return 1;
+		}
+		luma->convert = avx2Row;
+		return 0;
+#endif
+	default:
+		return 1;
+	}
+}
+
+void lumaConvertRow(const struct luma *luma, const uint16_t *in, uint8_t *out, size_t width)
+{
+	luma->convert(luma, in, out, width);
+}
@@ -0,0 +1,45 @@
+#ifndef LUMA_H
+#define LUMA_H
+
+// Converts depth frames into 8 bit luma for the debug videos.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// How depths map to brightness. Depths from 0 to inputMax are spread over
+// the whole 0-255 range, and anything further away than inputMax is clipped
+// to it.
+struct lumaMapping {
+	uint16_t inputMax;
+	// if true, near is bright and far is dark
+	bool invert;
+	// brightness is proportional to (depth / inputMax)^gamma. 1 is
+	// linear, which is the fastest.
+	float gamma;
+};
+
+// inputMax was chosen arbitrarily for one particular situation.
+#define LUMA_MAPPING_DEFAULT ((struct lumaMapping) {4000, true, 1})
+
+enum lumaEngine {
+	LUMA_ENGINE_LUT,
+	LUMA_ENGINE_SSE2,
+	LUMA_ENGINE_AVX2,
+};
+
+struct luma;
+
+// Picks the fastest engine that the CPU supports for `mapping`
+struct luma *lumaInit(struct lumaMapping mapping);
+void lumaDestroy(struct luma *luma);
+
+// Overrides the engine that lumaInit picked. The SIMD engines only handle
+// linear mappings. Returns nonzero if the mapping, the CPU or the build does not
+// support the requested engine.
+int lumaSetEngine(struct luma *luma, enum lumaEngine engine);
+
+// converts `width` depths from `in` to brightnesses in `out`
+void lumaConvertRow(const struct luma *luma, const uint16_t *in, uint8_t *out, size_t width);
+
+#endif
@@ -0,0 +1,491 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include "median.h"
+
+// Compare-exchange networks that leave the median of their N inputs in element
+// N/2. They are the "opt_med" networks from Devillard's "Fast median search: an
+// ANSI C implementation". OP(a, b) must leave min(a, b) in a and max(a, b) in b.
+#define NETWORK3(OP) \
+	OP(0, 1) OP(1, 2) OP(0, 1)
+#define NETWORK5(OP) \
+	OP(0, 1) OP(3, 4) OP(0, 3) OP(1, 4) OP(1, 2) OP(2, 3) OP(1, 2)
+#define NETWORK7(OP) \
+	OP(0, 5) OP(0, 3) OP(1, 6) OP(2, 4) OP(0, 1) OP(3, 5) OP(2, 6) \
+	OP(2, 3) OP(3, 6) OP(4, 5) OP(1, 4) OP(1, 3) OP(3, 4)
+#define NETWORK9(OP) \
+	OP(1, 2) OP(4, 5) OP(7, 8) OP(0, 1) OP(3, 4) OP(6, 7) OP(1, 2) \
+	OP(4, 5) OP(7, 8) OP(0, 3) OP(5, 8) OP(4, 7) OP(3, 6) OP(1, 4) \
+	OP(2, 5) OP(4, 7) OP(4, 2) OP(6, 4) OP(4, 2)
+
+// Defines a function that computes the median of N frames for pixels in
+// [0, cPixels) in blocks of LANES pixels, and returns how many pixels it
+// processed. The remaining (< LANES) pixels are left for the caller.
+#define DEFINE_KERNEL(NAME, ATTR, VEC, LANES, LOAD, STORE, OP, N) \
+ATTR static size_t NAME(const uint16_t **frames, size_t cPixels, uint16_t *frameOut) \
+{ \
+	size_t iPixel; \
+	for (iPixel = 0; iPixel + LANES <= cPixels; iPixel += LANES) { \
+		VEC v[N]; \
+		for (unsigned int iFrame = 0; iFrame < N; iFrame++) { \
+			v[iFrame] = LOAD(frames[iFrame] + iPixel); \
+		} \
+		NETWORK##N(OP) \
+		STORE(frameOut + iPixel, v[N / 2]); \
+	} \
+	return iPixel; \
+}
+
+typedef size_t (*kernel)(const uint16_t **frames, size_t cPixels, uint16_t *frameOut);
+
+// DEFINE_KERNEL for a medianSlab: the samples of tile iTile start at
+// tiles + iTile*tileStride, and sample iFrame of each is offsets[iFrame] further
+// on. Processes every pixel of cTiles whole tiles.
+#define DEFINE_SLAB_KERNEL(NAME, ATTR, VEC, LANES, LOAD, STORE, OP, N) \
+ATTR static void NAME(const uint16_t *tiles, size_t tileStride, const size_t *offsets, size_t cTiles, uint16_t *frameOut) \
+{ \
+	for (size_t iTile = 0; iTile < cTiles; iTile++) { \
+		const uint16_t *tile = tiles + iTile * tileStride; \
+		for (unsigned int iLane = 0; iLane < MEDIAN_SLAB_TILE; iLane += LANES) { \
+			VEC v[N]; \
+			for (unsigned int iFrame = 0; iFrame < N; iFrame++) { \
+				v[iFrame] = LOAD(tile + offsets[iFrame] + iLane); \
+			} \
+			NETWORK##N(OP) \
+			STORE(frameOut + iTile * MEDIAN_SLAB_TILE + iLane, v[N / 2]); \
+		} \
+	} \
+}
+
+typedef void (*slabKernel)(const uint16_t *tiles, size_t tileStride, const size_t *offsets, size_t cTiles, uint16_t *frameOut);
+
+#ifdef __SSE2__
+
+// SSE2 has no unsigned 16 bit min/max (that came with SSE4.1), but
+// saturating subtraction gives us both: subs(a, b) is a-b if a>b, else 0.
+#define SSE2_OP(a, b) { \
+	__m128i t = _mm_subs_epu16(v[a], v[b]); \
+	v[a] = _mm_sub_epi16(v[a], t); \
+	v[b] = _mm_add_epi16(v[b], t); \
+}
+#define SSE2_LOAD(p) _mm_loadu_si128((const __m128i *) (p))
+#define SSE2_STORE(p, x) _mm_storeu_si128((__m128i *) (p), x)
+
+DEFINE_KERNEL(sse2Median3, , __m128i, 8, SSE2_LOAD, SSE2_STORE, SSE2_OP, 3)
+DEFINE_KERNEL(sse2Median5, , __m128i, 8, SSE2_LOAD, SSE2_STORE, SSE2_OP, 5)
+DEFINE_KERNEL(sse2Median7, , __m128i, 8, SSE2_LOAD, SSE2_STORE, SSE2_OP, 7)
+DEFINE_KERNEL(sse2Median9, , __m128i, 8, SSE2_LOAD, SSE2_STORE, SSE2_OP, 9)
+DEFINE_SLAB_KERNEL(sse2SlabMedian3, , __m128i, 8, SSE2_LOAD, SSE2_STORE, SSE2_OP, 3)
+DEFINE_SLAB_KERNEL(sse2SlabMedian5, , __m128i, 8, SSE2_LOAD, SSE2_STORE, SSE2_OP, 5)
+DEFINE_SLAB_KERNEL(sse2SlabMedian7, , __m128i, 8, SSE2_LOAD, SSE2_STORE, SSE2_OP, 7)
+DEFINE_SLAB_KERNEL(sse2SlabMedian9, , __m128i, 8, SSE2_LOAD, SSE2_STORE, SSE2_OP, 9)
+
+// The AVX2 kernels are compiled for AVX2 regardless of the build flags, and
+// only ever called after checking for it at runtime.
+#define AVX2_ATTR __attribute__((target("avx2")))
+#define AVX2_OP(a, b) { \
+	__m256i t = _mm256_min_epu16(v[a], v[b]); \
+	v[b] = _mm256_max_epu16(v[a], v[b]); \
+	v[a] = t; \
+}
+#define AVX2_LOAD(p) _mm256_loadu_si256((const __m256i *) (p))
+#define AVX2_STORE(p, x) _mm256_storeu_si256((__m256i *) (p), x)
+
+DEFINE_KERNEL(avx2Median3, AVX2_ATTR, __m256i, 16, AVX2_LOAD, AVX2_STORE, AVX2_OP, 3)
+DEFINE_KERNEL(avx2Median5, AVX2_ATTR, __m256i, 16, AVX2_LOAD, AVX2_STORE, AVX2_OP, 5)
+DEFINE_KERNEL(avx2Median7, AVX2_ATTR, __m256i, 16, AVX2_LOAD, AVX2_STORE, AVX2_OP, 7)
+DEFINE_KERNEL(avx2Median9, AVX2_ATTR, __m256i, 16, AVX2_LOAD, AVX2_STORE, AVX2_OP, 9)
+DEFINE_SLAB_KERNEL(avx2SlabMedian3, AVX2_ATTR, __m256i, 16, AVX2_LOAD, AVX2_STORE, AVX2_OP, 3)
+DEFINE_SLAB_KERNEL(avx2SlabMedian5, AVX2_ATTR, __m256i, 16, AVX2_LOAD, AVX2_STORE, AVX2_OP, 5)
+DEFINE_SLAB_KERNEL(avx2SlabMedian7, AVX2_ATTR, __m256i, 16, AVX2_LOAD, AVX2_STORE, AVX2_OP, 7)
+DEFINE_SLAB_KERNEL(avx2SlabMedian9, AVX2_ATTR, __m256i, 16, AVX2_LOAD, AVX2_STORE, AVX2_OP, 9)
+
+#endif
+
+static enum medianEngine engine = MEDIAN_ENGINE_SCALAR;
+
+static void pixelSort(uint16_t *buf, size_t cPix)
+{
+	// if this fails, the function needs to be optimized for large inputs
+	assert(cPix < 30);
+
+	//  insertion sort
+	for(size_t ii = 1; ii < cPix; ii++) {
+		// buf is sorted for indicies strictly less than ii
+
+		uint16_t tmp = buf[ii];
+
+		// shift right-most elements right by one until we've found the
+		// spot for `tmp`
+		size_t ij = ii;
+		while(ij > 0 && tmp < buf[ij-1]) {
+			buf[ij] = buf[ij - 1];
+			ij--;
+		}
+
+		buf[ij] = tmp;
+	}
+}
+
+// medianCompute, but only for pixels in [iFirst, cPixels)
+static void scalarMedian(const uint16_t **frames, unsigned int cFrames, size_t iFirst, size_t cPixels, uint16_t *frameOut)
+{
+	uint16_t scratch[30];
+	assert(cFrames <= sizeof(scratch) / sizeof(*scratch));
+
+	for (size_t iPixel = iFirst; iPixel < cPixels; iPixel++) {
+		for (unsigned int iFrame = 0; iFrame < cFrames; iFrame++) {
+			scratch[iFrame] = frames[iFrame][iPixel];
+		}
+
+		pixelSort(scratch, cFrames);
+		frameOut[iPixel] = scratch[cFrames / 2];
+	}
+}
+
+// returns the kernel to use for a window of cFrames frames, or NULL if there
+// is none.
+static kernel getKernel(unsigned int cFrames)
+{
+	switch (engine) {
+#ifdef __SSE2__
+	case MEDIAN_ENGINE_AVX2:
+		switch (cFrames) {
+		case 3: return avx2Median3;
+		case 5: return avx2Median5;
+		case 7: return avx2Median7;
+		case 9: return avx2Median9;
+		default: return NULL;
+		}
+	case MEDIAN_ENGINE_SSE2:
+		switch (cFrames) {
+		case 3: return sse2Median3;
+		case 5: return sse2Median5;
+		case 7: return sse2Median7;
+		case 9: return sse2Median9;
+		default: return NULL;
+		}
+#endif
+	default:
+		return NULL;
+	}
+}
+
+// getKernel, for slabs
+static slabKernel getSlabKernel(unsigned int cFrames)
+{
+	switch (engine) {
+#ifdef __SSE2__
+	case MEDIAN_ENGINE_AVX2:
+		switch (cFrames) {
+		case 3: return avx2SlabMedian3;
+		case 5: return avx2SlabMedian5;
+		case 7: return avx2SlabMedian7;
+		case 9: return avx2SlabMedian9;
+		default: return NULL;
+		}
+	case MEDIAN_ENGINE_SSE2:
+		switch (cFrames) {
+		case 3: return sse2SlabMedian3;
+		case 5: return sse2SlabMedian5;
+		case 7: return sse2SlabMedian7;
+		case 9: return sse2SlabMedian9;
+		default: return NULL;
+		}
+#endif
+	default:
+		return NULL;
+	}
+}
+
+static bool engineSupported(enum medianEngine e)
+{
+	switch (e) {
+	case MEDIAN_ENGINE_SCALAR:
+		return true;
+#ifdef __SSE2__
+	case MEDIAN_ENGINE_SSE2:
+		return true;
+	case MEDIAN_ENGINE_AVX2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+#endif
+	default:
+		return false;
+	}
+}
+
+static void detectEngine()
+{
+	if (engineSupported(MEDIAN_ENGINE_AVX2)) {
+		engine = MEDIAN_ENGINE_AVX2;
+	} else if (engineSupported(MEDIAN_ENGINE_SSE2)) {
+		engine = MEDIAN_ENGINE_SSE2;
+	} else {
+		engine = MEDIAN_ENGINE_SCALAR;
+	}
+}
+
+void medianInit()
+{
+	// every ccamera calls this, and several of them may be starting at once
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	assert(!pthread_once(&once, detectEngine));
+}
+
+int medianSetEngine(enum medianEngine e)
+{
+	if (!engineSupported(e)) {
+		return 1;
+	}
+	engine = e;
+	return 0;
+}
+
+enum medianEngine medianGetEngine()
+{
+	return engine;
+}
+
+const char *medianEngineName(enum medianEngine e)
+{
+	switch (e) {
+	case MEDIAN_ENGINE_SCALAR: return "scalar";
+	case MEDIAN_ENGINE_SSE2: return "sse2";
+	case MEDIAN_ENGINE_AVX2: return "avx2";
+	default: return "unknown";
+	}
+}
+
+void medianCompute(const uint16_t **frames, unsigned int cFrames, size_t cPixels, uint16_t *frameOut)
+{
+	size_t iPixel = 0;
+
+	kernel k = getKernel(cFrames);
+	if (k) {
+		iPixel = k(frames, cPixels, frameOut);
+	}
+
+	scalarMedian(frames, cFrames, iPixel, cPixels, frameOut);
+}
+
+// Tile iTile of the slab holds cSlots runs of MEDIAN_SLAB_TILE pixels, one per
+// slot, at tiles + iTile*cSlots*MEDIAN_SLAB_TILE. The last tile is padded out
+// to a whole tile.
+struct medianSlab {
+	unsigned int cSlots;
+	size_t cPixels;
+	uint16_t *tiles;
+};
+
+struct medianSlab *medianSlabInit(unsigned int cSlots, size_t cPixels)
+{
+	assert(cSlots > 0);
+
+	struct medianSlab *slab = malloc(sizeof(*slab));
+	assert(slab);
+	slab->cSlots = cSlots;
+	slab->cPixels = cPixels;
+
+	size_t cTiles = (cPixels + MEDIAN_SLAB_TILE - 1) / MEDIAN_SLAB_TILE;
+	size_t size = sizeof(*slab->tiles) * cTiles * cSlots * MEDIAN_SLAB_TILE;
+	// aligned_alloc wants a multiple of the alignment
+	size = (size + 63) / 64 * 64;
+	slab->tiles = aligned_alloc(64, size);
+	assert(slab->tiles);
+	memset(slab->tiles, 0, size);
+
+	return slab;
+}
+
+void medianSlabDestroy(struct medianSlab *slab)
+{
+	free(slab->tiles);
+	free(slab);
+}
+
+void medianSlabStore(struct medianSlab *slab, unsigned int iSlot, const uint16_t *frame, size_t iFirst, size_t cPixels)
+{
+	assert(iSlot < slab->cSlots);
+	assert(iFirst % MEDIAN_SLAB_TILE == 0);
+	assert(iFirst + cPixels <= slab->cPixels);
+
+	size_t tileStride = (size_t) slab->cSlots * MEDIAN_SLAB_TILE;
+	uint16_t *dst = slab->tiles + iFirst / MEDIAN_SLAB_TILE * tileStride + iSlot * MEDIAN_SLAB_TILE;
+	const uint16_t *src = frame + iFirst;
+
+	size_t ii = 0;
+	for (; ii + MEDIAN_SLAB_TILE <= cPixels; ii += MEDIAN_SLAB_TILE) {
+		memcpy(dst, src + ii, sizeof(*dst) * MEDIAN_SLAB_TILE);
+		dst += tileStride;
+	}
+	memcpy(dst, src + ii, sizeof(*dst) * (cPixels - ii));
+}
+
+void medianSlabCompute(struct medianSlab *slab, unsigned int iSlot, unsigned int cFrames,
+	size_t iFirst, size_t cPixels, uint16_t *frameOut)
+{
+	unsigned int cSlots = slab->cSlots;
+	assert(cFrames <= cSlots);
+	assert(iFirst % MEDIAN_SLAB_TILE == 0);
+	assert(iFirst + cPixels <= slab->cPixels);
+
+	size_t tileStride = (size_t) cSlots * MEDIAN_SLAB_TILE;
+	const uint16_t *tiles = slab->tiles + iFirst / MEDIAN_SLAB_TILE * tileStride;
+	size_t offsets[cFrames];
+	for (unsigned int iFrame = 0; iFrame < cFrames; iFrame++) {
+		offsets[iFrame] = (iSlot + iFrame) % cSlots * MEDIAN_SLAB_TILE;
+	}
+
+	size_t iPixel = 0;
+	slabKernel k = getSlabKernel(cFrames);
+	if (k) {
+		size_t cTiles = cPixels / MEDIAN_SLAB_TILE;
+		k(tiles, tileStride, offsets, cTiles, frameOut + iFirst);
+		iPixel = cTiles * MEDIAN_SLAB_TILE;
+	}
+
+	uint16_t scratch[30];
+	assert(cFrames <= sizeof(scratch) / sizeof(*scratch));
+	for (; iPixel < cPixels; iPixel++) {
+		const uint16_t *tile = tiles + iPixel / MEDIAN_SLAB_TILE * tileStride + iPixel % MEDIAN_SLAB_TILE;
+		for (unsigned int iFrame = 0; iFrame < cFrames; iFrame++) {
+			scratch[iFrame] = tile[offsets[iFrame]];
+		}
+		pixelSort(scratch, cFrames);
+		frameOut[iFirst + iPixel] = scratch[cFrames / 2];
+	}
+}
+
+// The window is stored as cFrames planes; sorted[iRank*cPixels + iPixel] is the
+// iRank'th smallest sample of pixel iPixel. Updates work on blocks of
+// WINDOW_BLOCK pixels so that every plane of a block stays in L1, and each
+// step is a branch free loop over the pixels of the block so that the
+// compiler vectorizes it.
+#define WINDOW_BLOCK 256
+
+struct medianWindow {
+	unsigned int cFrames;
+	size_t cPixels;
+	uint16_t *sorted;
+};
+
+struct medianWindow *medianWindowInit(const uint16_t **frames, unsigned int cFrames, size_t cPixels)
+{
+	assert(cFrames > 0);
+
+	struct medianWindow *window = malloc(sizeof(*window));
+	assert(window);
+	window->cFrames = cFrames;
+	window->cPixels = cPixels;
+	window->sorted = malloc(sizeof(*window->sorted) * cFrames * cPixels);
+	assert(window->sorted);
+
+	uint16_t scratch[30];
+	assert(cFrames <= sizeof(scratch) / sizeof(*scratch));
+	for (size_t iPixel = 0; iPixel < cPixels; iPixel++) {
+		for (unsigned int iFrame = 0; iFrame < cFrames; iFrame++) {
+			scratch[iFrame] = frames[iFrame][iPixel];
+		}
+		pixelSort(scratch, cFrames);
+		for (unsigned int iRank = 0; iRank < cFrames; iRank++) {
+			window->sorted[iRank*cPixels + iPixel] = scratch[iRank];
+		}
+	}
+
+	return window;
+}
+
+void medianWindowDestroy(struct medianWindow *window)
+{
+	free(window->sorted);
+	free(window);
+}
+
+// Replaces one copy of `evicted[i]` with `added[i]` in the sorted samples of
+// each pixel in [iFirst, iFirst+cBlock)
+static void windowUpdateBlock(struct medianWindow *window, size_t iFirst, size_t cBlock, const uint16_t *evicted, const uint16_t *added)
+{
+	unsigned int cFrames = window->cFrames;
+	size_t cPixels = window->cPixels;
+	uint16_t *sorted = window->sorted + iFirst;
+	uint16_t pos[WINDOW_BLOCK];
+
+	// Removal: the evicted sample is at rank pos, the number of smaller
+	// samples. Every rank from pos onwards takes the value one rank up, which
+	// leaves a hole at the top.
+	memset(pos, 0, sizeof(*pos) * cBlock);
+	for (unsigned int iRank = 0; iRank < cFrames; iRank++) {
+		const uint16_t *plane = sorted + iRank*cPixels;
+		for (size_t ii = 0; ii < cBlock; ii++) {
+			pos[ii] = (uint16_t) (pos[ii] + (plane[ii] < evicted[ii]));
+		}
+	}
+	for (unsigned int iRank = 0; iRank + 1 < cFrames; iRank++) {
+		uint16_t *plane = sorted + iRank*cPixels;
+		const uint16_t *above = plane + cPixels;
+		uint16_t rank = (uint16_t) iRank;
+		for (size_t ii = 0; ii < cBlock; ii++) {
+			// load both sides unconditionally so that the select
+			// vectorizes
+			uint16_t here = plane[ii];
+			uint16_t next = above[ii];
+			plane[ii] = rank < pos[ii] ? here : next;
+		}
+	}
+
+	// Insertion: the added sample belongs at rank pos, the number of
+	// remaining samples smaller than it. Ranks above it move up one, filling
+	// the hole.
+	memset(pos, 0, sizeof(*pos) * cBlock);
+	for (unsigned int iRank = 0; iRank + 1 < cFrames; iRank++) {
+		const uint16_t *plane = sorted + iRank*cPixels;
+		for (size_t ii = 0; ii < cBlock; ii++) {
+			pos[ii] = (uint16_t) (pos[ii] + (plane[ii] < added[ii]));
+		}
+	}
+	for (unsigned int iRank = cFrames - 1; iRank > 0; iRank--) {
+		uint16_t *plane = sorted + iRank*cPixels;
+		const uint16_t *below = plane - cPixels;
+		uint16_t rank = (uint16_t) iRank;
+		for (size_t ii = 0; ii < cBlock; ii++) {
+			uint16_t here = plane[ii];
+			uint16_t prev = below[ii];
+			uint16_t add = added[ii];
+			uint16_t value = rank == pos[ii] ? add : here;
+			plane[ii] = rank > pos[ii] ? prev : value;
+		}
+	}
+	for (size_t ii = 0; ii < cBlock; ii++) {
+		uint16_t here = sorted[ii];
+		uint16_t add = added[ii];
+		sorted[ii] = pos[ii] == 0 ? add : here;
+	}
+}
+
+void medianWindowUpdate(struct medianWindow *window, const uint16_t *frameEvicted, const uint16_t *frameAdded, uint16_t *frameOut)
+{
+	medianWindowUpdateRange(window, 0, window->cPixels, frameEvicted, frameAdded, frameOut);
+}
+
+void medianWindowUpdateRange(struct medianWindow *window, size_t iFirst, size_t cPixels,
+	const uint16_t *frameEvicted, const uint16_t *frameAdded, uint16_t *frameOut)
+{
+	assert(iFirst + cPixels <= window->cPixels);
+	const uint16_t *median = window->sorted + (window->cFrames / 2) * window->cPixels;
+
+	size_t iEnd = iFirst + cPixels;
+	for (size_t iBlock = iFirst; iBlock < iEnd; iBlock += WINDOW_BLOCK) {
+		size_t cBlock = iEnd - iBlock < WINDOW_BLOCK ? iEnd - iBlock : WINDOW_BLOCK;
+		windowUpdateBlock(window, iBlock, cBlock, frameEvicted + iBlock, frameAdded + iBlock);
+		memcpy(frameOut + iBlock, median + iBlock, sizeof(*frameOut) * cBlock);
+	}
+}
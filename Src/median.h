@@ -0,0 +1,80 @@
+#ifndef MEDIAN_H
+#define MEDIAN_H
+
+// Per-pixel median of a small number of frames. Used by ccamera for temporal
+// denoising.
+//
+// For the common window sizes (3, 5, 7 and 9) the median is found with a
+// min/max sorting network that is evaluated on 8 (SSE2) or 16 (AVX2) pixels at
+// a time. Every other window size, and the pixels left over at the end of a
+// frame, go through a scalar insertion sort.
+
+#include <stdint.h>
+#include <stdlib.h>
+
+enum medianEngine {
+	MEDIAN_ENGINE_SCALAR,
+	MEDIAN_ENGINE_SSE2,
+	MEDIAN_ENGINE_AVX2,
+};
+
+// Selects the fastest engine that the current CPU supports. Must be called
+// before `medianCompute`. Only the first call has any effect, so that it can't
+// undo `medianSetEngine`.
+void medianInit();
+
+// Overrides the engine chosen by `medianInit`. Returns nonzero if the CPU (or
+// the build) does not support the requested engine.
+int medianSetEngine(enum medianEngine engine);
+enum medianEngine medianGetEngine();
+const char *medianEngineName(enum medianEngine engine);
+
+// After calling this function, frameOut[i] is the median of frames[j][i] for j
+// in [0, cFrames), for all i in [0, cPixels).
+void medianCompute(const uint16_t **frames, unsigned int cFrames, size_t cPixels, uint16_t *frameOut);
+
+// The last few frames, interleaved so that the samples of each pixel sit next
+// to each other. The slab is divided into tiles of MEDIAN_SLAB_TILE pixels, and
+// each tile stores its pixels from every slot contiguously, so a median reads
+// one short run of memory per tile instead of one stream per frame. Slots are
+// meant to be used as a ring, with one frame stored per slot.
+struct medianSlab;
+
+// pixels per tile: one AVX2 vector, or two SSE2 vectors
+#define MEDIAN_SLAB_TILE 16
+
+struct medianSlab *medianSlabInit(unsigned int cSlots, size_t cPixels);
+void medianSlabDestroy(struct medianSlab *slab);
+
+// Copies pixels [iFirst, iFirst+cPixels) of `frame` into slot iSlot. iFirst
+// must be a multiple of MEDIAN_SLAB_TILE. Stores to, and computes from,
+// disjoint ranges may run concurrently.
+void medianSlabStore(struct medianSlab *slab, unsigned int iSlot, const uint16_t *frame, size_t iFirst, size_t cPixels);
+
+// After calling this function, frameOut[i] is the median of slots
+// (iSlot + j) % cSlots for j in [0, cFrames), for all i in
+// [iFirst, iFirst+cPixels). iFirst must be a multiple of MEDIAN_SLAB_TILE.
+void medianSlabCompute(struct medianSlab *slab, unsigned int iSlot, unsigned int cFrames,
+	size_t iFirst, size_t cPixels, uint16_t *frameOut);
+
+// A sliding window median. For every pixel it keeps that pixel's samples from
+// the last cFrames frames in sorted order, so advancing the window by one frame
+// costs O(cFrames) per pixel instead of a full sort.
+struct medianWindow;
+
+// Creates a window whose initial contents are frames[0..cFrames)
+struct medianWindow *medianWindowInit(const uint16_t **frames, unsigned int cFrames, size_t cPixels);
+void medianWindowDestroy(struct medianWindow *window);
+
+// Removes `frameEvicted` from the window, adds `frameAdded` to it and writes
+// the median of the resulting window to frameOut. frameEvicted must be
+// (pixelwise identical to) a frame that is currently in the window.
+void medianWindowUpdate(struct medianWindow *window, const uint16_t *frameEvicted, const uint16_t *frameAdded, uint16_t *frameOut);
+
+// medianWindowUpdate, but only for the pixels in [iFirst, iFirst+cPixels). The
+// frames are still whole frames. Updates of disjoint ranges may run
+// concurrently.
+void medianWindowUpdateRange(struct medianWindow *window, size_t iFirst, size_t cPixels,
+	const uint16_t *frameEvicted, const uint16_t *frameAdded, uint16_t *frameOut);
+
+#endif
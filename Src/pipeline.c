@@ -0,0 +1,52 @@
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pipeline.h"
+
+struct pipeline *pipelineInit(struct args args, struct repLog *log, char *name, char *videoFile)
+{
+	struct pipeline *pipeline = malloc(sizeof(*pipeline));
+	assert(pipeline);
+
+	pipeline->cam = ccameraInit(args);
+	if (!pipeline->cam) {
+		free(pipeline);
+		return NULL;
+	}
+
+	pipeline->log = log;
+	pipeline->name = name;
+	pipeline->videoFile = videoFile;
+	pipeline->cSets = 0;
+	pipeline->cReps = 0;
+
+	return pipeline;
+}
+
+int pipelineDestroy(struct pipeline *pipeline)
+{
+	struct framePoolStats stats = framePoolGetStats(ccameraGetFramePool(pipeline->cam));
+	pipelinePrintf(pipeline, "Frame pool: %llu frames handed out, at most %u of %u in use, ran out %llu times\n",
+		stats.cAllocs, stats.cPeakInUse, stats.cFrames, stats.cExhausted);
+
+	int fail = ccameraDestroy(pipeline->cam);
+	free(pipeline);
+	return fail;
+}
+
+void pipelinePrintf(struct pipeline *pipeline, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+
+	flockfile(stdout);
+	if (pipeline->name) {
+		printf("%s: ", pipeline->name);
+	}
+	vprintf(format, args);
+	funlockfile(stdout);
+
+	va_end(args);
+}
@@ -0,0 +1,41 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+// A pipeline is one complete instance of the rep counter: a ccamera and the
+// state machine that reads from it. States are handed their pipeline and keep
+// everything else in their own args or on the stack, so any number of
+// pipelines may run side by side (see batch.h).
+
+#include "args.h"
+#include "ccamera.h"
+#include "state_log.h"
+
+struct pipeline {
+	struct ccamera *cam;
+
+	// where finished sets are logged. May be shared with other pipelines.
+	struct repLog *log;
+
+	// Identifies this pipeline in console output and in the log when
+	// several are running at once, or NULL if it is the only one.
+	char *name;
+
+	// file that the counting state records a debug video to, or NULL to
+	// not record
+	char *videoFile;
+
+	// totals of every set that has been logged so far. Other threads may
+	// read these atomically while the pipeline runs.
+	unsigned int cSets;
+	unsigned int cReps;
+};
+
+// Returns NULL if the ccamera couldn't be started
+struct pipeline *pipelineInit(struct args args, struct repLog *log, char *name, char *videoFile);
+int pipelineDestroy(struct pipeline *pipeline);
+
+// printf, but prefixed with the pipeline's name if it has one. Each call is
+// printed as a unit, even if other pipelines are printing at the same time.
+void pipelinePrintf(struct pipeline *pipeline, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#endif
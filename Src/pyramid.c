@@ -0,0 +1,155 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include "pyramid.h"
+
+static inline uint16_t average(uint16_t a, uint16_t b)
+{
+	return (uint16_t) (((uint32_t) a + b + 1) >> 1);
+}
+
+static inline size_t isChanged(uint16_t a, uint16_t b, uint16_t threshold)
+{
+	uint16_t diff = a > b ? (uint16_t) (a - b) : (uint16_t) (b - a);
+	return diff > threshold;
+}
+
+// Halves the row pair (top, bottom) from output pixel iFirst on. If `previous`
+// isn't NULL, returns how many output pixels changed.
+static size_t halveRowScalar(const uint16_t *top, const uint16_t *bottom, uint16_t *out, size_t iFirst, size_t widthOut,
+	const uint16_t *previous, uint16_t threshold)
+{
+	size_t cChanged = 0;
+	for (size_t x = iFirst; x < widthOut; x++) {
+		uint16_t left = average(top[2*x], bottom[2*x]);
+		uint16_t right = average(top[2*x + 1], bottom[2*x + 1]);
+		out[x] = average(left, right);
+		if (previous) {
+			cChanged += isChanged(out[x], previous[x], threshold);
+		}
+	}
+	return cChanged;
+}
+
+#ifdef __SSE2__
+// Subtracts one from each lane of `unchanged` where a and b differ by no more
+// than `threshold`. Counting in a vector is much cheaper than a popcount per
+// comparison, which SSE2 doesn't even have.
+static inline __m128i countUnchangedSse2(__m128i unchanged, __m128i a, __m128i b, __m128i threshold)
+{
+	__m128i diff = _mm_or_si128(_mm_subs_epu16(a, b), _mm_subs_epu16(b, a));
+	// zero wherever diff <= threshold
+	__m128i over = _mm_subs_epu16(diff, threshold);
+	return _mm_add_epi16(unchanged, _mm_cmpeq_epi16(over, _mm_setzero_si128()));
+}
+
+// the number of comparisons that a countUnchangedSse2 counter has counted
+static size_t sumCounter(__m128i unchanged)
+{
+	// the lanes are negative, and at most 2^15 each
+	__m128i sums = _mm_madd_epi16(unchanged, _mm_set1_epi16(-1));
+	uint32_t parts[4];
+	_mm_storeu_si128((__m128i *) parts, sums);
+	return (size_t) parts[0] + parts[1] + parts[2] + parts[3];
+}
+
+// Does 8 output pixels at a time, and returns how many it did. Adds the number
+// that changed to *cChanged if `previous` isn't NULL. widthOut must be less than
+// 8 * 2^15, so that the counter can't overflow.
+static size_t halveRowSse2(const uint16_t *top, const uint16_t *bottom, uint16_t *out, size_t widthOut,
+	const uint16_t *previous, uint16_t threshold, size_t *cChanged)
+{
+	const __m128i low = _mm_set1_epi32(0xFFFF);
+	const __m128i bias32 = _mm_set1_epi32(0x8000);
+	const __m128i bias16 = _mm_set1_epi16((short) 0x8000);
+	const __m128i thresholds = _mm_set1_epi16((short) threshold);
+	__m128i unchanged = _mm_setzero_si128();
+
+	size_t x = 0;
+	for (; x + 8 <= widthOut; x += 8) {
+		__m128i halves[2];
+		for (unsigned int jj = 0; jj < 2; jj++) {
+			__m128i t = _mm_loadu_si128((const __m128i *) (top + 2*x + 8*jj));
+			__m128i b = _mm_loadu_si128((const __m128i *) (bottom + 2*x + 8*jj));
+			__m128i v = _mm_avg_epu16(t, b);
+
+			// Each 32 bit lane holds a left and right column. Averaging
+			// them in place leaves the result in the low half.
+			__m128i h = _mm_avg_epu16(_mm_and_si128(v, low), _mm_srli_epi32(v, 16));
+
+			// SSE2 can only pack signed numbers, so shift into range
+			halves[jj] = _mm_sub_epi32(h, bias32);
+		}
+		__m128i packed = _mm_xor_si128(_mm_packs_epi32(halves[0], halves[1]), bias16);
+		_mm_storeu_si128((__m128i *) (out + x), packed);
+
+		if (previous) {
+			__m128i p = _mm_loadu_si128((const __m128i *) (previous + x));
+			unchanged = countUnchangedSse2(unchanged, packed, p, thresholds);
+		}
+	}
+
+	if (previous) {
+		*cChanged += x - sumCounter(unchanged);
+	}
+	return x;
+}
+#endif
+
+size_t pyramidHalveAndCompare(const uint16_t *in, size_t width, size_t height, uint16_t *out,
+	const uint16_t *previous, uint16_t threshold)
+{
+	size_t widthOut = width / 2;
+	size_t heightOut = height / 2;
+	size_t cChanged = 0;
+
+	for (size_t y = 0; y < heightOut; y++) {
+		const uint16_t *top = in + 2*y * width;
+		const uint16_t *bottom = top + width;
+		uint16_t *row = out + y * widthOut;
+		const uint16_t *rowPrevious = previous ? previous + y * widthOut : NULL;
+
+		size_t iFirst = 0;
+#ifdef __SSE2__
+		iFirst = halveRowSse2(top, bottom, row, widthOut, rowPrevious, threshold, &cChanged);
+#endif
+		cChanged += halveRowScalar(top, bottom, row, iFirst, widthOut, rowPrevious, threshold);
+	}
+	return cChanged;
+}
+
+void pyramidHalve(const uint16_t *in, size_t width, size_t height, uint16_t *out)
+{
+	pyramidHalveAndCompare(in, width, height, out, NULL, 0);
+}
+
+size_t pyramidCountChanged(const uint16_t *a, const uint16_t *b, size_t cPixels, uint16_t threshold)
+{
+	size_t cChanged = 0;
+	size_t ii = 0;
+#ifdef __SSE2__
+	const __m128i thresholds = _mm_set1_epi16((short) threshold);
+	while (ii + 8 <= cPixels) {
+		// empty the counter before any lane can overflow
+		size_t iEnd = ii + 8 * (size_t) INT16_MAX;
+		iEnd = iEnd < cPixels ? iEnd : cPixels;
+
+		size_t iStart = ii;
+		__m128i unchanged = _mm_setzero_si128();
+		for (; ii + 8 <= iEnd; ii += 8) {
+			__m128i va = _mm_loadu_si128((const __m128i *) (a + ii));
+			__m128i vb = _mm_loadu_si128((const __m128i *) (b + ii));
+			unchanged = countUnchangedSse2(unchanged, va, vb, thresholds);
+		}
+		cChanged += (ii - iStart) - sumCounter(unchanged);
+	}
+#endif
+	for (; ii < cPixels; ii++) {
+		cChanged += isChanged(a[ii], b[ii], threshold);
+	}
+	return cChanged;
+}
@@ -0,0 +1,25 @@
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+// Shrinks depth frames for the work that doesn't need every pixel.
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// Writes a (width/2) x (height/2) version of `in` to `out`. Each output pixel
+// averages a 2x2 block: the two rows first, then the two columns, rounding up
+// each time. Zeros are averaged like any other depth. An odd last row or
+// column is dropped.
+void pyramidHalve(const uint16_t *in, size_t width, size_t height, uint16_t *out);
+
+// pyramidHalve, but also returns how many output pixels differ from the same
+// pixel of `previous`, a frame the size of the output, by more than
+// `threshold`. Comparing while the output is still in registers saves a
+// second pass over it.
+size_t pyramidHalveAndCompare(const uint16_t *in, size_t width, size_t height, uint16_t *out,
+	const uint16_t *previous, uint16_t threshold);
+
+// how many of the cPixels pixels of `a` and `b` differ by more than `threshold`
+size_t pyramidCountChanged(const uint16_t *a, const uint16_t *b, size_t cPixels, uint16_t threshold);
+
+#endif
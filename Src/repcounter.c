@@ -1,34 +1,129 @@
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "args.h"
+#include "batch.h"
+#include "filter.h"
+#include "pipeline.h"
 #include "state.h"
-#include "ccamera.h"
+#include "state_log.h"
+#include "stations.h"
+
+// file that the counting state records a debug video to
+#define FVIDEO_COUNTING "/tmp/count"
 
 bool parseArgs(int argc, char **argv, struct args *out)
 {
-	if (argc != 3) {
+	if (argc < 3) {
 		goto FAIL;
 	}
 
+	out->replay = false;
+	out->batch = false;
+	out->stations = false;
 	if (!strcmp("--read", argv[1])) {
 		out->write=false;
+	} else if (!strcmp("--replay", argv[1])) {
+		out->write=false;
+		out->replay=true;
 	} else if (!strcmp("--write", argv[1])) {
 		out->write=true;
+	} else if (!strcmp("--stations", argv[1])) {
+		out->write=true;
+		out->stations=true;
+	} else if (!strcmp("--batch", argv[1])) {
+		out->write=false;
+		out->replay=true;
+		out->batch=true;
 	} else {
 		goto FAIL;
 	}
 
 	out->file = argv[2];
+	out->device = NULL;
+	out->batch_files = NULL;
+	out->batch_cFiles = 0;
+	out->batch_jobs = 0;
+
+	int iArg = 3;
+	if (out->batch) {
+		// everything up to the first option is a recording
+		while (iArg < argc && strncmp("--", argv[iArg], 2)) {
+			iArg++;
+		}
+		out->file = NULL;
+		out->batch_files = &argv[2];
+		out->batch_cFiles = (unsigned int) (iArg - 2);
+	}
 
 	out->ccamera_sample_size = 5;
 	out->ccamera_sample_delta = 4;
+	out->ccamera_incremental = false;
+	out->ccamera_threads = 1;
+	out->ccamera_slab = false;
+	out->ccamera_filters = FILTER_CHAIN_DEFAULT;
+	out->log_file = LOG_FNAME;
+	out->archive_file = NULL;
+
+	for (; iArg < argc; iArg++) {
+		bool hasValue = iArg + 1 < argc;
+		if (!strcmp("--incremental", argv[iArg])) {
+			out->ccamera_incremental = true;
+		} else if (!strcmp("--filters", argv[iArg]) && hasValue) {
+			out->ccamera_filters = argv[++iArg];
+		} else if (!strcmp("--slab", argv[iArg])) {
+			out->ccamera_slab = true;
+		} else if (!strcmp("--threads", argv[iArg]) && hasValue) {
+			char *end;
+			long threads = strtol(argv[++iArg], &end, 10);
+			if (*end || threads < 0 || threads > UINT_MAX) {
+				goto FAIL;
+			}
+			out->ccamera_threads = (unsigned int) threads;
+		} else if (!strcmp("--log", argv[iArg]) && hasValue) {
+			out->log_file = argv[++iArg];
+		} else if (!strcmp("--device", argv[iArg]) && hasValue && out->write && !out->stations) {
+			out->device = argv[++iArg];
+		} else if (!strcmp("--archive", argv[iArg]) && hasValue && !out->batch && !out->stations) {
+			out->archive_file = argv[++iArg];
+		} else if (!strcmp("--jobs", argv[iArg]) && hasValue && out->batch) {
+			char *end;
+			long jobs = strtol(argv[++iArg], &end, 10);
+			if (*end || jobs < 1 || jobs > UINT_MAX) {
+				goto FAIL;
+			}
+			out->batch_jobs = (unsigned int) jobs;
+		} else {
+			goto FAIL;
+		}
+	}
 
 	return true;
 FAIL:
 	puts("USAGE:");
-	printf("A: %s --write /file/\n", argv[0]);
-	printf("B: %s --read /file/\n", argv[0]);
+	printf("A: %s --write /file/ [options]\n", argv[0]);
+	printf("B: %s --read /file/ [options]\n", argv[0]);
+	printf("C: %s --replay /file/ [options]\n", argv[0]);
+	printf("D: %s --batch /path/ [/path/ ...] [options]\n", argv[0]);
+	printf("E: %s --stations /directory/ [options]\n", argv[0]);
+	puts("");
+	puts("--replay processes a recording as fast as possible, rather than in real time");
+	puts("--batch replays many recordings (or directories of them) in parallel");
+	puts("--stations counts reps on every attached device at once, recording each to /directory/");
+	puts("");
+	puts("OPTIONS:");
+	puts("--incremental: update the denoising median incrementally");
+	printf("--filters LIST: denoise with the comma separated stages in LIST, out of median, ema=A, holes\n"
+	       "    and decimate=F (default: %s)\n", FILTER_CHAIN_DEFAULT);
+	puts("--slab: keep the frames being denoised interleaved pixel by pixel");
+	puts("--threads N: compute the denoising median on N threads, or one per CPU if N is 0 (default: 1)");
+	puts("--device SERIAL: with --write, record from the device with this serial number");
+	printf("--log /file/: append finished sets to /file/ instead of %s\n", LOG_FNAME);
+	puts("    (with --stations, each device's sets go to /file/.SERIAL)");
+	puts("--archive /file/: also write every denoised frame to /file/ in the lossless archive format");
+	puts("--jobs N: with --batch, replay at most N recordings at once (default: one per CPU)");
 	return false;
 }
 
@@ -41,21 +136,30 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	if (args.batch) {
+		return batchRun(args);
+	}
+	if (args.stations) {
+		return stationsRun(args);
+	}
+
+	struct repLog *log = repLogInit(args.log_file);
 
-	int fail;
-	fail = ccameraInit(args);
-	if (fail) {
+	struct pipeline *pipeline = pipelineInit(args, log, NULL, FVIDEO_COUNTING);
+	if (!pipeline) {
 		puts("CCAMERA INIT FAILED");
 		return EXIT_FAILURE;
 	}
 
-	int ret = stateRun();
+	int ret = stateRun(pipeline);
 
-	fail = ccameraDestroy();
+	int fail = pipelineDestroy(pipeline);
 	if (fail) {
 		puts("CCAMERA DESTROY FAILED");
 		return EXIT_FAILURE;
 	}
 
+	repLogDestroy(log);
+
 	return ret;
 }
@@ -0,0 +1,98 @@
+#include <assert.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "repdetector.h"
+
+// how far the range moves towards the size of each half rep that is seen
+static const double rangeWeight = 0.25;
+
+struct repDetector {
+	double range;
+	double rangeMin;
+
+	// true while the samples should be heading up, i.e. while `extreme` is
+	// the lowest sample since the last turn
+	bool rising;
+
+	// The most extreme sample since the last turn, and the time of its
+	// frame. Only valid once there has been a sample.
+	bool started;
+	double extreme;
+	unsigned long long msExtreme;
+
+	// the sample that the samples last turned at, if they have turned yet
+	bool turned;
+	double lastTurn;
+};
+
+struct repDetector *repDetectorInit(double range, bool rising)
+{
+	struct repDetector *det = malloc(sizeof(*det));
+	assert(det);
+	det->range = range;
+	det->rangeMin = range / 2;
+	det->rising = rising;
+	det->started = false;
+	det->extreme = 0;
+	det->msExtreme = 0;
+	det->turned = false;
+	det->lastTurn = 0;
+	return det;
+}
+
+void repDetectorDestroy(struct repDetector *det)
+{
+	free(det);
+}
+
+// Moves the range towards the size of the half rep that just ended at
+// `extreme`
+static void adaptRange(struct repDetector *det)
+{
+	if (det->turned) {
+		double size = fabs(det->extreme - det->lastTurn);
+		det->range += (size - det->range) * rangeWeight;
+		det->range = det->range > det->rangeMin ? det->range : det->rangeMin;
+	}
+	det->turned = true;
+	det->lastTurn = det->extreme;
+}
+
+bool repDetectorPush(struct repDetector *det, double sample, unsigned long long ms, unsigned long long *msRep)
+{
+	if (!det->started ||
+	    (det->rising && sample < det->extreme) ||
+	    (!det->rising && sample > det->extreme)) {
+		// still heading away from the last turn
+		det->started = true;
+		det->extreme = sample;
+		det->msExtreme = ms;
+		return false;
+	}
+
+	if (fabs(sample - det->extreme) <= det->range * REPDETECTOR_THRESHOLD) {
+		// nothing interesting is happening
+		return false;
+	}
+
+	// the samples turned at `extreme`, and are now heading back
+	unsigned long long msTurn = det->msExtreme;
+	adaptRange(det);
+	det->extreme = sample;
+	det->msExtreme = ms;
+	det->rising = !det->rising;
+
+	// only count every other turn
+	if (det->rising) {
+		*msRep = msTurn;
+		return true;
+	}
+	return false;
+}
+
+double repDetectorGetRange(struct repDetector *det)
+{
+	return det->range;
+}
@@ -0,0 +1,45 @@
+#ifndef REPDETECTOR_H
+#define REPDETECTOR_H
+
+// Finds reps in a stream of samples, one per frame, such as the average depth
+// of part of each frame. A rep is one swing of the samples each way.
+//
+// The detector follows the most extreme sample since the samples last turned
+// around. Once they have come back from it by REPDETECTOR_THRESHOLD of the
+// range, they have turned at that sample; every second turn completes a rep.
+// Noise smaller than that never counts as a turn.
+//
+// The range starts out as the caller's estimate, then follows the size of the
+// half reps that are actually seen. It never drops below half of the estimate,
+// so that reps which gradually trail off into fidgeting stop being counted.
+//
+// A rep is therefore only reported well after its top: once the samples are
+// REPDETECTOR_THRESHOLD of the range back down from it. For smooth, even reps
+// that is a little over halfway through the next half rep, e.g. about 0.4 s
+// after the top for reps that take 1.5 s. The time reported is still that of
+// the top.
+//
+// Each sample takes constant time, and the detector keeps no history.
+
+#include <stdbool.h>
+
+// the fraction of the range that the samples must come back by to turn
+#define REPDETECTOR_THRESHOLD 0.6
+
+struct repDetector;
+
+// `range` is the expected distance between the top and bottom of a rep. If
+// `rising`, the samples are expected to go up first; the first rep is then
+// complete once they have gone up and come back down.
+struct repDetector *repDetectorInit(double range, bool rising);
+void repDetectorDestroy(struct repDetector *det);
+
+// Adds the sample for the frame at time `ms`. Returns true if it completes a
+// rep, in which case *msRep is the time of the frame at which the samples
+// turned; that is, of the rep's top.
+bool repDetectorPush(struct repDetector *det, double sample, unsigned long long ms, unsigned long long *msRep);
+
+// the current estimate of the distance between the top and bottom of a rep
+double repDetectorGetRange(struct repDetector *det);
+
+#endif
@@ -0,0 +1,155 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include "sat.h"
+
+struct sat {
+	size_t width, height;
+
+	// (width+1) * (height+1) entries. table[y*(width+1) + x] is the sum of
+	// every pixel above and to the left of (x, y), so row 0 and column 0
+	// are all zero.
+	int64_t *table;
+};
+
+struct sat *satInit(size_t width, size_t height)
+{
+	assert(width <= INT32_MAX / UINT16_MAX);
+
+	struct sat *sat = malloc(sizeof(*sat));
+	assert(sat);
+	sat->width = width;
+	sat->height = height;
+
+	// the builders never write row 0 or column 0, so they stay zero
+	sat->table = calloc((width + 1) * (height + 1), sizeof(*sat->table));
+	assert(sat->table);
+
+	return sat;
+}
+
+void satDestroy(struct sat *sat)
+{
+	free(sat->table);
+	free(sat);
+}
+
+// Fills in one row of the table: out[x] = above[x] + sum + the sum of f1[0..x]
+// - f2[0..x]. f2 can be NULL, in which case it's treated as all zeros. `sum` is
+// the row's sum so far, from any pixels to the left of f1[0].
+static void buildRowScalar(int64_t *out, const int64_t *above,
+	const uint16_t *f1, const uint16_t *f2, size_t width, int32_t sum)
+{
+	for (size_t iX = 0; iX < width; iX++) {
+		sum += f1[iX];
+		if (f2) {
+			sum -= f2[iX];
+		}
+		out[iX] = above[iX] + sum;
+	}
+}
+
+#ifdef __SSE2__
+
+// out[0..3] = above[0..3] + the four 32 bit lanes of v, sign extended
+static inline void addRow4(int64_t *out, const int64_t *above, __m128i v)
+{
+	__m128i sign = _mm_srai_epi32(v, 31);
+	__m128i lo = _mm_unpacklo_epi32(v, sign);
+	__m128i hi = _mm_unpackhi_epi32(v, sign);
+
+	lo = _mm_add_epi64(lo, _mm_loadu_si128((const __m128i *) above));
+	hi = _mm_add_epi64(hi, _mm_loadu_si128((const __m128i *) (above + 2)));
+	_mm_storeu_si128((__m128i *) out, lo);
+	_mm_storeu_si128((__m128i *) (out + 2), hi);
+}
+
+// inclusive prefix sum of the four 32 bit lanes of v
+static inline __m128i prefixSum4(__m128i v)
+{
+	v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+	v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+	return v;
+}
+
+// Same as buildRowScalar, 8 pixels at a time
+static void buildRowSse2(int64_t *out, const int64_t *above,
+	const uint16_t *f1, const uint16_t *f2, size_t width)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i carry = zero; // the row's sum so far, in every lane
+
+	size_t iX = 0;
+	for (; iX + 8 <= width; iX += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *) (f1 + iX));
+		__m128i lo = _mm_unpacklo_epi16(a, zero);
+		__m128i hi = _mm_unpackhi_epi16(a, zero);
+		if (f2) {
+			__m128i b = _mm_loadu_si128((const __m128i *) (f2 + iX));
+			lo = _mm_sub_epi32(lo, _mm_unpacklo_epi16(b, zero));
+			hi = _mm_sub_epi32(hi, _mm_unpackhi_epi16(b, zero));
+		}
+
+		lo = _mm_add_epi32(prefixSum4(lo), carry);
+		carry = _mm_shuffle_epi32(lo, 0xFF);
+		hi = _mm_add_epi32(prefixSum4(hi), carry);
+		carry = _mm_shuffle_epi32(hi, 0xFF);
+
+		addRow4(out + iX, above + iX, lo);
+		addRow4(out + iX + 4, above + iX + 4, hi);
+	}
+
+	// finish off the last few pixels one at a time
+	buildRowScalar(out + iX, above + iX, f1 + iX, f2 ? f2 + iX : NULL,
+		width - iX, _mm_cvtsi128_si32(carry));
+}
+
+#define buildRow buildRowSse2
+#else
+#define buildRow(out, above, f1, f2, width) buildRowScalar(out, above, f1, f2, width, 0)
+#endif
+
+static void build(struct sat *sat, const uint16_t *f1, const uint16_t *f2)
+{
+	size_t width = sat->width;
+	size_t stride = width + 1;
+
+	for (size_t iY = 0; iY < sat->height; iY++) {
+		int64_t *above = sat->table + iY * stride + 1;
+		size_t offset = iY * width;
+		buildRow(above + stride, above, f1 + offset, f2 ? f2 + offset : NULL, width);
+	}
+}
+
+void satBuild(struct sat *sat, const uint16_t *frame)
+{
+	build(sat, frame, NULL);
+}
+
+void satBuildDelta(struct sat *sat, const uint16_t *f1, const uint16_t *f2)
+{
+	build(sat, f1, f2);
+}
+
+int64_t satSum(const struct sat *sat, size_t xMin, size_t xMax, size_t yMin, size_t yMax)
+{
+	assert(xMin <= xMax && xMax <= sat->width);
+	assert(yMin <= yMax && yMax <= sat->height);
+
+	size_t stride = sat->width + 1;
+	const int64_t *top = sat->table + yMin * stride;
+	const int64_t *bottom = sat->table + yMax * stride;
+	return bottom[xMax] - bottom[xMin] - top[xMax] + top[xMin];
+}
+
+double satAverage(const struct sat *sat, size_t xMin, size_t xMax, size_t yMin, size_t yMax)
+{
+	size_t numPixels = (yMax - yMin) * (xMax - xMin);
+	assert(numPixels);
+	return (double) satSum(sat, xMin, xMax, yMin, yMax) / (double) numPixels;
+}
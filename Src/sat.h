@@ -0,0 +1,27 @@
+#ifndef SAT_H
+#define SAT_H
+
+// A summed-area table (integral image) of a frame. Building one takes a single
+// pass over the frame; after that, the sum of any rectangle of pixels costs
+// four lookups no matter how big the rectangle is.
+
+#include <stdint.h>
+#include <stdlib.h>
+
+struct sat;
+
+// width can be at most 32768, so that a row's sum fits in 32 bits
+struct sat *satInit(size_t width, size_t height);
+void satDestroy(struct sat *sat);
+
+// Fills `sat` in from `frame`
+void satBuild(struct sat *sat, const uint16_t *frame);
+// Fills `sat` in from the pixel by pixel difference f1 - f2
+void satBuildDelta(struct sat *sat, const uint16_t *f1, const uint16_t *f2);
+
+// The sum of the pixels with xMin <= x < xMax and yMin <= y < yMax
+int64_t satSum(const struct sat *sat, size_t xMin, size_t xMax, size_t yMin, size_t yMax);
+// The average of the same pixels. The rectangle must not be empty.
+double satAverage(const struct sat *sat, size_t xMin, size_t xMax, size_t yMin, size_t yMax);
+
+#endif
@@ -0,0 +1,112 @@
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "spsc.h"
+
+struct spscQueue {
+	void **items;
+	unsigned int capacity;
+
+	// The number of items ever pushed and popped. Only the producer writes
+	// `tail`, and only the consumer writes `head`; item i lives in
+	// items[i % capacity].
+	unsigned long long head;
+	unsigned long long tail;
+
+	// Only used to wake a waiting consumer; the queue itself is lock free.
+	pthread_mutex_t mut;
+	pthread_cond_t cond;
+};
+
+struct spscQueue *spscInit(unsigned int capacity)
+{
+	assert(capacity > 0);
+
+	struct spscQueue *queue = malloc(sizeof(*queue));
+	assert(queue);
+	queue->items = malloc(sizeof(*queue->items) * capacity);
+	assert(queue->items);
+	queue->capacity = capacity;
+	queue->head = 0;
+	queue->tail = 0;
+	queue->mut = (pthread_mutex_t) PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
+	// spscPopWait's deadlines are on the monotonic clock, which can't be set
+	pthread_condattr_t condAttr;
+	assert(!pthread_condattr_init(&condAttr));
+	assert(!pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC));
+	assert(!pthread_cond_init(&queue->cond, &condAttr));
+	assert(!pthread_condattr_destroy(&condAttr));
+
+	return queue;
+}
+
+void spscDestroy(struct spscQueue *queue)
+{
+	free(queue->items);
+	free(queue);
+}
+
+bool spscPush(struct spscQueue *queue, void *item)
+{
+	unsigned long long tail = queue->tail;
+	unsigned long long head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+	if (tail - head == queue->capacity) {
+		return false;
+	}
+
+	queue->items[tail % queue->capacity] = item;
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+
+	// The consumer checks for items with `mut` locked before it waits, so
+	// taking it here guarantees that it either sees the item or gets woken.
+	assert(!pthread_mutex_lock(&queue->mut));
+	assert(!pthread_cond_signal(&queue->cond));
+	assert(!pthread_mutex_unlock(&queue->mut));
+
+	return true;
+}
+
+void *spscPop(struct spscQueue *queue)
+{
+	unsigned long long head = queue->head;
+	unsigned long long tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+	if (head == tail) {
+		return NULL;
+	}
+
+	void *item = queue->items[head % queue->capacity];
+	__atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+	return item;
+}
+
+void *spscPopWait(struct spscQueue *queue, unsigned int msTimeout)
+{
+	void *item = spscPop(queue);
+	if (item) {
+		return item;
+	}
+
+	struct timespec stop;
+	assert(!clock_gettime(CLOCK_MONOTONIC, &stop));
+	stop.tv_sec += msTimeout / 1000;
+	stop.tv_nsec += (long) (msTimeout % 1000) * 1000000;
+	if (stop.tv_nsec >= 1000000000) {
+		stop.tv_sec++;
+		stop.tv_nsec -= 1000000000;
+	}
+
+	assert(!pthread_mutex_lock(&queue->mut));
+	while (__atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == queue->head) {
+		int fail = pthread_cond_timedwait(&queue->cond, &queue->mut, &stop);
+		if (fail == ETIMEDOUT) {
+			break;
+		}
+		assert(!fail);
+	}
+	assert(!pthread_mutex_unlock(&queue->mut));
+
+	return spscPop(queue);
+}
@@ -0,0 +1,25 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+// A bounded, lock free queue of pointers with exactly one producer thread and
+// one consumer thread. The consumer can block until something is pushed.
+
+#include <stdbool.h>
+
+struct spscQueue;
+
+struct spscQueue *spscInit(unsigned int capacity);
+// The queue should be empty; anything still in it is leaked.
+void spscDestroy(struct spscQueue *queue);
+
+// Producer only. Returns false, without pushing, if the queue is full.
+bool spscPush(struct spscQueue *queue, void *item);
+
+// Consumer only. Returns NULL if the queue is empty.
+void *spscPop(struct spscQueue *queue);
+
+// Consumer only. Like spscPop, but first waits up to msTimeout ms for an item
+// to be pushed.
+void *spscPopWait(struct spscQueue *queue, unsigned int msTimeout);
+
+#endif
@@ -4,15 +4,16 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include "state.h"
 #include "helper.h"
+#include "pipeline.h"
+#include "state.h"
 
-struct state runError(void *args, char **err, int *ret)
+struct state runError(struct pipeline *pipeline, void *args, char **err, int *ret)
 {
 	(void) args;
 	(void) ret;
 
-	puts(*err);
+	pipelinePrintf(pipeline, "%s\n", *err);
 	*err = NULL;
 	return STATE_EXIT;
 }
@@ -35,7 +36,7 @@ bool stateValid(struct state state)
 	return false;
 }
 
-int stateRun()
+int stateRun(struct pipeline *pipeline)
 {
 	char *err = NULL;
 	int ret = 0;
@@ -48,19 +49,19 @@ int stateRun()
 			return ret;
 		}
 
-		unsigned long long tPre = getTimeInMs();
-		struct state state_new = state.function(state.args, &err, &ret);
-		unsigned long long tPost = getTimeInMs();
+		double tPre = getMonotonicTimeInMs();
+		struct state state_new = state.function(pipeline, state.args, &err, &ret);
+		double tPost = getMonotonicTimeInMs();
 		if (state.shouldFreeArgs) {
 			free(state.args);
 		}
 		if (!stateValid(state_new)) {
-			printf("ERROR: state %s returned an invalid state: {%p, %p}\n", state.name, state_new.name, state_new.function);
+			pipelinePrintf(pipeline, "ERROR: state %s returned an invalid state: {%p, %p}\n", state.name, state_new.name, state_new.function);
 			return EXIT_FAILURE;
 		}
 
-		unsigned long long delta = tPost - tPre;
-		printf("State %s ran for %llu seconds and set state to %s\n", state.name, delta/1000, state_new.name);
+		unsigned long long delta = (unsigned long long) (tPost - tPre);
+		pipelinePrintf(pipeline, "State %s ran for %llu seconds and set state to %s\n", state.name, delta/1000, state_new.name);
 
 		state = state_new;
 	}
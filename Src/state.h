@@ -10,7 +10,10 @@
 
 
 struct state;
-typedef struct state (*stateFunction) (void *args, char **err, int *ret);
+struct pipeline;
+// `pipeline` is the pipeline that the state machine is running in. States must
+// not keep any data in globals, as several pipelines may be running at once.
+typedef struct state (*stateFunction) (struct pipeline *pipeline, void *args, char **err, int *ret);
 struct state {
 	char *name;
 	stateFunction function;
@@ -22,27 +25,27 @@ struct state {
 
 bool stateEqual(struct state state1, struct state state2);
 bool stateValid(struct state state);
-int stateRun();
+int stateRun(struct pipeline *pipeline);
 
 
 #define STATE_EXIT ((struct state) { .name="exit", .function=NULL, .args=NULL, .shouldFreeArgs=false, })
 
-struct state runError(void *args, char **err, int *ret);
+struct state runError(struct pipeline *pipeline, void *args, char **err, int *ret);
 #define STATE_ERROR ((struct state) { .name="error", .function=runError, .args=NULL, .shouldFreeArgs=false, })
 
-struct state runLowPower (void *args, char **err_msg, int *ret);
+struct state runLowPower (struct pipeline *pipeline, void *args, char **err_msg, int *ret);
 #define STATE_LOW_POWER ((struct state) { .name="low-power", .function=runLowPower, .args=NULL, .shouldFreeArgs=false, })
 
-struct state runCounting(void *args, char **err, int *ret);
+struct state runCounting(struct pipeline *pipeline, void *args, char **err, int *ret);
 #define STATE_COUNTING ((struct state) { .name="counting", .function=runCounting, .args=NULL, .shouldFreeArgs=false, })
 
-struct state runStarting(void *args, char **err, int *ret);
+struct state runStarting(struct pipeline *pipeline, void *args, char **err, int *ret);
 #define STATE_STARTING ((struct state) { .name="starting", .function=runStarting, .args=NULL, .shouldFreeArgs=false, })
 
-struct state runRecording(void *args, char **err_msg, int *retStatus);
+struct state runRecording(struct pipeline *pipeline, void *args, char **err_msg, int *retStatus);
 #define STATE_RECORDING ((struct state) { .name="recording", .function=runRecording, .args=NULL, .shouldFreeArgs=false, })
 
-struct state runLog(void *a, char **err, int *ret);
+struct state runLog(struct pipeline *pipeline, void *a, char **err, int *ret);
 #define STATE_LOG ((struct state) { .name="logging", .function=runLog, .args=NULL, .shouldFreeArgs=false, })
 
 static const struct state ALL_STATES[] = { STATE_EXIT, STATE_ERROR, STATE_LOW_POWER, STATE_STARTING, STATE_COUNTING, STATE_RECORDING, STATE_LOG };
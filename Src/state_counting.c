@@ -1,5 +1,4 @@
 #include <assert.h>
-#include <pthread.h>
 #include <stdio.h>
 //#include <string.h>
 #include <unistd.h>
@@ -8,68 +7,73 @@
 #include "camera.h"
 #include "ccamera.h"
 #include "helper.h"
+#include "pipeline.h"
+#include "repdetector.h"
+#include "sat.h"
 #include "state.h"
 #include "state_counting.h"
 #include "state_log.h"
 #include "video.h"
 
-// Stores the new frames that have not yet been considered. It is initially
-// empty, but a separate thread adds new frames to the end of it as they become
-// available.
-static uint16_t **buf;
-// how many frames are in fNew right now
-static unsigned int cBuf = 0;
-// max size of buf
-static const unsigned int cBufMax = CAMERA_FPS * 5;
-// mutex for all buf related variables
-static pthread_mutex_t mutBuf = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
-
-static pthread_t thdRead; // reads individual frames into `fNew`
-
-
-
-static bool growingDistant;
-
-// This value is obtained by doing the computation:
-//   take the last two extreme frames (either peak&valley of a rep, or the valley&peak).
-//   subtract one from the other
-//   take the average value of the pixels in box
-//   THEN take the absolute value of that value
-
-// todo: update this value as new data comes in. Actually not, because it seems
-// likely that reps gradually get shallower as cReps increases and we don't want
-// to cound the bad ones at the end.
-static double range;
-static double lastExtreme;
-
-static volatile bool done;
+// how long runCounting waits for a frame before checking whether it has been
+// idle for too long
+static const unsigned int msWaitFrame = 1000;
 
 // A region of a frame. `Min`s are included, `Max`s are excluded.
 struct box {
 	size_t xMin, xMax, yMin, yMax;
 };
-static struct box box;
+
+// Everything that one run of the counting state works with
+struct counting {
+	struct ccamera *cam;
+	struct framePool *pool;
+	// NULL if the pipeline doesn't record a debug video. Live, frames are
+	// dropped from the video rather than ever making counting wait for
+	// the encoder.
+	struct video *video;
+
+	// every frame that ccamera publishes, carrying on from where the
+	// starting state left off
+	struct ccameraSubscription *sub;
+
+	// false in replay mode
+	bool live;
+
+	// fed the average of the pixels in `box` of every frame, in order
+	struct repDetector *detector;
+	// when the first frame of the set was captured; reps are reported
+	// relative to this
+	unsigned long long msStart;
+
+	bool done;
+
+	struct box box;
+
+	// Live only: how long after the camera handed over the frame that
+	// completed each new rep it was counted
+	double msRepLatency;
+	double msRepLatencyMax;
+	unsigned int cRepLatency;
+};
 
 // number of ms that the user has to be idle for before termination
 static const unsigned long long msIdle = 10*1000;
 
-static void* readMain(void *none)
+// Copies the next frame that ccamera publishes, and its info, into a frame
+// from the pool. Returns NULL if there isn't one within msWaitFrame, or in
+// replay mode, at the end of the stream.
+static uint16_t *readFrame(struct counting *c)
 {
-	(void) none;
-
-	while (!done) {
-		usleep(1000000 / CAMERA_FPS);
-
-		assert(!pthread_mutex_lock(&mutBuf));
-
-		assert(cBuf < cBufMax);
-		ccameraGetFrame(buf[cBuf]);
-		cBuf++;
-
-		assert(!pthread_mutex_unlock(&mutBuf));
+	const struct ccameraFrame *view = ccameraWaitFrame(c->sub, msWaitFrame);
+	if (!view) {
+		return NULL;
 	}
 
-	return NULL;
+	uint16_t *frame = ccameraCopyToPool(c->cam, view);
+	assert(frame);
+	ccameraRelease(view);
+	return frame;
 }
 
 static unsigned int findNext(double *avgs, unsigned int cFrames, unsigned int start, bool max)
@@ -130,89 +134,58 @@ static unsigned int findMin(double *avgs, unsigned int start, unsigned int end)
 	return findExtreme(avgs, start, end, false);
 }
 
-// todo: duplicate code; avgInBoxInt/avgInBox
-static double avgInBoxInt(int *frame, struct box box)
+// the average of the pixels in box, summed directly from `frame`. For a
+// single lookup this beats building a `struct sat`, which has to visit the
+// whole frame rather than just the box.
+static double avgInBox(uint16_t *frame, size_t width, struct box box)
 {
-	size_t width = ccameraGetFrameWidth();
-	double total = 0;
+	uint64_t total = 0;
 
 	for (size_t iY = box.yMin; iY < box.yMax; iY++) {
+		const uint16_t *row = frame + iY*width;
 		for (size_t iX = box.xMin; iX < box.xMax; iX++) {
-			total += frame[iY*width + iX];
+			total += row[iX];
 		}
 	}
 
 	size_t numPixels = (box.yMax - box.yMin) * (box.xMax - box.xMin);
-	return total / (double) numPixels;
+	return (double) total / (double) numPixels;
 }
 
-// todo: duplicate code; avgInBoxInt/avgInBox
-static double avgInBox(uint16_t *frame, struct box box)
+static double avgInSat(struct sat *sat, struct box box)
 {
-	size_t width = ccameraGetFrameWidth();
-	double total = 0;
-
-	for (size_t iY = box.yMin; iY < box.yMax; iY++) {
-		for (size_t iX = box.xMin; iX < box.xMax; iX++) {
-			total += frame[iY*width + iX];
-		}
-	}
-
-	size_t numPixels = (box.yMax - box.yMin) * (box.xMax - box.xMin);
-	return total / (double) numPixels;
+	return satAverage(sat, box.xMin, box.xMax, box.yMin, box.yMax);
 }
 
-// Return a box whose contained pixels are a strict subset of the given box's
-// pixels.
-//
-// Each subsequent call shrinks the box in a different direction, and possibly
-// by a different amount. This isn't thread safe or anything though, so be
-// careful if you rely on that behavior.
-static struct box nextShrink(struct box box, bool reset)
+// Shrinks one side of `box` by `amount` of its length, rounded up. dir%2 picks
+// x or y, and dir/2 picks whether the min or max side moves. Returns the
+// number of pixels removed from that side, or 0, leaving `box` alone, if that
+// would leave it empty.
+static size_t shrinkBox(struct box *box, unsigned int dir, double amount)
 {
-	static unsigned int dir = 0;
-	static double maxAmount = 0.3;
-	static double amount;
-
-	if (reset) {
-		dir = 0;
-		amount = maxAmount;
-		return box;
-	}
-
 	bool vertical = dir % 2;
 	bool increaseMin = (dir / 2) % 2;
 
-	size_t range = vertical ? box.yMax - box.yMin : box.xMax - box.xMin;
+	size_t range = vertical ? box->yMax - box->yMin : box->xMax - box->xMin;
 	double ddelta = ceil((double)range * amount);
-	assert(ddelta < SIZE_MAX);
+	if (ddelta >= (double) range) {
+		return 0;
+	}
 	size_t delta = (size_t) ddelta;
 
 	size_t *value = vertical ?
-		(increaseMin ? &box.yMin : &box.yMax) :
-		(increaseMin ? &box.xMin : &box.xMax);
+		(increaseMin ? &box->yMin : &box->yMax) :
+		(increaseMin ? &box->xMin : &box->xMax);
 	if (!increaseMin) {
-		assert(*value >= delta);
 		*value -= delta;
 	} else {
-		assert(*value <= SIZE_MAX - delta);
 		*value += delta;
 	}
-
-
-	dir++;
-	if (dir % 4 != dir) {
-		dir = dir % 4;
-		amount *= 0.7;
-	}
-
-	return box;
+	return delta;
 }
 
-static __attribute__((unused)) void drawBox(uint16_t *frame, uint16_t color, struct box box)
+static __attribute__((unused)) void drawBox(uint16_t *frame, size_t width, uint16_t color, struct box box)
 {
-	size_t width = ccameraGetFrameWidth();
-
 	// draw horizontal lines
 	for (size_t iX = box.xMin; iX < box.xMax; iX++) {
 		frame[width*box.yMin + iX] = color;
@@ -253,209 +226,252 @@ static void findExtremePair(double *avgs, unsigned int cFrames, unsigned int *iM
 	}
 }
 
-// f1 - f2 -> fOut, but only for the pixels in box
-static void boxSubtraction(uint16_t *f1, uint16_t *f2, int *fOut, struct box box)
-{
-	size_t fWidth = ccameraGetFrameWidth(); // width of the FRAME, not box.
-	for (size_t iY = box.yMin; iY < box.yMax; iY++) {
-		for (size_t iX = box.xMin; iX < box.xMax; iX++) {
-			size_t ii = iY*fWidth + iX;
-			fOut[ii] = f1[ii] - f2[ii];
-		}
-	}
-}
-
-static void initializeBox(uint16_t *fMin, uint16_t *fMax)
+static void initializeBox(struct counting *c, uint16_t *fMin, uint16_t *fMax)
 {
+	// The largest fraction of a side that one step shrinks it by. Each
+	// step also tries shrinking by this times scaleFactor, times
+	// scaleFactor^2, and so on, down to a single pixel.
+	static const double maxAmount = 0.3;
+	static const double scaleFactor = 0.7;
+	// A step is only taken if it improves utility by at least this much,
+	// otherwise we'd shrink down to whichever few pixels are noisiest.
+	static const double minGain = 1.20;
+	// Searching stops after this many steps, even if it could still
+	// improve. Each step is about a hundred O(1) lookups, and the count
+	// rather than a time limit keeps the box the same however busy the
+	// machine is, so replays stay reproducible.
+	static const unsigned int cStepsMax = 100;
+
+	size_t width = ccameraGetFrameWidth(c->cam);
 	struct box boxBest;
-	boxBest.xMax = ccameraGetFrameWidth();
+	boxBest.xMax = width;
 	boxBest.xMin = 0;
-	boxBest.yMax = ccameraGetFrameHeight();
+	boxBest.yMax = ccameraGetFrameHeight(c->cam);
 	boxBest.yMin = 0;
 
-	size_t numPixels = ccameraGetNumPixels();
-	int *delta = malloc(sizeof(int*) * numPixels);
-	assert(delta);
-	// todo: wouldn't we get better SNR by adding a `delta[i] =
-	// max(delta[i], 0)` line? after the subtraction? Test this.
-	boxSubtraction(fMax, fMin, delta, boxBest);
-
-	double utilBest = avgInBoxInt(delta, boxBest);
-
-	nextShrink(boxBest, true);
-	unsigned int lastShrink = 0;
-	while(lastShrink < 10) { // arbitrary
-		lastShrink++;
-		// todo: use a slightly less greedy algorithm. Examine all four
-		// shrink directions, and choose the one that gets the best result.
-
-		// todo: instead of using static variables & special reset
-		// parameter, just pass `lastShrink`. %4 to get direction, /4 to
-		// get magnitude.
-		struct box boxNew = nextShrink(boxBest, false);
-		double utilNew = avgInBoxInt(delta, boxNew);
-
-
-		double fracChange = utilNew / utilBest;
-		if (fracChange >= 1.20) {
-			nextShrink(boxBest, true);
-			boxBest = boxNew;
-			utilBest = utilNew;
-			lastShrink = 0;
+	// Every candidate box is scored on the same delta, so build its
+	// summed-area table once and score each box in O(1).
+	//
+	// todo: wouldn't we get better SNR by clamping each pixel's delta to
+	// be at least zero? Test this.
+	struct sat *sat = satInit(width, boxBest.yMax);
+	satBuildDelta(sat, fMax, fMin);
+	double utilBest = avgInSat(sat, boxBest);
+
+	// Each step tries every direction at every scale, and takes whichever
+	// shrink improves utility the most.
+	for (unsigned int iStep = 0; iStep < cStepsMax; iStep++) {
+		struct box boxStep;
+		double gainStep = minGain;
+		bool found = false;
+
+		for (unsigned int dir = 0; dir < 4; dir++) {
+			// stop once a step is down to a single pixel
+			size_t delta = SIZE_MAX;
+			for (double amount = maxAmount; delta > 1; amount *= scaleFactor) {
+				struct box boxNew = boxBest;
+				delta = shrinkBox(&boxNew, dir, amount);
+				if (!delta) {
+					break;
+				}
+
+				double gain = avgInSat(sat, boxNew) / utilBest;
+				if (gain >= gainStep) {
+					boxStep = boxNew;
+					gainStep = gain;
+					found = true;
+				}
+			}
 		}
-	}
 
-	free(delta);
+		if (!found) {
+			// no shrink was good enough
+			break;
+		}
+		boxBest = boxStep;
+		utilBest = avgInSat(sat, boxBest);
+	}
+	satDestroy(sat);
 
-	box = boxBest;
+	c->box = boxBest;
 }
 
-static void initialize(struct argsCounting *args)
+static void initialize(struct counting *c, struct pipeline *pipeline, struct argsCounting *args)
 {
-	int fail;
+	c->cam = pipeline->cam;
+	c->pool = ccameraGetFramePool(c->cam);
 
-	buf = malloc(sizeof(*buf) * cBufMax);
-	assert(buf);
-	for (unsigned int ii = 0; ii < cBufMax; ii++) {
-		buf[ii] = malloc(ccameraGetFrameSize());
-		assert(buf[ii]);
-	}
-
-	fail = pthread_create(&thdRead, NULL, &readMain, NULL);
-	assert(!fail);
+	c->done = false;
+	c->live = !ccameraIsReplay(c->cam);
+	c->sub = args->sub;
+	c->msRepLatency = 0;
+	c->msRepLatencyMax = 0;
+	c->cRepLatency = 0;
 
-	// It's important that all this junk is done AFTER starting `thdRead`,
-	// otherwise we'll miss frames
+	// Frames that ccamera publishes meanwhile wait in `sub`, but it only
+	// keeps the last sample_delta + 1; any before those are skipped. So
+	// this, and the backlog in runCounting, must not take long.
 
 	unsigned int iMin, iMax;
 	double *avgs = malloc(sizeof(*avgs) * args->cFrames);
 	assert(avgs);
-	ccameraComputeFrameAverages(args->frames, args->cFrames, avgs);
+	ccameraComputeFrameAverages(c->cam, args->frames, args->cFrames, avgs);
 	findExtremePair(avgs, args->cFrames, &iMin, &iMax);
 	free(avgs);
 
-	initializeBox(args->frames[iMin], args->frames[iMax]);
-
-	growingDistant = iMin < iMax;
-
-	double tmpMin = avgInBox(args->frames[iMin], box);
-	double tmpMax = avgInBox(args->frames[iMax], box);
-	range = tmpMax - tmpMin;
+	initializeBox(c, args->frames[iMin], args->frames[iMax]);
+
+	// The detector's first estimate of the range is the difference between
+	// the two extreme frames' averages over the box
+	size_t width = ccameraGetFrameWidth(c->cam);
+	double tmpMin = avgInBox(args->frames[iMin], width, c->box);
+	double tmpMax = avgInBox(args->frames[iMax], width, c->box);
+	c->detector = repDetectorInit(tmpMax - tmpMin, iMin < iMax);
+	c->msStart = ccameraGetFrameTimeInMs(c->cam, ccameraGetFrameInfo(c->cam, args->frames[0]));
+
+	c->video = NULL;
+	if (pipeline->videoFile) {
+		// A replay has no deadline to meet, so its video might as
+		// well be complete.
+		enum videoPolicy policy = c->live ? VIDEO_DROP : VIDEO_BLOCK;
+		c->video = videoStart(pipeline->videoFile, width, ccameraGetFrameHeight(c->cam),
+			LUMA_MAPPING_DEFAULT, c->pool, policy);
+		assert(c->video);
+	}
 }
 
-static void destroy()
+static void destroy(struct counting *c, struct pipeline *pipeline)
 {
-	assert(done);
+	assert(c->done);
+
+	ccameraUnsubscribe(c->sub);
+	repDetectorDestroy(c->detector);
 
-	struct timespec stop = {time(NULL) + 2, 0}; // todo: tighten this bound
-	assert(!pthread_timedjoin_np(thdRead, NULL, &stop));
+	if (c->cRepLatency) {
+		pipelinePrintf(pipeline, "Reps were counted %.1f ms after the camera handed over their last frame (at most %.1f ms)\n",
+			c->msRepLatency / c->cRepLatency, c->msRepLatencyMax);
+	}
 
-	free(buf);
+	if (c->video) {
+		struct videoStats stats = videoGetStats(c->video);
+		pipelinePrintf(pipeline, "Debug video: %llu frames encoded, %llu dropped, at most %u of %u queued\n",
+			stats.cEncoded, stats.cDropped, stats.cPeakQueued, VIDEO_QUEUE_FRAMES);
+		assert(!videoStop(c->video));
+	}
 }
 
-static void destroyArgs(struct argsCounting *args)
+static void destroyArgs(struct counting *c, struct argsCounting *args)
 {
 	for (unsigned int ii = 0; ii < args->cFrames; ii++) {
-		free(args->frames[ii]);
+		framePoolRelease(c->pool, args->frames[ii]);
 	}
 	free(args->frames);
 }
 
-static bool isRepFromFrame(uint16_t *frame)
+// Records how long it took to count a rep that `frame` completed
+static void addRepLatency(struct counting *c, uint16_t *frame)
 {
-	// Each pushup must have a range of at least thresh*range
-	static const double thresh = 0.6;
-	double avg = avgInBox(frame, box);
-
-	if ((growingDistant && avg < lastExtreme) ||
-		(!growingDistant && avg > lastExtreme)) {
-		// a previous frame was extreme enough to flip growingDistant,
-		// but the rep hasn't actually changed directions yet.
-		lastExtreme = avg;
-		return false;
+	if (!c->live) {
+		// replays don't keep up with the camera, they outrun it
+		return;
 	}
 
-	double delta = lastExtreme - avg;
-
-	bool goodMagnitude = fabs(delta) > range*thresh;
-	bool goodSign = (growingDistant && avg > lastExtreme) ||
-		(!growingDistant && avg < lastExtreme);
+	const struct ccameraFrameInfo *info = ccameraGetFrameInfo(c->cam, frame);
+	double ms = getMonotonicTimeInMs() - info->camera.msAcquired;
+	c->msRepLatency += ms;
+	c->msRepLatencyMax = ms > c->msRepLatencyMax ? ms : c->msRepLatencyMax;
+	c->cRepLatency++;
+}
 
-	if (!goodMagnitude || !goodSign) {
-		// nothing interesting is happening
-		return false;
+// encodes `frame` to the debug video, if there is one
+static void encodeFrame(struct counting *c, uint16_t *frame)
+{
+	if (c->video) {
+		assert(!videoEncodeFrame(c->video, frame));
 	}
+}
 
-	// goodMagnitude && goodSign, therefore we've completed a half-rep and need to flipGrowingDistant
-	lastExtreme = avg;
-	growingDistant = !growingDistant;
+// encodes a frame of a single color to the debug video, if there is one
+static void encodeColor(struct counting *c, float color)
+{
+	if (c->video) {
+		assert(!videoEncodeColor(c->video, color));
+	}
+}
 
-	// only count every other half rep
-	return growingDistant;
+// Feeds `frame` to the rep detector. Returns true if it completes a rep, in
+// which case *msRep is when the rep's top was captured.
+static bool isRepFromFrame(struct counting *c, uint16_t *frame, unsigned long long *msRep)
+{
+	double avg = avgInBox(frame, ccameraGetFrameWidth(c->cam), c->box);
+	unsigned long long ms = ccameraGetFrameTimeInMs(c->cam, ccameraGetFrameInfo(c->cam, frame));
+	return repDetectorPush(c->detector, avg, ms, msRep);
 }
 
-struct state runCounting(void *a, char **err_msg, int *ret)
+struct state runCounting(struct pipeline *pipeline, void *a, char **err_msg, int *ret)
 {
 	(void) err_msg;
 	(void) ret;
 	struct argsCounting *args = a;
-	initialize(args);
+	struct counting c;
+	initialize(&c, pipeline, args);
 
+	struct ccamera *cam = c.cam;
+	size_t width = ccameraGetFrameWidth(cam);
 	unsigned int cRep = 0;
 
-	assert(!videoStart("/tmp/count"));
+	unsigned long long msRep;
 
 	for (unsigned int ii = 0; ii < args->cFrames; ii++) {
 		uint16_t *frame = args->frames[ii];
-		drawBox(frame, 0, box);
-		assert(!videoEncodeFrame(frame));
-		if (isRepFromFrame(frame)) {
-			assert(!videoEncodeColor(1));
+		bool isRep = isRepFromFrame(&c, frame, &msRep);
+		drawBox(frame, width, 0, c.box);
+		encodeFrame(&c, frame);
+		if (isRep) {
+			encodeColor(&c, 1);
 			cRep++;
-			printf("Backlog rep: %d\n", cRep);
+			pipelinePrintf(pipeline, "Backlog rep: %d at %.2f s\n", cRep, (double) (msRep - c.msStart) / 1000);
 		}
 	}
 
 	for (int tmp = 0; tmp < 10; tmp++) {
-		assert(!videoEncodeColor(1));
+		encodeColor(&c, 1);
 	}
 
 
-	unsigned long long tPrior = getTimeInMs();
+	unsigned long long tPrior = ccameraGetTimeInMs(cam);
 
-	while (!done) {
-		assert(!pthread_mutex_lock(&mutBuf));
+	while (!c.done) {
+		uint16_t *frame = readFrame(&c);
+		if (!frame && !c.live) {
+			// end of the replay
+			c.done = true;
+			break;
+		}
 
-		unsigned int iF = 0;
-		while (iF < cBuf) {
-			uint16_t *frame = buf[iF];
-			drawBox(frame, 0, box);
-			assert(!videoEncodeFrame(frame));
-			if (isRepFromFrame(frame)) {
-				assert(!videoEncodeColor(1));
+		if (frame) {
+			bool isRep = isRepFromFrame(&c, frame, &msRep);
+			drawBox(frame, width, 0, c.box);
+			encodeFrame(&c, frame);
+			if (isRep) {
+				addRepLatency(&c, frame);
+				encodeColor(&c, 1);
 				cRep++;
-				printf("New rep: %d\n", cRep);
-				tPrior = getTimeInMs();
+				pipelinePrintf(pipeline, "New rep: %d at %.2f s\n", cRep, (double) (msRep - c.msStart) / 1000);
+				// the idle timer starts from the top of the
+				// rep, not from when it was noticed
+				tPrior = msRep;
 			}
-
-			iF++;
+			framePoolRelease(c.pool, frame);
 		}
-		cBuf = 0;
 
-		if (getTimeInMs() - tPrior > msIdle) {
-			done = true;
+		if (ccameraGetTimeInMs(cam) - tPrior > msIdle) {
+			c.done = true;
 		}
-
-		assert(!pthread_mutex_unlock(&mutBuf));
-
-		usleep(100000); // 100ms
 	}
 
-	assert(!videoStop());
-
-
-	destroy();
-	destroyArgs(args);
+	destroyArgs(&c, args);
+	destroy(&c, pipeline);
 
 	if (!cRep) {
 		return STATE_STARTING;
@@ -464,7 +480,7 @@ struct state runCounting(void *a, char **err_msg, int *ret)
 	struct argsLog *logArgs = malloc(sizeof(struct argsLog));
 	assert(logArgs);
 	logArgs->cRep = cRep;
-	logArgs->sStop = getTimeInMs() / 1000;
+	logArgs->sStop = ccameraGetDateInS(cam);
 
 	struct state next = STATE_LOG;
 	next.args = logArgs;
@@ -3,15 +3,21 @@
 
 #include <stdint.h>
 
+#include "ccamera.h"
 // state defines runCounting for us
 #include "state.h"
 
 struct argsCounting {
-	// Frames to process before getting new ones from ccamera. Each frame in
-	// `frames` as well as `frames` itself is assumed to be `malloc`ed and
-	// will be `free`ed by state_counting.
+	// Frames to process before getting new ones from ccamera. `frames` is
+	// assumed to be `malloc`ed and will be `free`ed by state_counting. Each
+	// frame in it comes from the pipeline's frame pool, and state_counting
+	// takes over the reference to it.
 	uint16_t **frames;
 	unsigned int cFrames;
+
+	// Picks up right after the last of `frames`, so that no frame is missed
+	// between the two states. state_counting takes it over too.
+	struct ccameraSubscription *sub;
 };
 
 #endif
@@ -1,20 +1,57 @@
+#include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 
+#include "pipeline.h"
 #include "state.h"
 #include "state_log.h"
 
-#define LOG_FNAME "/home/i/Code/RepCounter/Data/reps.txt"
+struct repLog {
+	char *fname;
+	// serializes writes from different pipelines
+	pthread_mutex_t mut;
+};
 
-struct state runLog(void *a, char **err, int *ret)
+struct repLog *repLogInit(char *fname)
+{
+	struct repLog *log = malloc(sizeof(*log));
+	assert(log);
+	log->fname = fname;
+	log->mut = (pthread_mutex_t) PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
+	return log;
+}
+
+void repLogDestroy(struct repLog *log)
+{
+	free(log);
+}
+
+void repLogWrite(struct repLog *log, char *source, unsigned long long sStop, unsigned int cRep)
+{
+	assert(!pthread_mutex_lock(&log->mut));
+
+	FILE *fOut = fopen(log->fname, "a");
+	assert(fOut);
+	if (source) {
+		fprintf(fOut, "%llu\t%u\t%s\n", sStop, cRep, source);
+	} else {
+		fprintf(fOut, "%llu\t%u\n", sStop, cRep);
+	}
+	fclose(fOut);
+
+	assert(!pthread_mutex_unlock(&log->mut));
+}
+
+struct state runLog(struct pipeline *pipeline, void *a, char **err, int *ret)
 {
 	struct argsLog *args = a;
 	(void) err;
 	(void) ret;
-	(void) args;
 
-	FILE *fOut = fopen(LOG_FNAME, "a");
-	fprintf(fOut, "%llu\t%u\n", args->sStop, args->cRep);
+	repLogWrite(pipeline->log, pipeline->name, args->sStop, args->cRep);
+	__atomic_fetch_add(&pipeline->cSets, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&pipeline->cReps, args->cRep, __ATOMIC_RELAXED);
 
-	fclose(fOut);
 	return STATE_STARTING;
 }
@@ -6,6 +6,8 @@
 // state defines runLog for us
 #include "state.h"
 
+#define LOG_FNAME "/home/i/Code/RepCounter/Data/reps.txt"
+
 struct argsLog {
 	unsigned int cRep;
 
@@ -14,4 +16,15 @@ struct argsLog {
 	unsigned long long sStop;
 };
 
+// The file that finished sets are appended to. Any number of pipelines may
+// share one.
+struct repLog;
+
+struct repLog *repLogInit(char *fname);
+void repLogDestroy(struct repLog *log);
+
+// Appends one set to the log. If `source` isn't NULL it is written as an extra
+// column, so that sets from different recordings can be told apart.
+void repLogWrite(struct repLog *log, char *source, unsigned long long sStop, unsigned int cRep);
+
 #endif
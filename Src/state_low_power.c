@@ -1,72 +1,67 @@
 #include <assert.h>
-#include <limits.h>
-#include <math.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
-#include <unistd.h>
 
 #include "video.h"
 #include "camera.h"
 #include "ccamera.h"
-#include "helper.h"
+#include "pipeline.h"
 #include "state.h"
 
-struct state runLowPower (void *args, char **err_msg, int *ret)
+// The camera's rate while waiting for activity. Full rate comes back as soon as
+// STARTING begins.
+#define LOW_POWER_FPS 6
+
+// how long to wait for a frame before checking again
+static const unsigned int msWaitFrame = 1000;
+
+struct state runLowPower (struct pipeline *pipeline, void *args, char **err_msg, int *ret)
 {
+	struct ccamera *cam = pipeline->cam;
 	(void) args;
 	(void) err_msg;
 	(void) ret;
 
-	size_t numPixels = ccameraGetNumPixels();
+	// Only a large fraction of the frame moving counts, so ccamera's count
+	// of active pixels in its smallest level is plenty.
+	size_t numPixels = ccameraGetLevelNumPixels(cam, CCAMERA_LEVELS - 1);
 	struct state stateNext = STATE_STARTING;
-	uint16_t *data_new = NULL;
-	uint16_t *data_old = NULL;
-	uint16_t *data_scratch = NULL;
-	data_new = malloc(ccameraGetFrameSize());
-	data_old = malloc(ccameraGetFrameSize());
-	data_scratch = malloc(ccameraGetFrameSize());
-	assert(data_new && data_old && data_scratch);
 
-	unsigned long long tStart = getTimeInMs();
+	unsigned long long tStart = ccameraGetTimeInMs(cam);
+	ccameraSetFps(cam, LOW_POWER_FPS);
+	struct ccameraSubscription *sub = ccameraSubscribe(cam);
+	bool endOfStream = false;
 
 	float cActive = 0;
 	float cThreshold = 0.1f * (float) numPixels; // randomly chosen, but it works
 	while (cActive < cThreshold) {
-		ccameraGetFrames(data_new, data_old);
-		unsigned long long tLast = getTimeInMs();
-
-		float nActivePixels = 0;
-		for (size_t iPixel = 0; iPixel<numPixels; iPixel++) {
-			float activeness = fabsf((float) data_new[iPixel] - (float) data_old[iPixel]);
-			if (activeness > 40) {
-				nActivePixels++;
-			}
+		// sleeps until ccamera publishes something new
+		const struct ccameraFrame *fNew = ccameraWaitFrame(sub, msWaitFrame);
+		if (!fNew && ccameraIsReplay(cam)) {
+			endOfStream = true;
+			break;
 		}
+		if (!fNew) {
+			continue;
+		}
+
+		float nActivePixels = (float) fNew->cActive;
+		ccameraRelease(fNew);
 
 #define CURWEIGHT 0.15f
 		cActive = CURWEIGHT*nActivePixels + (1-CURWEIGHT)*cActive;
-
-		assert(tLast < LLONG_MAX);
-		unsigned long long tNext = tLast + 1000/CAMERA_FPS;
-		assert(tNext < LLONG_MAX);
-		long long tSleep = (long long) tNext - (long long) tLast;
-		tSleep = tSleep > 0 ? tSleep : 0;
-		assert(tSleep < UINT_MAX / 1000);
-		usleep((unsigned int) tSleep * 1000);
 	}
 
-	unsigned long long delta = getTimeInMs() - tStart;
-	printf("Activated after %f s\n", (double) delta / 1000.0);
-
-	if (data_new) {
-		free(data_new);
-	}
-	if (data_scratch) {
-		free(data_scratch);
-	}
-	if (data_old) {
-		free(data_old);
+	ccameraUnsubscribe(sub);
+	ccameraSetFps(cam, CAMERA_FPS);
+	if (endOfStream) {
+		// the recording we're replaying is over
+		return STATE_EXIT;
 	}
 
+	unsigned long long delta = ccameraGetTimeInMs(cam) - tStart;
+	pipelinePrintf(pipeline, "Activated after %f s\n", (double) delta / 1000.0);
+
 	return stateNext;
 }
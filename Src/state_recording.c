@@ -1,8 +1,7 @@
 #include <assert.h>
-#include <unistd.h>
 
 #include "ccamera.h"
-#include "helper.h"
+#include "pipeline.h"
 #include "state.h"
 #include "video.h"
 
@@ -13,31 +12,46 @@
 // NULL to not record
 #define FVIDEO NULL
 
-struct state runRecording(void *args, char **err_msg, int *retStatus)
+struct state runRecording(struct pipeline *pipeline, void *args, char **err_msg, int *retStatus)
 {
 	(void) args;
 	(void) err_msg;
 	(void) retStatus;
 
-	unsigned long long tStart = getTimeInMs();
-	uint16_t *frame = NULL;
+	struct ccamera *cam = pipeline->cam;
+	struct framePool *pool = ccameraGetFramePool(cam);
+	unsigned long long tStart = ccameraGetTimeInMs(cam);
+	struct video *video = NULL;
 	if (FVIDEO) {
-		assert(!videoStart(FVIDEO));
-		frame = malloc(ccameraGetFrameSize());
-		assert(frame);
+		// the whole point is the video, so never drop frames
+		video = videoStart(FVIDEO, ccameraGetFrameWidth(cam), ccameraGetFrameHeight(cam),
+			LUMA_MAPPING_DEFAULT, pool, VIDEO_BLOCK);
+		assert(video);
 	}
 
-	while (getTimeInMs() - tStart < DURATION) {
-		if (FVIDEO) {
-			ccameraGetFrame(frame);
-			assert(!videoEncodeFrame(frame));
+	struct ccameraSubscription *sub = ccameraSubscribe(cam);
+	while (ccameraGetTimeInMs(cam) - tStart < DURATION) {
+		// the camera records everything by itself; this just waits for
+		// each frame so that the video gets them all
+		const struct ccameraFrame *view = ccameraWaitFrame(sub, 1000);
+		if (!view) {
+			continue;
 		}
 
-		usleep(100000); // 100ms
+		if (FVIDEO) {
+			// the video holds on to the frame until it's encoded, so
+			// each one needs a frame of its own
+			uint16_t *frame = ccameraCopyToPool(cam, view);
+			assert(frame);
+			assert(!videoEncodeFrame(video, frame));
+			framePoolRelease(pool, frame);
+		}
+		ccameraRelease(view);
 	}
+	ccameraUnsubscribe(sub);
 
 	if (FVIDEO) {
-		assert(!videoStop());
+		assert(!videoStop(video));
 	}
 
 	return STATE_EXIT;
@@ -7,320 +7,400 @@
 
 #include "camera.h"
 #include "ccamera.h"
-#include "helper.h"
+#include "pipeline.h"
+#include "spsc.h"
 #include "state.h"
 #include "state_counting.h"
 #include "video.h"
 
 
-// this whole chunk of variables belongs to `mutFrames`
-
-// `frames` stores the frames that are actually being processed. High indicies
-// are older. Low indicies are the most recent data.
-static uint16_t **frames;
 static const unsigned int cFrames = CAMERA_FPS * 5; // # of frames in `frames`.
-static pthread_mutex_t mutFrames = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
 // how far away from the average must you go before it counts as a up or a down.
 static const double minDeviation = 8; // todo: unduplicate with state_counting#findNext#thresh
+// How far the average may move before every frame is sorted into up, down or
+// neither again. Until then, only frames within this of minDeviation can be
+// sorted differently than against the exact average.
+static const double averageTolerance = 1;
 // how many reps have to be detected to be considered activated
 static const unsigned int repThreshold = 2;
 
-#define US_DELAY_MOVE 1000000
-
-// Stores the new frames that have not yet been considered. It is initially
-// empty, but a separate thread adds new frames to it as they become
-// available. Approximately once ever `US_DELAY_MOVE` uSeconds a different
-// thread flushes them to `frames`.
-static uint16_t **fNew;
-// how many frames are in fNew right now
-static unsigned int cFNew = 0;
+// the most frames that can be waiting in `fNew` at once
 static const unsigned int cFNewMax = CAMERA_FPS * 2;
-// a single scratch buffer (of size `cFNewMax`) for storing pointers to
-// frames. i.e. it is not an array of many scratch frames. May only be used by
-// whoever has the `mutFNew` mutex locked.
-static uint16_t **fNewScratch;
-static pthread_mutex_t mutFNew = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
-
-
-
-static pthread_t thdRead; // reads individual frames into `fNew`
-static pthread_t thdMove; // Moves data from `fNew` to `frames`
 
-static volatile bool done;
+// how long startingMain waits for a frame before checking whether it has been
+// idle for too long
+static const unsigned int msWaitFrame = 1000;
+
+// Everything that one run of the starting state works with
+struct starting {
+	struct ccamera *cam;
+	struct framePool *pool;
+
+	// The frames that are actually being processed, and the average value
+	// of each one. This is a ring buffer: once it is full, frames[iOldest]
+	// is the oldest frame and the newest is just before it. Only
+	// startingMain touches these.
+	uint16_t **frames;
+	double *avgs;
+	unsigned int cFramesUsed;
+	unsigned int iOldest;
+
+	// The sum of the first cFramesUsed entries of `avgs`
+	double sumAvgs;
+
+	// Whether each frame is an up (1), a down (-1) or neither (0), judged
+	// against averageSides rather than the current average, which moves
+	// with every frame. Indexed like `avgs`. Only valid once `frames` is
+	// full and `sidesValid` is set. cSided is how many frames are ups or
+	// downs, and cFlips how many times those change from one to the next,
+	// oldest first. sideNewest is the newest frame's up or down, or 0 if
+	// there are none.
+	signed char *sides;
+	bool sidesValid;
+	double averageSides;
+	unsigned int cSided;
+	unsigned int cFlips;
+	signed char sideNewest;
+
+	// New frames that have not yet been considered. readMain pushes frames
+	// as it reads them, and startingMain pops them. Each holds a reference
+	// to a frame from `pool`.
+	struct spscQueue *fNew;
+
+	pthread_t thdRead; // reads individual frames into `fNew`
+	// every frame that ccamera publishes; used by thdRead, or in replay
+	// mode, by startingMain
+	struct ccameraSubscription *sub;
+
+	// false in replay mode, where startingMain reads frames itself
+	bool threaded;
+
+	volatile bool done;
+};
 
 // number of ms that the user has to be idle for before termination
 static const unsigned long long msIdle = 30*1000;
 
-
-static void* readMain(void *none)
+// Copies the next frame that ccamera publishes, and its info, into a frame
+// from the pool. Returns NULL if there isn't one within msWaitFrame, or in
+// replay mode, at the end of the stream.
+static uint16_t *readFrame(struct starting *s)
 {
-	(void) none;
+	const struct ccameraFrame *view = ccameraWaitFrame(s->sub, msWaitFrame);
+	if (!view) {
+		return NULL;
+	}
 
-	while (!done) {
-		usleep(1000000 / CAMERA_FPS);
+	uint16_t *frame = ccameraCopyToPool(s->cam, view);
+	assert(frame);
+	ccameraRelease(view);
+	return frame;
+}
 
-		// todo: instead of this convoluted mess of having a second done
-		// check, simply aquire the lock before doing the `done` check
-		// (and release it during sleeps)
-		assert(!pthread_mutex_lock(&mutFNew));
-		if (done) {
-			goto CONTINUE;
-		}
+static void* readMain(void *arg)
+{
+	struct starting *s = arg;
 
-		assert(cFNew < cFNewMax);
-		ccameraGetFrame(fNew[cFNew]);
-		cFNew++;
+	while (!s->done) {
+		uint16_t *frame = readFrame(s);
+		if (!frame) {
+			continue;
+		}
 
-	CONTINUE:
-		assert(!pthread_mutex_unlock(&mutFNew));
+		if (!spscPush(s->fNew, frame)) {
+			// startingMain has fallen cFNewMax frames behind, so
+			// this one is lost
+			framePoolRelease(s->pool, frame);
+		}
 	}
 
 	return NULL;
 }
 
-static void* moveMain(void* none)
+// Returns the next frame for startingMain to consider. Returns NULL if there
+// isn't one yet, or in replay mode, at the end of the stream.
+static uint16_t *nextFrame(struct starting *s)
 {
-	(void) none;
-
-	// todo: malloc/free fNewScratch here, not globally
-	while (!done) {
-		usleep(US_DELAY_MOVE);
-
-		// we're deliberately locking mutFrame before mutFNew because of
-		// the combined reasons:
-		//
-		// A: mutFNew is much more sensitive to being locked for
-		//    extended periods of time than mutFrame is
-		//
-		// B: locking mutFrame might take a while
-		//
-		// Also note that we can't delay the locking of mutFNew because
-		// we're using cFNew.
-		assert(!pthread_mutex_lock(&mutFrames));
-		assert(!pthread_mutex_lock(&mutFNew));
-		if (done) {
-			goto CONTINUE;
-		}
+	if (!s->threaded) {
+		return readFrame(s);
+	}
+	return spscPopWait(s->fNew, msWaitFrame);
+}
+
+// Whether the average `avg` makes its frame an up (1), a down (-1) or neither
+// (0), relative to `average`
+static signed char getSide(double avg, double average)
+{
+	double dev = avg - average;
+	return (signed char) ((dev > minDeviation) - (dev < -minDeviation));
+}
 
-		// "delete" the `cFNew` oldest frames from `frames`
-		for (unsigned int ii = 0; ii < cFNew; ii++) {
-			fNewScratch[ii] = frames[ii];
+// Sorts every frame into up, down or neither against `average`, and recounts
+// the flips between them
+static void resetSides(struct starting *s, double average)
+{
+	s->sidesValid = true;
+	s->averageSides = average;
+	s->cSided = 0;
+	s->cFlips = 0;
+	s->sideNewest = 0;
+	for (unsigned int ii = 0; ii < cFrames; ii++) {
+		unsigned int iFrame = (s->iOldest + ii) % cFrames;
+		signed char side = getSide(s->avgs[iFrame], average);
+		s->sides[iFrame] = side;
+		if (side) {
+			s->cFlips += s->sideNewest && side != s->sideNewest;
+			s->sideNewest = side;
+			s->cSided++;
 		}
+	}
+}
 
-		// shift frames to account for the "deletetion" of `cFNew` frames
-		for (unsigned int iWrite = 0; iWrite+cFNew < cFrames; iWrite++) {
-			frames[iWrite] = frames[iWrite+cFNew];
+// Takes the oldest frame's side out of the counts, just before it is dropped
+static void dropSide(struct starting *s)
+{
+	signed char side = s->sides[s->iOldest];
+	if (!side) {
+		return;
+	}
+	s->cSided--;
+
+	// it flipped to the next up or down after it, if there is one
+	for (unsigned int ii = 1; ii < cFrames; ii++) {
+		signed char next = s->sides[(s->iOldest + ii) % cFrames];
+		if (next) {
+			s->cFlips -= next != side;
+			return;
 		}
-		// frames[cFrames - cFNew] is the first frame of garbage
+	}
+	s->sideNewest = 0;
+}
 
-		// copy `cFNew` frames from `fNew` to `frames`
-		// `offset` is the first free spot in `frames`
-		unsigned int offset = cFrames - cFNew;
-		for (unsigned int iRead = 0; iRead < cFNew; iRead++) {
-			// append a valid frame pointer to `frames`
-			frames[offset + iRead] = fNewScratch[iRead];
+// Adds the newest frame, at iFrame, to the counts
+static void addSide(struct starting *s, unsigned int iFrame)
+{
+	signed char side = getSide(s->avgs[iFrame], s->averageSides);
+	s->sides[iFrame] = side;
+	if (side) {
+		s->cFlips += s->sideNewest && side != s->sideNewest;
+		s->sideNewest = side;
+		s->cSided++;
+	}
+}
 
-			// copy the data
-			memcpy(frames[offset + iRead], fNew[iRead], ccameraGetFrameSize());
+// Appends `frame` to `frames`, dropping the oldest frame if `frames` is full
+static void addFrame(struct starting *s, uint16_t *frame)
+{
+	unsigned int iFrame;
+	if (s->cFramesUsed < cFrames) {
+		iFrame = s->cFramesUsed++;
+	} else {
+		if (s->sidesValid) {
+			dropSide(s);
 		}
+		iFrame = s->iOldest;
+		s->iOldest = (s->iOldest + 1) % cFrames;
+		framePoolRelease(s->pool, s->frames[iFrame]);
+		s->sumAvgs -= s->avgs[iFrame];
+	}
 
-		// clear the contents of fNew
-		cFNew = 0;
-
-	CONTINUE:
-		assert(!pthread_mutex_unlock(&mutFNew));
-		assert(!pthread_mutex_unlock(&mutFrames));
+	s->frames[iFrame] = frame;
+	ccameraComputeFrameAverages(s->cam, &frame, 1, &s->avgs[iFrame]);
+	s->sumAvgs += s->avgs[iFrame];
+	if (s->sidesValid) {
+		addSide(s, iFrame);
 	}
 
-	return NULL;
+	if (s->iOldest == 0 && s->cFramesUsed == cFrames) {
+		// Once per trip around the ring, re-add everything so that
+		// rounding errors from the subtractions can't build up.
+		s->sumAvgs = 0;
+		for (unsigned int ii = 0; ii < cFrames; ii++) {
+			s->sumAvgs += s->avgs[ii];
+		}
+	}
 }
 
-static void initialize()
+static void initialize(struct starting *s, struct pipeline *pipeline)
 {
 	int fail;
 
-	frames = malloc(sizeof(*frames) * cFrames);
-	assert(frames);
-	for (size_t i = 0; i < cFrames; i++) {
-		frames[i] = malloc(ccameraGetFrameSize());
-		assert(frames[i]);
-		ccameraGetFrame(frames[i]);
-		usleep(1000000 / CAMERA_FPS);
+	s->cam = pipeline->cam;
+	s->pool = ccameraGetFramePool(s->cam);
+
+	s->frames = malloc(sizeof(*s->frames) * cFrames);
+	assert(s->frames);
+	s->avgs = malloc(sizeof(*s->avgs) * cFrames);
+	assert(s->avgs);
+	s->sides = malloc(sizeof(*s->sides) * cFrames);
+	assert(s->sides);
+	s->sidesValid = false;
+	s->cFramesUsed = 0;
+	s->iOldest = 0;
+	s->sumAvgs = 0;
+
+	s->fNew = spscInit(cFNewMax);
+
+	s->done = false;
+	s->threaded = !ccameraIsReplay(s->cam);
+	s->sub = ccameraSubscribe(s->cam);
+
+	if (s->threaded) {
+		fail = pthread_create(&s->thdRead, NULL, &readMain, s);
+		assert(!fail);
 	}
+}
 
-	fNewScratch = malloc(sizeof(*fNew) * cFNewMax);
-	assert(fNewScratch);
-	fNew = malloc(sizeof(*fNew) * cFNewMax);
-	assert(fNew);
-	for (size_t i = 0; i < cFNewMax; i++) {
-		fNew[i] = malloc(ccameraGetFrameSize());
-		assert(fNew[i]);
-	}
-	cFNew = 0;
+// Stops readMain. Frames that it read but that startingMain never got to are
+// left in `fNew`.
+static void stopReading(struct starting *s)
+{
+	s->done = true;
 
-	done = false;
+	if (s->threaded) {
+		struct timespec stop = {time(NULL) + 2, 0}; // todo: tighten this bound
+		assert(!pthread_timedjoin_np(s->thdRead, NULL, &stop));
+	}
+}
 
-	fail = pthread_create(&thdRead, NULL, &readMain, NULL);
-	assert(!fail);
+static void destroy(struct starting *s)
+{
+	assert(s->done);
 
-	fail = pthread_create(&thdMove, NULL, &moveMain, NULL);
-	assert(!fail);
+	for (unsigned int ii = 0; ii < s->cFramesUsed; ii++) {
+		framePoolRelease(s->pool, s->frames[ii]);
+	}
+	free(s->frames);
+	free(s->avgs);
+	free(s->sides);
 
+	uint16_t *frame;
+	while ((frame = spscPop(s->fNew))) {
+		framePoolRelease(s->pool, frame);
+	}
+	spscDestroy(s->fNew);
+	if (s->sub) {
+		ccameraUnsubscribe(s->sub);
+	}
 }
 
-static void destroy()
+// Hands every frame over to the counting state, oldest first, along with the
+// subscription that they came from
+static struct argsCounting *takeFrames(struct starting *s)
 {
-	// setting of `done` is now done in startingMain
-	//done = true;
-
-	struct timespec stop = {time(NULL) + 2, 0}; // todo: tighten this bound
-	assert(!pthread_timedjoin_np(thdRead, NULL, &stop));
-	assert(!pthread_timedjoin_np(thdMove, NULL, &stop));
-
-	for (size_t i = 0; i < cFrames; i++) {
-		if (frames[i] != NULL) {
-			free(frames[i]);
-		}
+	struct argsCounting *args = malloc(sizeof(struct argsCounting));
+	assert(args);
+	args->frames = malloc(sizeof(*args->frames) * (cFrames + cFNewMax));
+	assert(args->frames);
+	args->cFrames = 0;
+
+	for (unsigned int ii = 0; ii < s->cFramesUsed; ii++) {
+		unsigned int iFrame = (s->iOldest + ii) % cFrames;
+		args->frames[args->cFrames++] = s->frames[iFrame];
 	}
-	free(frames);
+	s->cFramesUsed = 0;
+	s->sumAvgs = 0;
+	s->sidesValid = false;
 
-	for (size_t i = 0; i < cFNewMax; i++) {
-		if (fNew[i] != NULL) {
-			free(fNew[i]);
-		}
+	uint16_t *frame;
+	while ((frame = spscPop(s->fNew))) {
+		args->frames[args->cFrames++] = frame;
 	}
-	free(fNew);
 
-	free(fNewScratch);
+	args->sub = s->sub;
+	s->sub = NULL;
+
+	return args;
 }
 
-static struct state startingMain()
+static struct state startingMain(struct starting *s)
 {
+	struct ccamera *cam = s->cam;
+
 	bool success = false;
 	bool failure = false;
+	bool endOfStream = false;
 
-	double *dScratch = malloc(sizeof(double) * cFrames);
-	assert(dScratch);
-
-	unsigned long long tStart = getTimeInMs();
+	unsigned long long tStart = ccameraGetTimeInMs(cam);
 
-	assert(!pthread_mutex_lock(&mutFrames));
 	while (!success && !failure) {
-		// for each frame, compute the difference between its average
-		// and the average of averages
-		ccameraComputeFrameAverages(frames, cFrames, dScratch);
-		double tmpTotal = 0;
-		for (unsigned int ii = 0; ii < cFrames; ii++) {
-			tmpTotal += dScratch[ii];
+		// Wait for a new frame
+		uint16_t *frame = nextFrame(s);
+		if (!frame && !s->threaded) {
+			endOfStream = true;
+			break;
+		}
+		if (!frame) {
+			goto SLEEP;
 		}
-		double average = tmpTotal / cFrames;
 
-		for (unsigned int ii = 0; ii < cFrames; ii++) {
-			dScratch[ii] -= average;
+		addFrame(s, frame);
+		unsigned long long tFrame = ccameraGetFrameTimeInMs(cam, ccameraGetFrameInfo(cam, frame));
+		if (s->cFramesUsed < cFrames) {
+			// the idle timer starts once `frames` is full
+			tStart = tFrame;
+			continue;
 		}
 
-		// Find the first frame that differs from the average by at
-		// least minDeviation
-		unsigned int ii = 0;
-		while (ii < cFrames && fabs(dScratch[ii]) < minDeviation) {
-			ii++;
+		// Which frames count as up or down depends on the average of
+		// averages, which moves with every new frame. addFrame keeps
+		// the flips between them counted against a recent average, and
+		// only when that drifts too far are all cFrames frames sorted
+		// again.
+		double average = s->sumAvgs / cFrames;
+		if (!s->sidesValid || fabs(average - s->averageSides) > averageTolerance) {
+			resetSides(s, average);
 		}
-		if (ii == cFrames) {
+		if (!s->cSided) {
 			goto SLEEP;
 		}
-		tStart = getTimeInMs();
-
-		// Within this time sequence, find out how many times we went
-		// from being more than minDeviation above to being more than
-		// minDeviation below.
-		bool far = dScratch[ii] > 0;
-		unsigned int flipCount = 0;
-		while (ii < cFrames) {
-			if ((far && dScratch[ii] < -minDeviation) ||
-				(!far && dScratch[ii] > minDeviation)) {
-				flipCount++;
-				far = !far;
-			}
-			ii++;
-		}
+		tStart = tFrame;
+
+		// Within this time sequence, how many times we went from being
+		// more than minDeviation above to being more than minDeviation
+		// below
+		unsigned int flipCount = s->cFlips;
 
 		if (flipCount / 2 > repThreshold) {
 			success = true;
 		}
 
 	SLEEP:
-		if (!success && getTimeInMs() - tStart > msIdle) {
+		if (!success && ccameraGetTimeInMs(cam) - tStart > msIdle) {
 			// `!success` check is implied by time check?
 			failure = true;
 		}
-
-		// Wait for a new batch of frames
-		//
-		// todo: instead of a redundant check, why don't we just put
-		// this at the top of the loop?
-		if (!success && !failure) {
-			uint16_t *tmp = frames[0];
-			while(frames[0] == tmp) {
-				assert(!pthread_mutex_unlock(&mutFrames));
-				usleep(US_DELAY_MOVE / 10);
-				assert(!pthread_mutex_lock(&mutFrames));
-			}
-		}
 	}
 
-	// request stop early to give other threads as much time as possible to
-	// notice
-	done = true;
-
-	free(dScratch);
+	// stop readMain first, so that every frame it read ends up in either
+	// `frames` or `fNew`
+	stopReading(s);
 
 	struct state next;
 	if (success) {
-		assert(!pthread_mutex_lock(&mutFNew));
-
-		struct argsCounting *args = malloc(sizeof(struct argsCounting));
-		args->cFrames = cFrames + cFNew;
-		args->frames = malloc(sizeof(*args->frames) * args->cFrames);
-
-		unsigned int iBase = 0;
-		for (unsigned int ii = 0; ii < cFrames; ii++) {
-			args->frames[iBase + ii] = frames[ii];
-			frames[ii] = NULL;
-		}
-		iBase += cFrames;
-		for (unsigned int ii = 0; ii < cFNew; ii++) {
-			args->frames[iBase + ii] = fNew[ii];
-			fNew[ii] = NULL;
-		}
-		cFNew = 0;
-
-
 		next = STATE_COUNTING;
-		next.args = args;
+		next.args = takeFrames(s);
 		next.shouldFreeArgs = true;
-
-		assert(!pthread_mutex_unlock(&mutFNew));
+	} else if (endOfStream) {
+		next = STATE_EXIT;
 	} else {
 		assert(failure);
 		next = STATE_LOW_POWER;
 	}
 
-	assert(!pthread_mutex_unlock(&mutFrames));
-
 	return next;
 }
 
-struct state runStarting(void *args, char **err_msg, int *retStatus)
+struct state runStarting(struct pipeline *pipeline, void *args, char **err_msg, int *retStatus)
 {
 	(void) args;
 	(void) err_msg;
 	(void) retStatus;
 
-	initialize();
-
-	struct state retState = startingMain();
-
-	destroy();
+	struct starting s;
+	initialize(&s, pipeline);
+	struct state retState = startingMain(&s);
+	destroy(&s);
 
 	return retState;
 }
@@ -0,0 +1,234 @@
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "camera.h"
+#include "ccamera.h"
+#include "pipeline.h"
+#include "state.h"
+#include "state_log.h"
+#include "stations.h"
+
+// the counting state's debug video, per station
+#define FVIDEO_COUNTING "/tmp/count"
+
+struct station {
+	struct stations *stations;
+	char *serial;
+	char *file;
+	char *logFile;
+	char *videoFile;
+	struct repLog *log;
+	unsigned int iCpu;
+	pthread_t thread;
+
+	// NULL until the pipeline has started, and again once it is being
+	// destroyed. Belongs to stations->mut, as does everything below.
+	struct pipeline *pipeline;
+	bool done;
+	bool success;
+
+	// the totals as of the last report
+	unsigned long long cFramesReported;
+	unsigned long long cDroppedReported;
+	double msLatencyReported;
+};
+
+struct stations {
+	struct args args;
+
+	struct station *stations;
+	unsigned int cStations;
+
+	// broadcast whenever a station finishes
+	pthread_mutex_t mut;
+	pthread_cond_t condDone;
+};
+
+// Returns a malloc'ed copy of a, separator and b, one after the other
+static char *join(const char *a, const char *separator, const char *b)
+{
+	size_t len = strlen(a) + strlen(separator) + strlen(b) + 1;
+	char *out = malloc(len);
+	assert(out);
+	snprintf(out, len, "%s%s%s", a, separator, b);
+	return out;
+}
+
+static void *stationMain(void *arg)
+{
+	struct station *station = arg;
+	struct stations *stations = station->stations;
+
+	// every thread that the pipeline starts inherits this
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(station->iCpu, &cpus);
+	assert(!pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus));
+
+	struct args args = stations->args;
+	args.file = station->file;
+	args.device = station->serial;
+
+	struct pipeline *pipeline = pipelineInit(args, station->log, station->serial, station->videoFile);
+	bool success = false;
+	if (!pipeline) {
+		printf("%s: could not be started\n", station->serial);
+	} else {
+		assert(!pthread_mutex_lock(&stations->mut));
+		station->pipeline = pipeline;
+		assert(!pthread_mutex_unlock(&stations->mut));
+
+		success = stateRun(pipeline) == 0;
+
+		assert(!pthread_mutex_lock(&stations->mut));
+		station->pipeline = NULL;
+		assert(!pthread_mutex_unlock(&stations->mut));
+		assert(!pipelineDestroy(pipeline));
+	}
+
+	assert(!pthread_mutex_lock(&stations->mut));
+	station->done = true;
+	station->success = success;
+	assert(!pthread_cond_broadcast(&stations->condDone));
+	assert(!pthread_mutex_unlock(&stations->mut));
+	return NULL;
+}
+
+// Prints what each running station has done since the last report, and the
+// totals across all of them. Needs stations->mut.
+static void report(struct stations *stations, double sElapsed)
+{
+	double fpsTotal = 0;
+	unsigned long long cDroppedTotal = 0;
+	unsigned int cSets = 0;
+	unsigned int cReps = 0;
+	unsigned int cRunning = 0;
+
+	for (unsigned int ii = 0; ii < stations->cStations; ii++) {
+		struct station *station = &stations->stations[ii];
+		struct pipeline *pipeline = station->pipeline;
+		if (!pipeline) {
+			continue;
+		}
+
+		struct ccameraStats stats = ccameraGetStats(pipeline->cam);
+		unsigned long long cFrames = stats.cFrames - station->cFramesReported;
+		double fps = (double) cFrames / sElapsed;
+		unsigned long long cDropped = stats.cDropped - station->cDroppedReported;
+		double msLatency = cFrames ? (stats.msLatencyTotal - station->msLatencyReported) / (double) cFrames : 0;
+		station->cFramesReported = stats.cFrames;
+		station->cDroppedReported = stats.cDropped;
+		station->msLatencyReported = stats.msLatencyTotal;
+
+		unsigned int cStationSets = __atomic_load_n(&pipeline->cSets, __ATOMIC_RELAXED);
+		unsigned int cStationReps = __atomic_load_n(&pipeline->cReps, __ATOMIC_RELAXED);
+		pipelinePrintf(pipeline, "%.1f fps, %llu frames dropped, %.1f ms to denoise, %u reps in %u sets\n",
+			fps, cDropped, msLatency, cStationReps, cStationSets);
+
+		fpsTotal += fps;
+		cDroppedTotal += cDropped;
+		cSets += cStationSets;
+		cReps += cStationReps;
+		cRunning++;
+	}
+
+	printf("Stations: %u of %u running at %.1f fps in total, %llu frames dropped, %u reps in %u sets\n",
+		cRunning, stations->cStations, fpsTotal, cDroppedTotal, cReps, cSets);
+}
+
+int stationsRun(struct args args)
+{
+	char **serials;
+	unsigned int cSerials = cameraListDevices(&serials);
+	if (!cSerials) {
+		puts("There are no attached devices");
+		return EXIT_FAILURE;
+	}
+
+	long cCpus = sysconf(_SC_NPROCESSORS_ONLN);
+	cCpus = cCpus > 0 ? cCpus : 1;
+
+	struct stations stations;
+	stations.args = args;
+	stations.cStations = cSerials;
+	stations.stations = calloc(cSerials, sizeof(*stations.stations));
+	assert(stations.stations);
+	stations.mut = (pthread_mutex_t) PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
+	stations.condDone = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
+
+	printf("Running %u stations on %ld cores\n", cSerials, cCpus);
+	for (unsigned int ii = 0; ii < cSerials; ii++) {
+		struct station *station = &stations.stations[ii];
+		station->stations = &stations;
+		station->serial = serials[ii];
+		char *name = join(serials[ii], "", ".bag");
+		station->file = join(args.file, "/", name);
+		free(name);
+		station->logFile = join(args.log_file, ".", serials[ii]);
+		station->videoFile = join(FVIDEO_COUNTING, ".", serials[ii]);
+		station->log = repLogInit(station->logFile);
+		station->iCpu = (unsigned int) (ii % (unsigned long) cCpus);
+		station->pipeline = NULL;
+		station->done = false;
+		station->success = false;
+
+		printf("%s: recording to %s, logging to %s\n", station->serial, station->file, station->logFile);
+		int fail = pthread_create(&station->thread, NULL, &stationMain, station);
+		assert(!fail);
+	}
+
+	struct timespec tLast;
+	assert(!clock_gettime(CLOCK_MONOTONIC, &tLast));
+	struct timespec stop;
+	assert(!clock_gettime(CLOCK_REALTIME, &stop));
+	stop.tv_sec += STATIONS_REPORT_S;
+
+	assert(!pthread_mutex_lock(&stations.mut));
+	while (true) {
+		unsigned int cDone = 0;
+		for (unsigned int ii = 0; ii < stations.cStations; ii++) {
+			cDone += stations.stations[ii].done;
+		}
+		if (cDone == stations.cStations) {
+			break;
+		}
+
+		int fail = pthread_cond_timedwait(&stations.condDone, &stations.mut, &stop);
+		if (fail == ETIMEDOUT) {
+			struct timespec now;
+			assert(!clock_gettime(CLOCK_MONOTONIC, &now));
+			double sElapsed = (double) (now.tv_sec - tLast.tv_sec) + (double) (now.tv_nsec - tLast.tv_nsec) / 1e9;
+			report(&stations, sElapsed);
+			tLast = now;
+			stop.tv_sec += STATIONS_REPORT_S;
+			continue;
+		}
+		assert(!fail);
+	}
+	assert(!pthread_mutex_unlock(&stations.mut));
+
+	unsigned int cFailed = 0;
+	for (unsigned int ii = 0; ii < stations.cStations; ii++) {
+		struct station *station = &stations.stations[ii];
+		assert(!pthread_join(station->thread, NULL));
+		cFailed += !station->success;
+
+		repLogDestroy(station->log);
+		free(station->file);
+		free(station->logFile);
+		free(station->videoFile);
+		free(station->serial);
+	}
+	printf("Stations: %u of %u stopped with errors\n", cFailed, stations.cStations);
+
+	free(stations.stations);
+	free(serials);
+	return cFailed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,19 @@
+#ifndef STATIONS_H
+#define STATIONS_H
+
+// Station mode runs the rep counter for every attached device at once, each in
+// a pipeline of its own, so that one process can serve a whole gym. Every
+// station records its device to <args.file>/<serial>.bag, logs its sets to
+// <args.log_file>.<serial>, and runs on a core of its own, or shares them
+// round robin when there are more stations than cores.
+
+#include "args.h"
+
+// how often the throughput of the stations is printed
+#define STATIONS_REPORT_S 60
+
+// Returns once every station has stopped, which only happens if they fail.
+// Returns EXIT_SUCCESS if every station stopped cleanly.
+int stationsRun(struct args args);
+
+#endif
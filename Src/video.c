@@ -31,6 +31,8 @@
  */
 
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,29 +42,68 @@
 #include <libavutil/opt.h>
 #include <libavutil/imgutils.h>
 
+#include "luma.h"
 #include "video.h"
-#include "ccamera.h"
 
-AVCodecContext *ctx = NULL;
-AVPacket *pkt;
-FILE *outfile;
-AVCodec *codec;
-uint8_t endcode[] = { 0, 0, 1, 0xb7 };
-AVFrame *frame;
-int iFrame;
-
-static int encode(AVFrame *frame)
+// A frame waiting to be encoded: either `frame`, or if that's NULL, a frame
+// filled with `color`.
+struct job {
+	const uint16_t *frame;
+	float color;
+};
+
+struct video {
+	// Only encodeMain touches these once videoStart returns
+	AVCodecContext *ctx;
+	AVPacket *pkt;
+	FILE *outfile;
+	AVCodec *codec;
+	AVFrame *frame;
+	int iFrame;
+
+	// Used for every videoEncodeColor frame. Its luma plane is only
+	// refilled when the color changes; `color` is the current one, or
+	// negative if it hasn't been filled in yet.
+	AVFrame *colorFrame;
+	float color;
+
+	struct luma *luma;
+
+	struct framePool *pool;
+	enum videoPolicy policy;
+	pthread_t thdEncode;
+
+	// A ring of cQueued jobs, starting at jobs[iHead]. Everything from here
+	// down belongs to `mut`.
+	struct job jobs[VIDEO_QUEUE_FRAMES];
+	unsigned int iHead;
+	unsigned int cQueued;
+	pthread_mutex_t mut;
+	pthread_cond_t condNotEmpty;
+	pthread_cond_t condNotFull;
+
+	// set by videoStop once nothing more will be queued
+	bool stopping;
+	// set if encoding any frame failed
+	bool failed;
+
+	struct videoStats stats;
+};
+
+static const uint8_t endcode[] = { 0, 0, 1, 0xb7 };
+
+static int encode(struct video *video, AVFrame *frame)
 {
 	int ret;
 
 	/* send the frame to the encoder */
-	ret = avcodec_send_frame(ctx, frame);
+	ret = avcodec_send_frame(video->ctx, frame);
 	if (ret < 0) {
 		return ret;
 	}
 
 	while (ret >= 0) {
-		ret = avcodec_receive_packet(ctx, pkt);
+		ret = avcodec_receive_packet(video->ctx, video->pkt);
 		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
 			ret = 0;
 			break;
@@ -71,112 +112,250 @@ static int encode(AVFrame *frame)
 			break;
 		}
 
-		int tmp = pkt->size;
+		int tmp = video->pkt->size;
 		assert(tmp > 0);
 		size_t size = (size_t) tmp;
-		fwrite(pkt->data, 1, size, outfile);
-		av_packet_unref(pkt);
+		fwrite(video->pkt->data, 1, size, video->outfile);
+		av_packet_unref(video->pkt);
 	}
 
 	return ret;
 }
 
-static int prepEncode()
+// make sure the frame data is writable
+static int prepEncode(AVFrame *frame)
 {
-	int ret;
-	/* make sure the frame data is writable */
-	ret = av_frame_make_writable(frame);
+	int ret = av_frame_make_writable(frame);
 	if (ret < 0) {
 		return 1;
 	}
 	return 0;
 }
 
-int videoEncodeColor(float tmp)
+static int encodeColor(struct video *video, float tmp)
 {
-	assert(0 <= tmp && tmp <= 1);
-	uint8_t color = (uint8_t) (tmp * UINT8_MAX);
-
+	AVFrame *frame = video->colorFrame;
 	int fail;
 
-	fail = prepEncode();
-	if (fail) {
-		goto DONE;
-	}
+	if (tmp != video->color) {
+		fail = prepEncode(frame);
+		if (fail) {
+			goto DONE;
+		}
 
-	for (int y = 0; y < ctx->height; y++) {
-		for (int x = 0; x < ctx->width; x++) {
-			frame->data[0][y * frame->linesize[0] + x] = color; // Y
+		uint8_t color = (uint8_t) (tmp * UINT8_MAX);
+		for (int y = 0; y < video->ctx->height; y++) {
+			memset(frame->data[0] + y * frame->linesize[0], color, (size_t) video->ctx->width); // Y
 		}
+		video->color = tmp;
 	}
 
-	frame->pts = iFrame;
-	iFrame++;
+	// The encoder takes its own reference to the frame rather than
+	// changing it, so the same plane can be sent again and again.
+	frame->pts = video->iFrame;
+	video->iFrame++;
 
-	fail = encode(frame);
+	fail = encode(video, frame);
 DONE:
 	return fail;
 }
 
-int videoEncodeFrame(uint16_t *data)
+static int encodeFrame(struct video *video, const uint16_t *data)
 {
+	AVFrame *frame = video->frame;
+	size_t width = (size_t) video->ctx->width;
 	int fail;
 
-	fail = prepEncode();
+	fail = prepEncode(frame);
 	if (fail) {
 		goto DONE;
 	}
 
-	// Choosen arbitrarily for one particular situation.
-	uint16_t inputMax = 4000;
+	for (int y = 0; y < video->ctx->height; y++) {
+		lumaConvertRow(video->luma, data + (size_t) y * width,
+			frame->data[0] + y * frame->linesize[0], width); // Y
+	}
+
+	frame->pts = video->iFrame;
+	video->iFrame++;
 
-	for (int y = 0; y < ctx->height; y++) {
-		for (int x = 0; x < ctx->width; x++) {
-			uint16_t value = data[y*ctx->width + x];
+	fail = encode(video, frame);
 
-			// clip to max
-			value = value <= inputMax ? value : inputMax;
+DONE:
+	return fail;
+}
 
-			// scale to uint8_t so that it fits in ffmpeg frame
-			uint8_t small = (uint8_t) (value * ((float) UINT8_MAX / inputMax));
+static void *encodeMain(void *arg)
+{
+	struct video *video = arg;
 
-			// invert colors
-			small = (uint8_t) (UINT8_MAX - small);
+	assert(!pthread_mutex_lock(&video->mut));
+	while (true) {
+		while (!video->cQueued && !video->stopping) {
+			assert(!pthread_cond_wait(&video->condNotEmpty, &video->mut));
+		}
+		if (!video->cQueued) {
+			// stopping, and everything has been encoded
+			break;
+		}
 
-			frame->data[0][y * frame->linesize[0] + x] = small; // Y
+		struct job job = video->jobs[video->iHead];
+		video->iHead = (video->iHead + 1) % VIDEO_QUEUE_FRAMES;
+		video->cQueued--;
+		assert(!pthread_cond_signal(&video->condNotFull));
+		assert(!pthread_mutex_unlock(&video->mut));
+
+		int fail;
+		if (job.frame) {
+			fail = encodeFrame(video, job.frame);
+			framePoolRelease(video->pool, job.frame);
+		} else {
+			fail = encodeColor(video, job.color);
 		}
+
+		assert(!pthread_mutex_lock(&video->mut));
+		video->failed = video->failed || fail;
+		video->stats.cEncoded++;
 	}
+	assert(!pthread_mutex_unlock(&video->mut));
 
-	frame->pts = iFrame;
-	iFrame++;
+	return NULL;
+}
 
-	fail = encode(frame);
+// Queues `job` up for encodeMain, or drops it if the queue is full and the
+// policy allows that
+static int push(struct video *video, struct job job)
+{
+	int fail = 0;
+
+	assert(!pthread_mutex_lock(&video->mut));
+	assert(!video->stopping);
+
+	while (video->cQueued == VIDEO_QUEUE_FRAMES) {
+		if (video->policy == VIDEO_DROP) {
+			video->stats.cDropped++;
+			goto DONE;
+		}
+		assert(!pthread_cond_wait(&video->condNotFull, &video->mut));
+	}
+
+	if (job.frame) {
+		framePoolAddRef(video->pool, job.frame);
+	}
+	video->jobs[(video->iHead + video->cQueued) % VIDEO_QUEUE_FRAMES] = job;
+	video->cQueued++;
+	if (video->cQueued > video->stats.cPeakQueued) {
+		video->stats.cPeakQueued = video->cQueued;
+	}
+	assert(!pthread_cond_signal(&video->condNotEmpty));
 
 DONE:
+	// report failures as soon as possible, even though they happened to
+	// some earlier frame
+	fail = video->failed;
+	assert(!pthread_mutex_unlock(&video->mut));
 	return fail;
 }
 
-int videoStart(char *filename)
+int videoEncodeColor(struct video *video, float tmp)
+{
+	assert(0 <= tmp && tmp <= 1);
+	struct job job = {NULL, tmp};
+	return push(video, job);
+}
+
+int videoEncodeFrame(struct video *video, const uint16_t *data)
+{
+	struct job job = {data, 0};
+	return push(video, job);
+}
+
+struct videoStats videoGetStats(struct video *video)
+{
+	assert(!pthread_mutex_lock(&video->mut));
+	struct videoStats stats = video->stats;
+	stats.cQueued = video->cQueued;
+	assert(!pthread_mutex_unlock(&video->mut));
+	return stats;
+}
+
+// frees everything that videoStart allocated, whether or not it succeeded
+static void freeVideo(struct video *video)
+{
+	if (video->outfile) {
+		fclose(video->outfile);
+	}
+
+	avcodec_free_context(&video->ctx);
+	av_frame_free(&video->frame);
+	av_frame_free(&video->colorFrame);
+	av_packet_free(&video->pkt);
+	if (video->luma) {
+		lumaDestroy(video->luma);
+	}
+	free(video);
+}
+
+// Returns a new black and white frame for `ctx`, or NULL on failure
+static AVFrame *allocFrame(AVCodecContext *ctx)
+{
+	AVFrame *frame = av_frame_alloc();
+	if (!frame) {
+		return NULL;
+	}
+	frame->format = ctx->pix_fmt;
+	frame->width  = ctx->width;
+	frame->height = ctx->height;
+
+	int ret = av_frame_get_buffer(frame, 32);
+	if (ret < 0) {
+		av_frame_free(&frame);
+		return NULL;
+	}
+
+	// note that Cb & Cr have half the dimensions of Y.
+	for (int y = 0; y < ctx->height/2; y++) {
+		// this particular data formate use uint8_t to store data.
+		// using half the maximum value for Cb & Cr makes the image black and white.
+		memset(frame->data[1] + y * frame->linesize[1], UINT8_MAX / 2, (size_t) ctx->width/2); //Cb
+		memset(frame->data[2] + y * frame->linesize[2], UINT8_MAX / 2, (size_t) ctx->width/2); //Cr
+	}
+
+	return frame;
+}
+
+struct video *videoStart(char *filename, size_t width, size_t height,
+	struct lumaMapping mapping, struct framePool *pool, enum videoPolicy policy)
 {
 	int fail;
 
 	char *codec_name = "mpeg2video";
-	iFrame = 0;
-
-	codec = avcodec_find_encoder_by_name(codec_name);
-	if (!codec) {
+	struct video *video = calloc(1, sizeof(*video));
+	assert(video);
+	video->iFrame = 0;
+	video->color = -1;
+	video->luma = lumaInit(mapping);
+	video->pool = pool;
+	video->policy = policy;
+	video->mut = (pthread_mutex_t) PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
+	video->condNotEmpty = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
+	video->condNotFull = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
+
+	video->codec = avcodec_find_encoder_by_name(codec_name);
+	if (!video->codec) {
 		fail = 1;
 		goto DONE;
 	}
 
-	ctx = avcodec_alloc_context3(codec);
+	AVCodecContext *ctx = avcodec_alloc_context3(video->codec);
+	video->ctx = ctx;
 	if (!ctx) {
 		fail = 1;
 		goto DONE;
 	}
 
-	pkt = av_packet_alloc();
-	if (!pkt) {
+	video->pkt = av_packet_alloc();
+	if (!video->pkt) {
 		fail = 1;
 		goto DONE;
 	}
@@ -184,8 +363,6 @@ int videoStart(char *filename)
 	/* put sample parameters */
 	ctx->bit_rate = 400000;
 	/* resolution must be a multiple of two */
-	size_t width = ccameraGetFrameWidth();
-	size_t height = ccameraGetFrameHeight();
 	assert(width < INT_MAX);
 	assert(height < INT_MAX);
 	ctx->width = (int) width;
@@ -206,64 +383,51 @@ int videoStart(char *filename)
 	ctx->pix_fmt = AV_PIX_FMT_YUV420P;
 
 	/* open it */
-	int ret = avcodec_open2(ctx, codec, NULL);
+	int ret = avcodec_open2(ctx, video->codec, NULL);
 	if (ret < 0) {
 		fail = 1;
 		goto DONE;
 	}
 
-	outfile = fopen(filename, "wb");
-	if (!outfile) {
-		fail = 1;
-		goto DONE;
-	}
-
-	frame = av_frame_alloc();
-	if (!frame) {
+	video->outfile = fopen(filename, "wb");
+	if (!video->outfile) {
 		fail = 1;
 		goto DONE;
 	}
-	frame->format = ctx->pix_fmt;
-	frame->width  = ctx->width;
-	frame->height = ctx->height;
 
-	ret = av_frame_get_buffer(frame, 32);
-	if (ret < 0) {
+	video->frame = allocFrame(ctx);
+	video->colorFrame = allocFrame(ctx);
+	if (!video->frame || !video->colorFrame) {
 		fail = 1;
 		goto DONE;
 	}
 
-	// note that Cb & Cr have half the dimensions of Y.
-	for (int y = 0; y < ctx->height/2; y++) {
-		for (int x = 0; x < ctx->width/2; x++) {
-			// this particular data formate use uint8_t to store data.
-			// using half the maximum value for Cb & Cr makes the image black and white.
-			frame->data[1][y * frame->linesize[1] + x] = UINT8_MAX / 2; //Cb
-			frame->data[2][y * frame->linesize[2] + x] = UINT8_MAX / 2; //Cr
-		}
-	}
-
-	fail = 0;
+	fail = pthread_create(&video->thdEncode, NULL, &encodeMain, video);
 DONE:
 	if (fail) {
-		videoStop();
+		freeVideo(video);
+		return NULL;
 	}
-	return fail;
+	return video;
 }
 
-int videoStop()
+int videoStop(struct video *video)
 {
+	assert(!pthread_mutex_lock(&video->mut));
+	video->stopping = true;
+	assert(!pthread_cond_signal(&video->condNotEmpty));
+	assert(!pthread_mutex_unlock(&video->mut));
+	assert(!pthread_join(video->thdEncode, NULL));
+	int fail = video->failed;
+
 	/* flush the encoder */
-	encode(NULL);
+	encode(video, NULL);
 
 	/* add sequence end code to have a real MPEG file */
-	assert(codec->id == AV_CODEC_ID_MPEG2VIDEO);
-	fwrite(endcode, 1, sizeof(endcode), outfile);
-	fclose(outfile);
+	assert(video->codec->id == AV_CODEC_ID_MPEG2VIDEO);
+	fwrite(endcode, 1, sizeof(endcode), video->outfile);
 
-	avcodec_free_context(&ctx);
-	av_frame_free(&frame);
-	av_packet_free(&pkt);
+	freeVideo(video);
 
-	return 0;
+	return fail;
 }
@@ -3,16 +3,57 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdlib.h>
 
-// TODO last: parameterize this, specifing what values are white/black, and how many copies to encode
-int videoEncodeFrame(uint16_t *data);
+#include "framepool.h"
+#include "luma.h"
+
+// One video file being written. Any number of these may be open at once.
+//
+// Encoding happens on a thread of its own. videoEncodeFrame and
+// videoEncodeColor only queue a frame up, so they are cheap no matter how slow
+// the encoder is; what happens when the queue is full depends on the video's
+// policy.
+struct video;
+
+// the most frames that can be waiting to be encoded at once
+#define VIDEO_QUEUE_FRAMES (30 * 2)
+
+enum videoPolicy {
+	// wait for the encoder to catch up, so that every frame makes it into
+	// the video
+	VIDEO_BLOCK,
+	// throw away frames that arrive while the queue is full
+	VIDEO_DROP,
+};
+
+struct videoStats {
+	unsigned long long cEncoded;
+	unsigned long long cDropped;
+	unsigned int cQueued;
+	unsigned int cPeakQueued;
+};
+
+// TODO last: parameterize how many copies to encode
+//
+// `data` must come from the frame pool that was passed to videoStart; the
+// video takes a reference to it until it has been encoded, so the caller must
+// not modify it afterwards.
+int videoEncodeFrame(struct video *video, const uint16_t *data);
 
 // encode a new frame filled with a single color; any float between zero and one
 // (inclusive)
-int videoEncodeColor(float tmp);
+int videoEncodeColor(struct video *video, float tmp);
 
 // TODO: parameterize, FPS
-int videoStart(char *file);
-int videoStop();
+// `mapping` says how depths in videoEncodeFrame frames become brightnesses.
+// Returns NULL on failure.
+struct video *videoStart(char *file, size_t width, size_t height,
+	struct lumaMapping mapping, struct framePool *pool, enum videoPolicy policy);
+// Encodes everything still queued, then closes the file. Returns non-zero if
+// encoding any frame failed.
+int videoStop(struct video *video);
+
+struct videoStats videoGetStats(struct video *video);
 
 #endif
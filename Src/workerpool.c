@@ -0,0 +1,138 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "workerpool.h"
+
+struct worker {
+	struct workerPool *pool;
+	unsigned int iPart;
+	pthread_t thread;
+};
+
+struct workerPool {
+	unsigned int cThreads;
+	// the threads other than the caller's; workers[i] does part i+1
+	struct worker *workers;
+
+	// Everything below is protected by `mut`. Each call to workerPoolRun
+	// increments `generation`, which is how a worker tells a new task from
+	// the one it just finished.
+	pthread_mutex_t mut;
+	pthread_cond_t condStart;
+	pthread_cond_t condDone;
+	unsigned long long generation;
+	workerTask task;
+	void *arg;
+	// the number of workers that haven't finished the current task
+	unsigned int cBusy;
+	bool stopRequested;
+};
+
+static void *workerMain(void *arg)
+{
+	struct worker *worker = arg;
+	struct workerPool *pool = worker->pool;
+	unsigned long long generation = 0;
+
+	assert(!pthread_mutex_lock(&pool->mut));
+	while (true) {
+		while (!pool->stopRequested && pool->generation == generation) {
+			assert(!pthread_cond_wait(&pool->condStart, &pool->mut));
+		}
+		if (pool->stopRequested) {
+			break;
+		}
+		generation = pool->generation;
+		workerTask task = pool->task;
+		void *taskArg = pool->arg;
+		assert(!pthread_mutex_unlock(&pool->mut));
+
+		task(taskArg, worker->iPart, pool->cThreads);
+
+		assert(!pthread_mutex_lock(&pool->mut));
+		if (!--pool->cBusy) {
+			assert(!pthread_cond_signal(&pool->condDone));
+		}
+	}
+	assert(!pthread_mutex_unlock(&pool->mut));
+
+	return NULL;
+}
+
+struct workerPool *workerPoolInit(unsigned int cThreads)
+{
+	assert(cThreads > 0);
+
+	struct workerPool *pool = malloc(sizeof(*pool));
+	assert(pool);
+	pool->cThreads = cThreads;
+	pool->mut = (pthread_mutex_t) PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
+	pool->condStart = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
+	pool->condDone = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
+	pool->generation = 0;
+	pool->task = NULL;
+	pool->arg = NULL;
+	pool->cBusy = 0;
+	pool->stopRequested = false;
+
+	pool->workers = malloc(sizeof(*pool->workers) * (cThreads - 1));
+	assert(pool->workers || cThreads == 1);
+	for (unsigned int ii = 0; ii + 1 < cThreads; ii++) {
+		struct worker *worker = &pool->workers[ii];
+		worker->pool = pool;
+		worker->iPart = ii + 1;
+		int fail = pthread_create(&worker->thread, NULL, &workerMain, worker);
+		assert(!fail);
+	}
+
+	return pool;
+}
+
+void workerPoolDestroy(struct workerPool *pool)
+{
+	assert(!pthread_mutex_lock(&pool->mut));
+	pool->stopRequested = true;
+	assert(!pthread_cond_broadcast(&pool->condStart));
+	assert(!pthread_mutex_unlock(&pool->mut));
+
+	for (unsigned int ii = 0; ii + 1 < pool->cThreads; ii++) {
+		int fail = pthread_join(pool->workers[ii].thread, NULL);
+		assert(!fail);
+	}
+
+	free(pool->workers);
+	free(pool);
+}
+
+unsigned int workerPoolGetSize(struct workerPool *pool)
+{
+	return pool->cThreads;
+}
+
+void workerPoolRun(struct workerPool *pool, workerTask task, void *arg)
+{
+	if (pool->cThreads == 1) {
+		task(arg, 0, 1);
+		return;
+	}
+
+	assert(!pthread_mutex_lock(&pool->mut));
+	assert(!pool->cBusy);
+	pool->task = task;
+	pool->arg = arg;
+	pool->cBusy = pool->cThreads - 1;
+	pool->generation++;
+	assert(!pthread_cond_broadcast(&pool->condStart));
+	assert(!pthread_mutex_unlock(&pool->mut));
+
+	task(arg, 0, pool->cThreads);
+
+	// the barrier: nothing the task wrote is used until every part is done
+	assert(!pthread_mutex_lock(&pool->mut));
+	while (pool->cBusy) {
+		assert(!pthread_cond_wait(&pool->condDone, &pool->mut));
+	}
+	assert(!pthread_mutex_unlock(&pool->mut));
+}
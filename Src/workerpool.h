@@ -0,0 +1,25 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+// A fixed set of threads that split one task at a time between them. The
+// threads are started once and then sleep between tasks, so running a task
+// costs a wake up rather than a thread creation.
+
+// Does part iPart of a task that has been split into cParts parts
+typedef void (*workerTask)(void *arg, unsigned int iPart, unsigned int cParts);
+
+struct workerPool;
+
+// `cThreads` counts the thread that calls workerPoolRun, so a pool of one
+// starts no threads at all.
+struct workerPool *workerPoolInit(unsigned int cThreads);
+void workerPoolDestroy(struct workerPool *pool);
+
+unsigned int workerPoolGetSize(struct workerPool *pool);
+
+// Runs task(arg, i, cThreads) for every i in [0, cThreads), one on each
+// thread. Part 0 runs on the calling thread. Returns once every part has
+// finished. Only one thread may call this at a time.
+void workerPoolRun(struct workerPool *pool, workerTask task, void *arg);
+
+#endif